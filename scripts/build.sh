@@ -4,9 +4,13 @@
 
 # -O2 builds with safe optimizations on
 # -march=native is required to enable AES instructions and allow vector optimizations
+# Set ARCH to build one binary for several hosts, e.g.
+#   ARCH="-march=x86-64-v2 -maes -mpclmul" ./scripts/build.sh
+# VAES kernels are compiled separately and selected at runtime with CPUID
 
 CC="gcc"
-CFLAGS="-Wall -O2 -funroll-loops -march=native -lm -lpthread -lOpenCL -lgcrypt"
+ARCH="${ARCH:--march=native}"
+CFLAGS="-Wall -O2 -funroll-loops ${ARCH} -lm -lpthread -lOpenCL -lgcrypt"
 
 SRC_DIR="src"
 INCLUDE_DIR="src/include"
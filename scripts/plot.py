@@ -1,6 +1,9 @@
 #!/usr/bin/env python3
 
-# Raw data from run_bench.py output
+# Plots the JSON written by run_bench.py:
+#     ./scripts/plot.py results/bench.json [more.json ...]
+# With no arguments, plots the 2020 snapshots below, which are mean
+# milliseconds over 10 runs of the whole process at 4 threads.
 
 data_laptop = {
     'bench_cl':
@@ -207,28 +210,68 @@ data_aws = {
          8589934592: 71246.89045}}
 
 
+import json
+import sys
+from typing import Dict, List, Tuple
+
 import matplotlib.pyplot as plt
 
+MARKERS: List[str] = ["bo", "g^", "rs", "kx", "mD", "cv", "y<", "k>"]
+
+LABELS: Dict[str, str] = {"bench_cpu": "Custom C",
+                          "bench_cl": "OpenCL/GPU",
+                          "bench_ni": "AES-NI",
+                          "bench_gcrypt": "gcrypt"}
+
+
+def plot_snapshot(name: str, data: Dict[str, Dict[int, float]]) -> None:
+    plt.figure()
+    for marker, (program, times) in zip(MARKERS, data.items()):
+        plt.loglog(list(times.keys()), list(times.values()), marker,
+                   label=LABELS.get(program, program))
+
+    plt.legend()
+    plt.xlabel("File Size (bytes)")
+    plt.ylabel("Average time to encrypt across 10 executions (msec)")
+    plt.title(f"Runtime Comparison for AES-128 Encryption Implementations ({name})")
+
+
+def plot_results(filename: str) -> None:
+    with open(filename) as json_file:
+        data = json.load(json_file)
+
+    # One series per program, options and thread count
+    series: Dict[Tuple[str, str, int], List[Dict]] = {}
+    for result in data["results"]:
+        key = (result["program"], " ".join(result["args"]), result["threads"])
+        series.setdefault(key, []).append(result)
+
+    plt.figure()
+    for marker, ((program, args, threads), results) in zip(MARKERS, series.items()):
+        results.sort(key=lambda result: result["size"])
+        sizes = [result["size"] for result in results]
+        medians = [result["median_ns"]/10**6 for result in results]
+
+        # Error bars run from the median up to the 95th percentile
+        upper = [(result["p95_ns"] - result["median_ns"])/10**6 for result in results]
+        label = f"{LABELS.get(program, program)} {args} ({threads} threads)"
+        plt.errorbar(sizes, medians, yerr=[[0]*len(upper), upper],
+                     fmt=marker, label=label.replace("  ", " "))
+
+    plt.xscale("log")
+    plt.yscale("log")
+    plt.legend()
+    plt.xlabel("File Size (bytes)")
+    plt.ylabel(f"Median {results[0]['metric']} time, to p95 (msec)")
+    plt.title(f"AES Encryption on {data['host']['host']} ({data['host']['cpu']})")
+
+
 if __name__ == "__main__":
-    datas = {"Laptop": data_laptop, "AWS": data_aws}
-    
-    for name, data in datas.items():
-        sizes = list(data["bench_cl"].keys())
-        cl_times = list(data["bench_cl"].values())
-        cpu_times = list(data["bench_cpu"].values())
-        ni_times = list(data["bench_ni"].values())
-        gcrypt_times = list(data["bench_gcrypt"].values())
-
-        plt.figure()
-        plt.loglog(sizes, cpu_times, "bo",
-                sizes, cl_times, "g^",
-                sizes, ni_times, "rs",
-                sizes, gcrypt_times, "kx")
-        
-        plt.legend(["Custom C", "OpenCL/GPU", "AES-NI", "gcrypt"])
-
-        plt.xlabel("File Size (bytes)")
-        plt.ylabel("Average time to encrypt across 10 executions (msec)");
-        plt.title(f"Runtime Comparison for AES-128 Encryption Implementations ({name})")
-        
-        plt.show()
+    if len(sys.argv) > 1:
+        for filename in sys.argv[1:]:
+            plot_results(filename)
+    else:
+        for name, data in {"Laptop": data_laptop, "AWS": data_aws}.items():
+            plot_snapshot(name, data)
+
+    plt.show()
@@ -1,11 +1,36 @@
 #!/usr/bin/env python3
 
-from statistics import mean
-from subprocess import run
-from time import time_ns
-from typing import Dict, List
+# Runs the benchmarks and writes the statistics to JSON and CSV for plot.py
+#
+# Each (program, thread count, file size) case gets a few warm-up runs that
+# are thrown away, then at least --min-runs timed runs.  More runs are added
+# until the confidence interval of the mean is within --ci of the mean, or
+# until --max-runs.  Outliers (outside Tukey's fences, 1.5 IQR beyond the
+# quartiles) are reported and left out of the statistics.
+#
+# Times come from the binaries' own phase=... lines by default, so process
+# and OpenCL startup are not counted; --metric wall times the whole process.
+#
+# --save-baseline stores the results as this host's baseline, in
+# baselines/<host>.json.  --check compares them with that baseline and
+# exits with status 1 if any case got slower by more than both --tolerance
+# and the noise of the two measurements (their combined CI half-widths).
+# --results checks or saves an earlier results JSON instead of running.
 
-ITERATIONS: int = 10
+import argparse
+import csv
+import json
+import os
+import platform
+import re
+import socket
+import sys
+from datetime import datetime, timezone
+from math import sqrt
+from statistics import NormalDist, mean, median, stdev
+from subprocess import run
+from time import perf_counter_ns
+from typing import Dict, List, Optional, Tuple
 
 FILE_SIZES: Dict[str, int] = {
     "1K": 2**10,
@@ -36,39 +61,332 @@ FILE_SIZES: Dict[str, int] = {
 
 PROGRAMS: List[str] = ["bench_cpu", "bench_cl", "bench_gcrypt", "bench_ni"]
 
+PHASES: List[str] = ["setup", "key_expansion", "io_map", "encrypt", "teardown", "total"]
+
+PHASE_LINE = re.compile(r"^phase=(\w+) ns=(\d+) cycles=(\d+) bytes=(\d+)", re.MULTILINE)
+
+CSV_FIELDS: List[str] = ["host", "program", "args", "threads", "size", "metric",
+                         "runs", "outliers", "median_ns", "p95_ns", "mean_ns",
+                         "stddev_ns", "ci_ns", "min_ns", "max_ns",
+                         "gb_per_s", "cycles_per_byte"]
+
+
+def host_info() -> Dict[str, str]:
+    cpu = platform.processor()
+    try:
+        with open("/proc/cpuinfo") as cpuinfo:
+            for line in cpuinfo:
+                if line.startswith("model name"):
+                    cpu = line.split(":", 1)[1].strip()
+                    break
+    except OSError:
+        pass
+
+    return {"host": socket.gethostname(),
+            "cpu": cpu,
+            "kernel": platform.release(),
+            "cpus": str(os.cpu_count())}
+
+
+def t_quantile(p: float, df: int) -> float:
+    # Cornish-Fisher expansion of Student's t about the normal quantile;
+    # close enough for the degrees of freedom used here (4 and up)
+    z = NormalDist().inv_cdf(p)
+    return (z
+            + (z**3 + z)/(4*df)
+            + (5*z**5 + 16*z**3 + 3*z)/(96*df**2)
+            + (3*z**7 + 19*z**5 + 17*z**3 - 15*z)/(384*df**3))
+
+
+def percentile(samples: List[float], fraction: float) -> float:
+    # Linear interpolation between the closest ranks
+    ordered = sorted(samples)
+    position = fraction*(len(ordered) - 1)
+    low = int(position)
+    high = min(low + 1, len(ordered) - 1)
+    return ordered[low] + (ordered[high] - ordered[low])*(position - low)
+
+
+def split_outliers(samples: List[float]) -> Tuple[List[float], List[float]]:
+    if len(samples) < 4:
+        return samples, []
+
+    q1 = percentile(samples, 0.25)
+    q3 = percentile(samples, 0.75)
+    fence = 1.5*(q3 - q1)
+    kept = [s for s in samples if q1 - fence <= s <= q3 + fence]
+    outliers = [s for s in samples if not q1 - fence <= s <= q3 + fence]
+    return kept, outliers
+
+
+def ci_half_width(samples: List[float], confidence: float) -> float:
+    if len(samples) < 2:
+        return float("inf")
+    t = t_quantile(0.5 + confidence/2, len(samples) - 1)
+    return t*stdev(samples)/sqrt(len(samples))
+
+
+def run_once(command: List[str], metric: str) -> Tuple[float, Dict[str, Dict[str, int]]]:
+    start_time: int = perf_counter_ns()
+    result = run(command, capture_output=True, text=True)
+    run_time: int = perf_counter_ns() - start_time
+
+    if result.returncode != 0:
+        raise RuntimeError(f"{' '.join(command)} failed:\n{result.stdout}{result.stderr}")
+
+    phases: Dict[str, Dict[str, int]] = {}
+    for name, ns, cycles, processed in PHASE_LINE.findall(result.stdout):
+        phases[name] = {"ns": int(ns), "cycles": int(cycles), "bytes": int(processed)}
+
+    if metric == "wall":
+        return run_time, phases
+    if metric not in phases:
+        raise RuntimeError(f"{command[0]} printed no phase={metric} line; "
+                           "rebuild it, or use --metric wall")
+    return phases[metric]["ns"], phases
+
+
+def measure(command: List[str], args: argparse.Namespace) -> Dict:
+    for _ in range(args.warmup):
+        run_once(command, args.metric)
+
+    samples: List[float] = []
+    phase_samples: Dict[str, List[Dict[str, int]]] = {}
+    while len(samples) < args.max_runs:
+        sample, phases = run_once(command, args.metric)
+        samples.append(sample)
+        for name, values in phases.items():
+            phase_samples.setdefault(name, []).append(values)
+
+        if len(samples) >= args.min_runs:
+            kept, _ = split_outliers(samples)
+            if ci_half_width(kept, args.confidence) <= args.ci*mean(kept):
+                break
+
+    kept, outliers = split_outliers(samples)
+
+    # Per-phase medians, to see where the time goes
+    phases = {}
+    for name, values in phase_samples.items():
+        phases[name] = {"median_ns": median(v["ns"] for v in values),
+                        "median_cycles": median(v["cycles"] for v in values),
+                        "bytes": values[0]["bytes"]}
+
+    return {"runs": len(samples),
+            "samples_ns": samples,
+            "outliers_ns": outliers,
+            "median_ns": median(kept),
+            "p95_ns": percentile(kept, 0.95),
+            "mean_ns": mean(kept),
+            "stddev_ns": stdev(kept) if len(kept) > 1 else 0.0,
+            "ci_ns": ci_half_width(kept, args.confidence),
+            "min_ns": min(kept),
+            "max_ns": max(kept),
+            "phases": phases}
+
+
+def summary_row(host: str, result: Dict) -> Dict[str, object]:
+    row: Dict[str, object] = {field: result.get(field) for field in CSV_FIELDS}
+    row["host"] = host
+    row["args"] = " ".join(result["args"])
+    row["outliers"] = len(result["outliers_ns"])
+
+    # With -r the binaries encrypt more than size; they report how much.
+    # Bytes per nanosecond is GB/s.
+    phase: Dict = result["phases"].get(result["metric"], {})
+    processed: int = phase.get("bytes", result["size"])
+    row["gb_per_s"] = processed/result["median_ns"] if result["median_ns"] else None
+    cycles: Optional[float] = phase.get("median_cycles")
+    row["cycles_per_byte"] = cycles/processed if cycles is not None else None
+    return row
+
+
+def parse_size(size: str) -> int:
+    # Same suffixes as the binaries' -S
+    multipliers = {"K": 2**10, "M": 2**20, "G": 2**30}
+    if size[-1:] in multipliers:
+        return int(size[:-1])*multipliers[size[-1]]
+    return int(size)
+
+
+def case_key(result: Dict) -> str:
+    # Baselines hold one entry per case, e.g. "bench_ni -m gcm|4|67108864|encrypt"
+    program = " ".join([result["program"], *result["args"]])
+    return f"{program}|{result['threads']}|{result['size']}|{result['metric']}"
+
+
+def baseline_path(baseline_dir: str, host: Dict[str, str]) -> str:
+    name = re.sub(r"[^A-Za-z0-9_.-]", "_", host["host"])
+    return os.path.join(baseline_dir, f"{name}.json")
+
+
+def save_baseline(path: str, host: Dict[str, str], results: List[Dict]) -> None:
+    # New results replace the cases they cover and leave the others
+    baseline: Dict = {"host": host, "cases": {}}
+    if os.path.exists(path):
+        with open(path) as json_file:
+            baseline = json.load(json_file)
+    baseline["host"] = host
+
+    for result in results:
+        entry = {field: result[field] for field in ["median_ns", "p95_ns", "ci_ns", "runs"]}
+        entry["date"] = datetime.now(timezone.utc).isoformat()
+        baseline["cases"][case_key(result)] = entry
+
+    os.makedirs(os.path.dirname(path) or ".", exist_ok=True)
+    with open(path, "w") as json_file:
+        json.dump(baseline, json_file, indent=2, sort_keys=True)
+    print(f"Saved {len(results)} cases to {path}")
+
+
+def check_baseline(path: str, results: List[Dict], tolerance: float) -> bool:
+    # Returns False if any case is slower than its baseline beyond the noise
+    if not os.path.exists(path):
+        print(f"No baseline at {path}; make one with --save-baseline")
+        return False
+    with open(path) as json_file:
+        cases: Dict[str, Dict] = json.load(json_file)["cases"]
+
+    print(f"{'case':<44} {'baseline':>12} {'current':>12} {'change':>8} {'limit':>8}")
+    ok = True
+    for result in results:
+        key = case_key(result)
+        base = cases.get(key)
+        program, threads, size, _ = key.split("|")
+        name = f"{program} t={threads} {int(size)} B"
+        if base is None:
+            print(f"{name:<44} {'-':>12} {result['median_ns']/10**6:>10.3f}ms {'':>8} {'':>8}  new")
+            continue
+
+        # Slower is positive; the limit is the larger of the tolerance and
+        # the two CIs combined, since either run may be off by its CI
+        change = result["median_ns"]/base["median_ns"] - 1
+        noise = sqrt(base["ci_ns"]**2 + result["ci_ns"]**2)/base["median_ns"]
+        limit = max(tolerance, noise)
+        status = "ok"
+        if change > limit:
+            status = "REGRESSION"
+            ok = False
+        elif change < -limit:
+            status = "faster"
+
+        print(f"{name:<44} {base['median_ns']/10**6:>10.3f}ms {result['median_ns']/10**6:>10.3f}ms "
+              f"{change:>+8.1%} {limit:>8.1%}  {status}")
+
+    return ok
+
+
+def parse_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser(description="Times the bench_* binaries")
+    parser.add_argument("--programs", nargs="+", default=PROGRAMS,
+                        help="binaries in bin/ to run")
+    parser.add_argument("--threads", nargs="+", type=int, default=[4],
+                        help="thread counts to run each program with")
+    parser.add_argument("--sizes", nargs="+", default=list(FILE_SIZES), metavar="SIZE",
+                        help="input files from scripts/make_inputs.sh, e.g. 1K 64M, "
+                             "or with --synthetic any size, e.g. 16 48 3K")
+    parser.add_argument("--synthetic", action="store_true",
+                        help="encrypt generated data in memory (-S) instead of files")
+    parser.add_argument("--args", default="",
+                        help="extra options for every program, e.g. \"-m gcm -p\"")
+    parser.add_argument("--metric", default="encrypt", choices=PHASES + ["wall"],
+                        help="phase to time, or wall for the whole process")
+    parser.add_argument("--warmup", type=int, default=2,
+                        help="untimed runs before each case")
+    parser.add_argument("--min-runs", type=int, default=5,
+                        help="timed runs before the CI is checked (at least 2)")
+    parser.add_argument("--max-runs", type=int, default=50)
+    parser.add_argument("--ci", type=float, default=0.02,
+                        help="stop once the CI half-width is this fraction of the mean")
+    parser.add_argument("--confidence", type=float, default=0.95)
+    parser.add_argument("--output", default="results/bench",
+                        help="writes OUTPUT.json and OUTPUT.csv")
+    parser.add_argument("--results",
+                        help="use this results JSON instead of running anything")
+    parser.add_argument("--baseline-dir", default="baselines")
+    parser.add_argument("--save-baseline", action="store_true",
+                        help="store the results as this host's baseline")
+    parser.add_argument("--check", action="store_true",
+                        help="exit with status 1 if a case is slower than the baseline")
+    parser.add_argument("--tolerance", type=float, default=0.05,
+                        help="smallest slowdown (a fraction) that counts as a regression")
+    return parser.parse_args()
+
+
+def run_cases(args: argparse.Namespace, host: Dict[str, str]) -> List[Dict]:
+    results: List[Dict] = []
+    extra_args: List[str] = args.args.split()
+
+    for program in args.programs:
+        for threads in args.threads:
+            for filename in args.sizes:
+                if args.synthetic:
+                    size = parse_size(filename)
+                    command = [f"bin/{program}", *extra_args,
+                               "-S", filename, str(threads)]
+                else:
+                    size = FILE_SIZES[filename]
+                    command = [f"bin/{program}", *extra_args,
+                               f"input/{filename}.bin", "output/out.bin", str(threads)]
+
+                result = {"program": program,
+                          "args": extra_args,
+                          "threads": threads,
+                          "size": size,
+                          "metric": args.metric}
+                result.update(measure(command, args))
+                results.append(result)
+
+                print(f"{program} threads={threads} size={filename}: "
+                      f"median {result['median_ns']/10**6:.3f} ms, "
+                      f"p95 {result['p95_ns']/10**6:.3f} ms, "
+                      f"+/- {result['ci_ns']/10**6:.3f} ms over {result['runs']} runs "
+                      f"({len(result['outliers_ns'])} outliers)")
+
+    os.makedirs(os.path.dirname(args.output) or ".", exist_ok=True)
+    with open(f"{args.output}.json", "w") as json_file:
+        json.dump({"host": host,
+                   "date": datetime.now(timezone.utc).isoformat(),
+                   "confidence": args.confidence,
+                   "unit": "ns",
+                   "results": results},
+                  json_file, indent=2)
+
+    with open(f"{args.output}.csv", "w", newline="") as csv_file:
+        writer = csv.DictWriter(csv_file, fieldnames=CSV_FIELDS)
+        writer.writeheader()
+        for result in results:
+            writer.writerow(summary_row(host["host"], result))
+
+    print(f"Wrote {args.output}.json and {args.output}.csv")
+    return results
+
+
 def main() -> None:
-    raw_timing_ns: Dict[str, Dict[int, List[int]]] = {}
-    
-    for iteration in range(ITERATIONS):
-        for program in PROGRAMS:
-            if not raw_timing_ns.get(program):
-                raw_timing_ns[program] = {}
-        
-            for filename, size in FILE_SIZES.items():
-                if not raw_timing_ns[program].get(size):
-                    raw_timing_ns[program][size] = []
-
-                start_time: int = time_ns()
-                
-                # Run program in 4 threads
-                run([f"bin/{program}", f"input/{filename}.bin", "output/out.bin", "4"])
-                
-                run_time: int = time_ns() - start_time
-                
-                raw_timing_ns[program][size].append(run_time)
-                
-                print(f"Finished iteration {iteration} of {program} at size {size}")
-    
-    timing_ms: Dict[str, Dict[str, float]] = {}
-    
-    for program in PROGRAMS:
-        timing_ms[program] = {}
-        
-        for size in FILE_SIZES.values():
-            timing_ms[program][size] = mean(raw_timing_ns[program][size])/10**6
-    
-    print(timing_ms)
-                
-                
+    args = parse_args()
+    args.min_runs = max(args.min_runs, 2)
+    args.max_runs = max(args.max_runs, args.min_runs)
+    if not args.synthetic:
+        unknown = [size for size in args.sizes if size not in FILE_SIZES]
+        if unknown:
+            sys.exit(f"No input files for sizes {' '.join(unknown)}; "
+                     f"choose from {' '.join(FILE_SIZES)} or use --synthetic")
+
+    if args.results:
+        with open(args.results) as json_file:
+            data = json.load(json_file)
+        host = data["host"]
+        results = data["results"]
+    else:
+        host = host_info()
+        results = run_cases(args, host)
+
+    path = baseline_path(args.baseline_dir, host)
+    if args.check and not check_baseline(path, results, args.tolerance):
+        sys.exit(1)
+    if args.save_baseline:
+        save_baseline(path, host, results)
+
+
 if __name__ == "__main__":
     main()
@@ -1,40 +1,259 @@
+#define _GNU_SOURCE     // For CPU affinity in thread_pool.h
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <getopt.h>
+
 #define CL_TARGET_OPENCL_VERSION 220
 
 #include <CL/cl.h>
 
 #include "include/aes_cpu.h"   // For KeyExpansion
+#include "include/cl_cache.h"
+#include "include/cl_pipeline.h"
+#include "include/cl_tuner.h"
 #include "include/file_utils.h"
-
-// Arbitrary size
-const size_t MAX_BIN_SIZE = 262144;
+#include "include/page_stats.h"
+#include "include/perf_counters.h"
+#include "include/phase_timer.h"
+#include "include/synthetic.h"
 
 int main(int argc, char** argv)
 {
+    phase_timer_t timer;
+    phase_timer_start(&timer, PHASE_SETUP);
+    
     // Take input from files (provided at command line)
     aes_file_t input;
     aes_file_t output;
     memset(&input, 0, sizeof(input));
     memset(&output, 0, sizeof(output));
-    if (argc < 3)
+    
+    // Options may appear anywhere; getopt moves them ahead of the filenames
+    uint16_t key_bits = 128;
+    size_t synthetic_bytes = 0;         /* -S, 0 to use files */
+    size_t synthetic_align = 0;         /* -A, 0 for CACHE_LINE_SIZE */
+    int synthetic_node = SYNTHETIC_NO_NODE; /* -N */
+    long repeat = 1;                    /* -r */
+    size_t buffer_sets = 1;             /* -P, 1 to run batches serially */
+    size_t batch_bytes = 0;             /* -B, 0 for the default */
+    const char* p_transfer = "auto";    /* -T */
+    kernel_config_t config = {KERNEL_SBOX, 0, 0};   /* -k, -L, -W */
+    bool config_given = false;          /* Any of -k, -L and -W */
+    bool tune = false;                  /* -t */
+    bool count_events = false;          /* -e */
+    unsigned map_hints = MAP_HINT_NONE; /* -M */
+    bool report_pages = false;          /* -M */
+    int opt;
+    while ((opt = getopt(argc, argv, "b:ek:r:tA:B:L:M:N:P:S:T:W:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'A':
+                synthetic_align = parse_size(optarg);
+                if (synthetic_align < CACHE_LINE_SIZE ||
+                    (synthetic_align & (synthetic_align - 1)) != 0)
+                {
+                    printf("Alignment must be a power of two of at least %d bytes\n",
+                           CACHE_LINE_SIZE);
+                    print_usage_and_cleanup(&input, &output);
+                }
+                break;
+            case 'B':
+                batch_bytes = parse_size(optarg);
+                if (batch_bytes < sizeof(block_vector_t))
+                {
+                    printf("Batch must be at least one block\n");
+                    print_usage_and_cleanup(&input, &output);
+                }
+                break;
+            case 'b':
+                key_bits = parse_key_bits(optarg);
+                if (key_bits == 0)
+                {
+                    print_usage_and_cleanup(&input, &output);
+                }
+                break;
+            case 'e':
+                count_events = true;
+                break;
+            case 'k':
+                config_given = true;
+                if (strcmp(optarg, "sbox") == 0)
+                {
+                    config.variant = KERNEL_SBOX;
+                }
+                else if (strcmp(optarg, "ttable") == 0)
+                {
+                    config.variant = KERNEL_TTABLE;
+                }
+                else
+                {
+                    print_usage_and_cleanup(&input, &output);
+                }
+                break;
+            case 'L':
+                config_given = true;
+                config.local_size = (size_t) strtoul(optarg, NULL, 10);
+                if (config.local_size == 0)
+                {
+                    printf("Work-group size is not a positive number\n");
+                    print_usage_and_cleanup(&input, &output);
+                }
+                break;
+            case 'M':
+                map_hints = parse_map_hints(optarg);
+                if (map_hints == MAP_HINT_INVALID)
+                {
+                    print_usage_and_cleanup(&input, &output);
+                }
+                report_pages = true;
+                break;
+            case 'N':
+                synthetic_node = (int) strtol(optarg, NULL, 10);
+                if (synthetic_node < 0 || synthetic_node >= SYNTHETIC_MAX_NODES)
+                {
+                    printf("NUMA node must be from 0 to %d\n", SYNTHETIC_MAX_NODES - 1);
+                    print_usage_and_cleanup(&input, &output);
+                }
+                break;
+            case 'P':
+                buffer_sets = (size_t) strtoul(optarg, NULL, 10);
+                if (buffer_sets < 1 || buffer_sets > CL_MAX_BUFFER_SETS)
+                {
+                    printf("Buffer sets must be from 1 to %d\n",
+                           CL_MAX_BUFFER_SETS);
+                    print_usage_and_cleanup(&input, &output);
+                }
+                break;
+            case 'r':
+                repeat = strtol(optarg, NULL, 10);
+                if (repeat < 1)
+                {
+                    printf("Repeat count is not a positive number\n");
+                    print_usage_and_cleanup(&input, &output);
+                }
+                break;
+            case 'S':
+                synthetic_bytes = parse_size(optarg);
+                if (synthetic_bytes == 0)
+                {
+                    printf("Size must be a positive number of bytes\n");
+                    print_usage_and_cleanup(&input, &output);
+                }
+                break;
+            case 'T':
+                p_transfer = optarg;
+                break;
+            case 't':
+                tune = true;
+                break;
+            case 'W':
+                config_given = true;
+                config.blocks_per_item = (cl_uint) strtoul(optarg, NULL, 10);
+                if (config.blocks_per_item == 0)
+                {
+                    printf("Blocks per work-item is not a positive number\n");
+                    print_usage_and_cleanup(&input, &output);
+                }
+                break;
+            default:
+                print_usage_and_cleanup(&input, &output);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    
+    if (synthetic_bytes == 0 &&
+        (synthetic_align != 0 || synthetic_node != SYNTHETIC_NO_NODE))
+    {
+        printf("-A and -N need -S\n");
+        print_usage_and_cleanup(&input, &output);
+    }
+    if (config.blocks_per_item > 0 && config.variant != KERNEL_TTABLE)
     {
+        printf("-W needs -k ttable\n");
         print_usage_and_cleanup(&input, &output);
     }
-    open_files(argv[1], argv[2], &input, &output);
+    if (synthetic_align == 0)
+    {
+        synthetic_align = CACHE_LINE_SIZE;
+    }
+    
+    if (synthetic_bytes == 0 && argc < 2)
+    {
+        print_usage_and_cleanup(&input, &output);
+    }
+    
+    // Started before the files are mapped, to count MAP_POPULATE's faults.
+    // Threads the runtime starts later are counted too.
+    page_stats_t page_stats;
+    if (report_pages)
+    {
+        page_stats_start(&page_stats);
+    }
+    
+    phase_timer_switch(&timer, PHASE_IO_MAP);
+    synthetic_t synthetic;
+    if (synthetic_bytes > 0)
+    {
+        open_synthetic(synthetic_bytes,
+                       synthetic_align,
+                       synthetic_node,
+                       map_hints,
+                       &synthetic,
+                       &input,
+                       &output);
+    }
+    else
+    {
+        open_files(argv[0], argv[1], &input, &output, map_hints);
+    }
+    phase_timer_switch(&timer, PHASE_SETUP);
     
     // Set up the OpenCL environment
     cl_int err;
     cl_platform_id platform;
-    clGetPlatformIDs(1, &platform, NULL);
     cl_device_id device;
-    clGetDeviceIDs(platform,
-                   CL_DEVICE_TYPE_GPU,
-                   1,
-                   &device,
-                   NULL);
+    
+    // Prefer a GPU, but take whatever the platform has (e.g. PoCL on a CPU)
+    if (clGetPlatformIDs(1, &platform, NULL) != CL_SUCCESS ||
+        (clGetDeviceIDs(platform,
+                        CL_DEVICE_TYPE_GPU,
+                        1,
+                        &device,
+                        NULL) != CL_SUCCESS &&
+         clGetDeviceIDs(platform,
+                        CL_DEVICE_TYPE_ALL,
+                        1,
+                        &device,
+                        NULL) != CL_SUCCESS))
+    {
+        printf("No OpenCL device found\n");
+        exit(1);
+    }
+    
+    // Options given on the command line win over the device's profile
+    tuning_profile_t profile;
+    unsigned batch_divisor = 0;
+    if (!tune && load_tuning_profile(CL_PROFILE_PATH, device, &profile))
+    {
+        config = config_given ? config : profile.config;
+        batch_divisor = profile.batch_divisor;
+        printf("profile=%s\n", CL_PROFILE_PATH);
+    }
+    
+    // Buffers over the files need every batch to start on a page
+    int transfer = parse_transfer(p_transfer, device, &input, &output);
+    if (transfer < 0)
+    {
+        printf("Transfer must be auto, copy or zero\n");
+        print_usage_and_cleanup(&input, &output);
+    }
+    printf("transfer=%s\n", transfer_name(transfer));
+    
     cl_context context;
     context = clCreateContext(NULL,
                               1,
@@ -42,61 +261,54 @@ int main(int argc, char** argv)
                               NULL,
                               NULL,
                               NULL);
-    cl_command_queue queue = clCreateCommandQueueWithProperties(context,
-                                                                device,
-                                                                0,
-                                                                NULL);
     
-    // Now we need to load the OpenCL binary
-    char filename[] = "bin/aes_cl.bin";
-    int fd = open(filename, O_RDONLY);
-    if (!fd)
+    // Load the program from the binary cache, or build it on a miss
+    cl_program program = get_program(context, device, false);
+    if (program == NULL)
     {
-        printf("Failed to open OpenCL binary.\n");
+        printf("Failed to build the OpenCL program\n");
         exit(1);
     }
-    unsigned char* binary = malloc(MAX_BIN_SIZE);
-    ssize_t bin_size = read(fd, binary, MAX_BIN_SIZE);
-    if (bin_size < 0)
-    {
-        printf("Error reading OpenCL binary\n");
-        exit(1);
-    }
-    else if (bin_size == MAX_BIN_SIZE)
-    {
-        printf("OpenCL binary was maximum length\n");
-        exit(1);
-    }
-    close(fd);
-    
-    // Build the binary into a kernel
-    size_t bin_size_u = (size_t) bin_size;
-    cl_int bin_status;
-    cl_program program = clCreateProgramWithBinary(context,
-                                                   1,
-                                                   &device,
-                                                   &bin_size_u,
-                                                   (const unsigned char**) &binary,
-                                                   &bin_status,
-                                                   &err);
-    clBuildProgram(program, 1, &device, "-Isrc/include", NULL, NULL);
-    cl_kernel kernel = clCreateKernel(program, "AesCipher128", &err);
-    free(binary);
     
-    if (err)
+    // Each key size and variant has its own kernel.  Tuning tries them all.
+    cl_kernel kernels[KERNEL_VARIANT_COUNT] = {NULL};
+    for (int variant = 0; variant < KERNEL_VARIANT_COUNT; ++variant)
     {
-        printf("Error in clCreateKernel: %d\n", err);
+        if (!tune && variant != (int) config.variant)
+        {
+            continue;
+        }
+        
+        char kernel_name[] = "AesCipher128TTable";
+        snprintf(kernel_name,
+                 sizeof(kernel_name),
+                 "AesCipher%u%s",
+                 key_bits,
+                 kernel_variant_suffixes[variant]);
+        kernels[variant] = clCreateKernel(program, kernel_name, &err);
+        if (err)
+        {
+            printf("Error in clCreateKernel: %d\n", err);
+            exit(1);
+        }
     }
     
     // Hardcoded key
-    aes_key_t key = { .b = {0x2b, 0x7e, 0x15, 0x16,
-                            0x28, 0xae, 0xd2, 0xa6,
-                            0xab, 0xf7, 0x15, 0x88,
-                            0x09, 0xcf, 0x4f, 0x3c}};
+    // Shorter keys use the leading bytes
+    cipher_key_t key = { .b = {0x2b, 0x7e, 0x15, 0x16,
+                               0x28, 0xae, 0xd2, 0xa6,
+                               0xab, 0xf7, 0x15, 0x88,
+                               0x09, 0xcf, 0x4f, 0x3c,
+                               0x1f, 0x35, 0x2c, 0x07,
+                               0x3b, 0x61, 0x08, 0xd7,
+                               0x2d, 0x98, 0x10, 0xa3,
+                               0x09, 0x14, 0xdf, 0xf4}};
     
     // Expand keys
+    phase_timer_switch(&timer, PHASE_KEY_EXPANSION);
     key_schedule_t key_sched;
-    KeyExpansion(&key, &key_sched);
+    KeyExpansion(&key, &key_sched, key_bits);
+    phase_timer_switch(&timer, PHASE_SETUP);
     
     // The maximum memory allocation provides an upper limit on the
     // amount of operations which can be done in a single batch
@@ -106,104 +318,156 @@ int main(int argc, char** argv)
                     sizeof(max_alloc_bytes),
                     &max_alloc_bytes,
                     NULL);
-    size_t max_alloc_blocks = max_alloc_bytes /
-                              sizeof(block_vector_t);
-    
-    // Allocate only as much memory as we need or are allowed to
-    size_t alloc_size_blocks = 
-        input.size_blocks < max_alloc_blocks ?
-        input.size_blocks :
-        max_alloc_blocks;
-    
-    // Set up memory for OpenCL
-    cl_mem d_input = clCreateBuffer(context,
-                                    CL_MEM_READ_ONLY,
-                                    alloc_size_blocks*sizeof(block_vector_t),
-                                    NULL,
-                                    NULL);
-    cl_mem d_output = clCreateBuffer(context,
-                                     CL_MEM_WRITE_ONLY,
-                                     alloc_size_blocks*sizeof(block_vector_t),
-                                     NULL,
-                                     NULL);
+    
+    // Set up memory for OpenCL.  The key schedule is copied in here, as it
+    // is the same for every batch.
     cl_mem d_key_schedule = clCreateBuffer(context,
-                                           CL_MEM_READ_ONLY,
+                                           CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
                                            sizeof(key_sched),
-                                           NULL,
+                                           &key_sched,
                                            NULL);
-
-    // Only need to write the key schedule one time
-    clEnqueueWriteBuffer(queue,
-                         d_key_schedule,
-                         CL_FALSE,
-                         0,
-                         sizeof(key_sched),
-                         &key_sched,
-                         0,
-                         NULL,
-                         NULL);
-    
-    uint64_t current_offset_blocks = 0;
-    while (current_offset_blocks < input.size_blocks)
-    {
-        size_t operation_size =
-            input.size_blocks - current_offset_blocks < max_alloc_blocks ?
-            input.size_blocks - current_offset_blocks :
-            max_alloc_blocks;
-        
-        // Copy batch-specific input to OpenCL
-        clEnqueueWriteBuffer(queue,
-                             d_input,
-                             CL_FALSE,
-                             0,
-                             operation_size*sizeof(block_vector_t),
-                             input.p_data + current_offset_blocks,
-                             0,
-                             NULL,
-                             NULL);
+    
+    if (tune)
+    {
+        if (!tune_pipeline(context,
+                           device,
+                           kernels,
+                           d_key_schedule,
+                           transfer,
+                           buffer_sets,
+                           max_alloc_bytes,
+                           &input,
+                           &output,
+                           &profile))
+        {
+            printf("No configuration could run\n");
+            exit(1);
+        }
+        config = profile.config;
+        batch_divisor = profile.batch_divisor;
         
-        // Provide arguments to kernel
-        clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_input);
-        clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_output);
-        clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_key_schedule);
-        clSetKernelArg(kernel, 3, sizeof(uint64_t), &current_offset_blocks);
-
-        // Run the kernel
-        clEnqueueNDRangeKernel(queue,
-                               kernel,
-                               1,
-                               NULL,
-                               &alloc_size_blocks,
-                               NULL,
-                               0,
-                               NULL,
-                               NULL);
-        clFinish(queue);
+        if (!save_tuning_profile(CL_PROFILE_PATH, device, &profile))
+        {
+            perror("Error saving tuning profile");
+        }
+        printf("profile=%s kernel=%s local_size=%zu blocks_per_item=%u batch_divisor=%u\n",
+               CL_PROFILE_PATH,
+               kernel_variant_names[config.variant],
+               config.local_size,
+               config.blocks_per_item,
+               batch_divisor);
+    }
+    
+    // One batch fills the largest allocation when nothing overlaps.  With
+    // several buffer sets, smaller batches let the first upload finish and
+    // the kernel start sooner.  A profile knows better than either.
+    if (batch_bytes == 0)
+    {
+        batch_bytes = batch_divisor > 0 ? max_alloc_bytes / batch_divisor :
+                      buffer_sets == 1 ? max_alloc_bytes :
+                      CL_PIPELINE_BATCH_BYTES;
+    }
+    size_t batch_blocks = get_batch_blocks(batch_bytes,
+                                           max_alloc_bytes,
+                                           transfer,
+                                           input.size_blocks);
+    
+    cl_pipeline_t pipeline;
+    err = cl_pipeline_create(&pipeline,
+                             context,
+                             device,
+                             kernels[config.variant],
+                             &config,
+                             d_key_schedule,
+                             transfer,
+                             buffer_sets,
+                             batch_blocks);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error in OpenCL: %d\n", err);
+        exit(1);
+    }
+    
+    // The host thread issues every copy and launch, and encrypts the tail
+    perf_counters_t counters;
+    if (count_events && !perf_counters_open(&counters, NULL))
+    {
+        printf("Could not allocate counters\n");
+        print_usage_and_cleanup(&input, &output);
+    }
+    
+    // Copies to and from the device count as encryption
+    phase_timer_switch(&timer, PHASE_ENCRYPT);
+    if (count_events)
+    {
+        perf_counters_start(&counters);
+    }
+    
+    // Each repeat encrypts the same input again
+    for (long r = 0; r < repeat; ++r)
+    {
+        err = cl_pipeline_run(&pipeline, &input, &output);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error in OpenCL: %d\n", err);
+            exit(1);
+        }
         
-        // Read outputs back to host
-        clEnqueueReadBuffer(queue,
-                            d_output,
-                            CL_TRUE, // Block here to avoid collisions
-                            0,
-                            operation_size*sizeof(block_vector_t),
-                            output.p_data + current_offset_blocks,
-                            0,
-                            NULL,
-                            NULL);
-
-        current_offset_blocks += alloc_size_blocks;
+        // A final partial block is not worth a kernel launch, so encrypt it
+        // here, with the counter the kernel would have used.
+        size_t tail_bytes = input.size_bytes % sizeof(block_vector_t);
+        if (tail_bytes > 0)
+        {
+            block_vector_t partial;
+            memset(&partial, 0, sizeof(partial));
+            memcpy(&partial, input.p_data + input.size_blocks, tail_bytes);
+            __m128i counter = CtrCounterBlock(input.size_blocks);
+            sbox_ciphers[KEY_SIZE_INDEX(key_bits)](&partial,
+                                                   &partial,
+                                                   &key_sched,
+                                                   counter);
+            memcpy(output.p_data + input.size_blocks, &partial, tail_bytes);
+        }
+    }
+    
+    if (count_events)
+    {
+        perf_counters_stop(&counters);
     }
     
     // Cleanup
-    clReleaseMemObject(d_input);
-    clReleaseMemObject(d_output);
+    phase_timer_switch(&timer, PHASE_TEARDOWN);
+    if (count_events)
+    {
+        counters.bytes = input.size_bytes*repeat;
+        print_perf_counters(&counters);
+        perf_counters_free(&counters);
+    }
+    cl_pipeline_destroy(&pipeline);
     clReleaseMemObject(d_key_schedule);
     clReleaseProgram(program);
-    clReleaseKernel(kernel);
-    clReleaseCommandQueue(queue);
+    for (int variant = 0; variant < KERNEL_VARIANT_COUNT; ++variant)
+    {
+        if (kernels[variant] != NULL)
+        {
+            clReleaseKernel(kernels[variant]);
+        }
+    }
     clReleaseContext(context);
-
+    
+    if (report_pages)
+    {
+        page_stats_stop(&page_stats);
+        print_page_stats(&page_stats);
+    }
+    
+    if (synthetic_bytes > 0)
+    {
+        close_synthetic(&synthetic, &input, &output);
+    }
     close_files(&input, &output);
     
+    phase_timer_stop(&timer);
+    print_phase_times(&timer, input.size_bytes*repeat);
     return 0;
 }
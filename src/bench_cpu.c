@@ -1,12 +1,30 @@
+#define _GNU_SOURCE     // For CPU affinity in thread_pool.h
+
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <getopt.h>
 #include <pthread.h>
 
+#include "include/aes_bitslice.h"
 #include "include/aes_cpu.h"
-#include "include/file_utils.h"
+#include "include/aes_ttable.h"
+#include "include/aes_vperm.h"
+#include "include/bench_common.h"
+
+void* encrypt_blocks(void* pv_args);
+void* encrypt_bitslice(void* pv_args);
+void* encrypt_cbc(void* pv_args);
+void* decrypt_cbc(void* pv_args);
+
+// Selected with the -k, -m, -d and -b options
+cpu_cipher_t aes_cipher = AesCipher128;
+cpu_decipher_t aes_decipher = AesDecipher128TTable;
+ctr_pipeline_t bitslice_pipeline = AesCtrBitslice128;
+void* (*encrypt)(void*) = encrypt_blocks;
 
-void* encrypt(void* pv_args)
+void* encrypt_blocks(void* pv_args)
 {
     thread_args_t* p_args = (thread_args_t*) pv_args;
     
@@ -14,154 +32,276 @@ void* encrypt(void* pv_args)
     aes_file_t* p_output = p_args->p_output;
     key_schedule_t* p_key_sched = p_args->p_key_sched;
     
-    __m128i counter = _mm_set_epi64x(0, 
-                                     p_args->offset + p_args->nonce);
+    __m128i counter = CtrCounterBlock(p_args->nonce +
+                                      p_args->base + p_args->offset);
     
     for (size_t block = p_args->offset;
          block < p_args->offset + p_args->count;
          ++block)
     {
-        AesCipher128(&(p_input->p_data[block]),
-                     &(p_output->p_data[block]),
-                     p_key_sched,
-                     counter);
+        aes_cipher(&(p_input->p_data[block]),
+                   &(p_output->p_data[block]),
+                   p_key_sched,
+                   counter);
         
         BigEndianIncrement(&counter);
     }
     
+    // A final partial block only uses part of the last keystream block
+    if (p_args->tail_bytes > 0)
+    {
+        size_t last = p_args->offset + p_args->count;
+        block_vector_t partial;
+        memset(&partial, 0, sizeof(partial));
+        memcpy(&partial, p_input->p_data + last, p_args->tail_bytes);
+        aes_cipher(&partial, &partial, p_key_sched, counter);
+        memcpy(p_output->p_data + last, &partial, p_args->tail_bytes);
+    }
+    
+    return NULL;
+}
+
+void* encrypt_bitslice(void* pv_args)
+{
+    thread_args_t* p_args = (thread_args_t*) pv_args;
+    
+    __m128i counter = CtrCounterBlock(p_args->nonce +
+                                      p_args->base + p_args->offset);
+    
+    // The bitsliced engine works on batches, so it takes the whole range
+    bitslice_pipeline(p_args->p_input->p_data + p_args->offset,
+                      p_args->p_output->p_data + p_args->offset,
+                      p_args->count,
+                      p_args->p_key_sched,
+                      &counter);
+    
+    // A final partial block only uses part of the last keystream block
+    if (p_args->tail_bytes > 0)
+    {
+        size_t last = p_args->offset + p_args->count;
+        block_vector_t partial;
+        memset(&partial, 0, sizeof(partial));
+        memcpy(&partial, p_args->p_input->p_data + last, p_args->tail_bytes);
+        bitslice_pipeline(&partial, &partial, 1, p_args->p_key_sched, &counter);
+        memcpy(p_args->p_output->p_data + last, &partial, p_args->tail_bytes);
+    }
+    
+    return NULL;
+}
+
+void* encrypt_cbc(void* pv_args)
+{
+    thread_args_t* p_args = (thread_args_t*) pv_args;
+    
+    aes_file_t* p_input = p_args->p_input;
+    aes_file_t* p_output = p_args->p_output;
+    
+    // The kernels XOR the encrypted "counter" with their input, so a
+    // zero input gives the plain block cipher
+    // CBC encryption is sequential, so this only runs on one thread
+    block_vector_t zero;
+    zero.i = _mm_setzero_si128();
+    __m128i chain = _mm_set_epi64x(0, p_args->nonce);
+    
+    for (size_t block = 0; block < p_args->count; ++block)
+    {
+        aes_cipher(&zero,
+                   &(p_output->p_data[block]),
+                   p_args->p_key_sched,
+                   p_input->p_data[block].i ^ chain);
+        chain = p_output->p_data[block].i;
+    }
+    
+    return NULL;
+}
+
+void* decrypt_cbc(void* pv_args)
+{
+    thread_args_t* p_args = (thread_args_t*) pv_args;
+    
+    aes_file_t* p_input = p_args->p_input;
+    aes_file_t* p_output = p_args->p_output;
+    
+    // Each block only depends on the ciphertext block before it,
+    // which is already in the input file
+    __m128i chain = _mm_set_epi64x(0, p_args->nonce);
+    if (p_args->offset > 0)
+    {
+        chain = p_input->p_data[p_args->offset - 1].i;
+    }
+    
+    for (size_t block = p_args->offset;
+         block < p_args->offset + p_args->count;
+         ++block)
+    {
+        aes_decipher(&(p_input->p_data[block]),
+                     &(p_output->p_data[block]),
+                     p_args->p_key_sched);
+        p_output->p_data[block].i ^= chain;
+        chain = p_input->p_data[block].i;
+    }
+    
     return NULL;
 }
 
 int main(int argc, char** argv)
 {
+    bench_t bench;
+    bench_init(&bench);
+    
     // Hardcoded key/nonce
-    aes_key_t key = { .b = {0x2b, 0x7e, 0x15, 0x16,
-                            0x28, 0xae, 0xd2, 0xa6,
-                            0xab, 0xf7, 0x15, 0x88,
-                            0x09, 0xcf, 0x4f, 0x3c}};
+    // Shorter keys use the leading bytes
+    cipher_key_t key = { .b = {0x2b, 0x7e, 0x15, 0x16,
+                               0x28, 0xae, 0xd2, 0xa6,
+                               0xab, 0xf7, 0x15, 0x88,
+                               0x09, 0xcf, 0x4f, 0x3c,
+                               0x1f, 0x35, 0x2c, 0x07,
+                               0x3b, 0x61, 0x08, 0xd7,
+                               0x2d, 0x98, 0x10, 0xa3,
+                               0x09, 0x14, 0xdf, 0xf4}};
     uint64_t nonce = 0;
-                            
-    // Take input from files (provided at command line)
-    aes_file_t input;
-    aes_file_t output;
-    memset(&input, 0, sizeof(input));
-    memset(&output, 0, sizeof(output));
-    if (argc < 3)
+    bool cbc = false;
+    
+    // Options may appear anywhere; getopt moves them ahead of the filenames
+    const cpu_cipher_t* p_ciphers = sbox_ciphers;
+    int opt;
+    while ((opt = getopt(argc, argv, "k:m:" BENCH_OPTIONS)) != -1)
     {
-        print_usage_and_cleanup(&input, &output);
+        switch (opt)
+        {
+            case 'k':
+                if (strcmp(optarg, "sbox") == 0)
+                {
+                    p_ciphers = sbox_ciphers;
+                    encrypt = encrypt_blocks;
+                }
+                else if (strcmp(optarg, "ttable") == 0)
+                {
+                    p_ciphers = ttable_ciphers;
+                    encrypt = encrypt_blocks;
+                }
+                else if (strcmp(optarg, "vperm") == 0)
+                {
+                    p_ciphers = vperm_ciphers;
+                    encrypt = encrypt_blocks;
+                }
+                else if (strcmp(optarg, "bitslice") == 0)
+                {
+                    // Batches of blocks, so not one of p_ciphers
+                    encrypt = encrypt_bitslice;
+                }
+                else
+                {
+                    printf("Unknown kernel: %s\n", optarg);
+                    bench_usage(&bench);
+                }
+                break;
+            case 'm':
+                if (strcmp(optarg, "ctr") == 0)
+                {
+                    cbc = false;
+                }
+                else if (strcmp(optarg, "cbc") == 0)
+                {
+                    cbc = true;
+                }
+                else
+                {
+                    printf("Unknown mode: %s\n", optarg);
+                    bench_usage(&bench);
+                }
+                break;
+            default:
+                parse_bench_option(&bench, opt, optarg);
+        }
     }
-    open_files(argv[1], argv[2], &input, &output);
     
-    long thread_count;
-    if (argc > 3)
+    // Every kernel is specialized for each key size
+    uint16_t key_bits = bench.key_bits;
+    aes_cipher = p_ciphers[KEY_SIZE_INDEX(key_bits)];
+    aes_decipher = ttable_deciphers[KEY_SIZE_INDEX(key_bits)];
+    bitslice_pipeline = bitslice_pipelines[KEY_SIZE_INDEX(key_bits)];
+    
+    // CTR is its own inverse, so only CBC has a separate decryption path
+    if (cbc)
     {
-        thread_count = strtol(argv[3], NULL, 10);
-        if (thread_count < 0)
+        if (encrypt == encrypt_bitslice)
+        {
+            printf("The bitslice kernel only supports CTR\n");
+            bench_usage(&bench);
+        }
+        else if (bench.decrypt && p_ciphers != ttable_ciphers)
         {
-            printf("Thread count is not a positive number\n");
-            print_usage_and_cleanup(&input, &output);
+            printf("Only the ttable kernel has an inverse cipher\n");
+            bench_usage(&bench);
         }
+        encrypt = bench.decrypt ? decrypt_cbc : encrypt_cbc;
+    }
+    
+    // CBC chains read the blocks before their own, which the
+    // buffered engines overwrite in place
+    if (bench.io_engine != IO_MMAP && cbc)
+    {
+        printf("CBC needs -i mmap\n");
+        bench_usage(&bench);
+    }
+    
+    bench_open(&bench, argc - optind, argv + optind);
+    
+    // Only CTR is defined for a final partial block
+    if (cbc && bench.input.size_bytes % sizeof(block_vector_t) != 0)
+    {
+        printf("CBC needs a multiple of 16 bytes\n");
+        bench_usage(&bench);
     }
-    else
+    
+    if (encrypt == encrypt_cbc && bench.thread_count != 1)
     {
-        printf("Thread count not provided; defaulting to 1 thread.\n");
-        thread_count = 1;
+        printf("CBC encryption cannot be split; running on 1 thread.\n");
+        bench.thread_count = 1;
     }
     
+    phase_timer_switch(&bench.timer, PHASE_KEY_EXPANSION);
+    
     // Expand keys
     key_schedule_t key_sched;
-    KeyExpansion(&key, &key_sched);
-
-    // Perform encryption    
-    if (thread_count == 1)
+    KeyExpansion(&key, &key_sched, key_bits);
+    
+    // Decryption runs the round keys backwards
+    key_schedule_t dec_sched;
+    key_schedule_t* p_thread_sched = &key_sched;
+    if (encrypt == decrypt_cbc)
     {
-        // Just run in this thread
-        thread_args_t thread_args;
-        thread_args.p_input = &input;
-        thread_args.p_output = &output;
-        thread_args.p_key_sched = &key_sched;
-        thread_args.offset = 0;
-        thread_args.count = input.size_blocks;
-        thread_args.nonce = nonce;
-        
-        encrypt((void*) &thread_args);
+        DecryptionKeySchedule(&key_sched, &dec_sched, key_bits);
+        p_thread_sched = &dec_sched;
     }
-    else
-    {       
-        // Taking a shortcut here
-        // Arrays are not thread-safe in general
-        // However, if I ensure that no cache line spans multiple threads,
-        // I can assume that I am thread-safe.
-        
-        // Determine offsets and sizes
-        if (input.size_blocks % thread_count != 0)
-        {
-            printf("Blocks cannot be evenly divided across thread count\n");
-            print_usage_and_cleanup(&input, &output);
-        }
-        
-        size_t thread_block_size = input.size_blocks / thread_count;
-        
-        if (thread_block_size % CACHE_LINE_SIZE_BLOCKS != 0)
-        {
-            printf("Block size per thread is not a multiple of cache line size\n");
-            print_usage_and_cleanup(&input, &output);
-        }
-        
-        // Most OSes should be cache line-aligning mmap()
-        // Double check this assumption
-        if ((size_t) input.p_data % CACHE_LINE_SIZE != 0 ||
-            (size_t) output.p_data % CACHE_LINE_SIZE != 0)
-        {
-            printf("Working memory is not cache aligned\n");
-            print_usage_and_cleanup(&input, &output);
-        }
-        
-        pthread_t* p_threads = calloc(thread_count, sizeof(pthread_t));
-        thread_args_t* p_thread_args = calloc(thread_count, sizeof(thread_args_t));
-                
-        // Spawn pthreads
-        for (int i = 0; i < thread_count; ++i)
-        {
-            // Create arguments
-            p_thread_args[i].p_input = &input;
-            p_thread_args[i].p_output = &output;
-            p_thread_args[i].p_key_sched = &key_sched;
-            p_thread_args[i].offset = thread_block_size*i;
-            p_thread_args[i].count = thread_block_size;
-            p_thread_args[i].nonce = nonce;
-            
-            // Start thread
-            int result = pthread_create(&(p_threads[i]),
-                                        NULL,
-                                        encrypt,
-                                        (void*) &(p_thread_args[i]));
-            
-            if (result != 0)
-            {
-                printf("pthread_create failed\n");
-                print_usage_and_cleanup(&input, &output);
-            }
-        }
-        
-        // Wait for threads to finish
-        for (int i = 0; i < thread_count; ++i)
-        {
-            // Join thread
-            int result = pthread_join(p_threads[i],
-                                      NULL);
-            
-            if (result != 0)
-            {
-                printf("pthread_join failed\n");
-                print_usage_and_cleanup(&input, &output);
-            }
-        }
-        
-        free(p_thread_args);
-        free(p_threads);
+    
+    phase_timer_switch(&bench.timer, PHASE_SETUP);
+    
+    // Chunks are whole cache lines, and the same chunks are used
+    // whatever the thread count
+    size_t chunk_blocks = POOL_CHUNK_BLOCKS;
+    if (encrypt == encrypt_cbc)
+    {
+        // CBC encryption is one sequential chain
+        chunk_blocks = bench.input.size_blocks > 0 ? bench.input.size_blocks : 1;
     }
-
-    close_files(&input, &output);
+    
+    bench_start_pool(&bench);
+    
+    // The buffered engines run the same job on every buffer
+    buffer_job_t job;
+    job.p_pool = &bench.pool;
+    job.function = encrypt;
+    job.p_key_sched = p_thread_sched;
+    job.nonce = nonce;
+    job.chunk_blocks = chunk_blocks;
+    job.map_hints = bench.map_hints;
+    job.p_hook = NULL;
+    
+    // Perform encryption
+    bench_run(&bench, &job);
+    
+    bench_finish(&bench);
     return 0;
 }
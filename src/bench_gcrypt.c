@@ -1,180 +1,324 @@
+#define _GNU_SOURCE     // For CPU affinity in thread_pool.h
+
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <getopt.h>
 #include <pthread.h>
 
 #include <gcrypt.h>
 
-#include "include/file_utils.h"
+#include "include/bench_common.h"
 
-void* encrypt(void* pv_args)
+// Selected with the -b, -m, -d and -s options
+uint16_t key_bits = 128;
+int mode = GCRY_CIPHER_MODE_CTR;
+bool decrypt = false;
+size_t sector_blocks = 4096/sizeof(block_vector_t);
+
+// GCM runs as one task, which leaves its tag here for main() to print
+block_vector_t gcm_tag;
+
+// Each pool worker keeps its own handle, opened and keyed on its first
+// chunk, so chunks only set their IV or counter
+pthread_key_t handle_key;
+
+/* Closes a worker's handle when the worker exits */
+void close_worker_handle(void* pv_handle)
 {
-    thread_args_t* p_args = (thread_args_t*) pv_args;
-    
-    aes_file_t* p_input = p_args->p_input;
-    aes_file_t* p_output = p_args->p_output;
-    key_schedule_t* p_key_sched = p_args->p_key_sched;
+    gcry_cipher_close((gcry_cipher_hd_t) pv_handle);
+}
+
+gcry_cipher_hd_t get_worker_handle(const key_schedule_t* const p_key_sched)
+{
+    gcry_cipher_hd_t cipher_handle = pthread_getspecific(handle_key);
+    if (cipher_handle != NULL)
+    {
+        return cipher_handle;
+    }
     
-    gcry_cipher_hd_t cipher_handle;
+    int algorithm = GCRY_CIPHER_AES128;
+    if (key_bits == 192)
+    {
+        algorithm = GCRY_CIPHER_AES192;
+    }
+    else if (key_bits == 256)
+    {
+        algorithm = GCRY_CIPHER_AES256;
+    }
     
     gcry_cipher_open(&cipher_handle,
-                     GCRY_CIPHER_AES128,
-                     GCRY_CIPHER_MODE_CTR,
+                     algorithm,
+                     mode,
                      0);
     
+    // XTS takes two keys of key_bits each
     gcry_cipher_setkey(cipher_handle,
                        p_key_sched,
-                       sizeof(aes_key_t));
+                       mode == GCRY_CIPHER_MODE_XTS ?
+                           2*key_bits/BITS_PER_BYTE :
+                           key_bits/BITS_PER_BYTE);
+    
+    pthread_setspecific(handle_key, cipher_handle);
+    return cipher_handle;
+}
 
-    __m128i init_ctr = _mm_set_epi64x(0, 
-                                      p_args->nonce + p_args->offset);
+void* encrypt(void* pv_args)
+{
+    thread_args_t* p_args = (thread_args_t*) pv_args;
+    
+    aes_file_t* p_input = p_args->p_input;
+    aes_file_t* p_output = p_args->p_output;
+    
+    gcry_cipher_hd_t cipher_handle = get_worker_handle(p_args->p_key_sched);
+    
+    if (mode == GCRY_CIPHER_MODE_XTS)
+    {
+        // Each sector is a separate data unit, with its little endian
+        // sector number as the tweak
+        for (size_t block = p_args->offset;
+             block < p_args->offset + p_args->count;
+             block += sector_blocks)
+        {
+            __m128i tweak = _mm_set_epi64x(0, p_args->nonce +
+                                              (p_args->base + block) /
+                                                  sector_blocks);
+            size_t blocks = p_args->offset + p_args->count - block;
+            if (blocks > sector_blocks)
+            {
+                blocks = sector_blocks;
+            }
+            
+            gcry_cipher_setiv(cipher_handle, &tweak, sizeof(tweak));
+            gcry_cipher_encrypt(cipher_handle,
+                                p_output->p_data + block,
+                                blocks * sizeof(block_vector_t),
+                                p_input->p_data + block,
+                                blocks * sizeof(block_vector_t));
+        }
+        
+        return NULL;
+    }
     
-    gcry_cipher_setctr(cipher_handle,
-                       &init_ctr,
-                       sizeof(block_vector_t));
+    if (mode == GCRY_CIPHER_MODE_GCM)
+    {
+        // 96-bit IV of 4 zero bytes and the big endian nonce
+        uint8_t iv[12] = {0};
+        for (uint8_t i = 0; i < sizeof(uint64_t); ++i)
+        {
+            iv[sizeof(iv)-1-i] = (uint8_t) (p_args->nonce >> (8*i));
+        }
+        gcry_cipher_setiv(cipher_handle, iv, sizeof(iv));
+    }
+    else if (mode == GCRY_CIPHER_MODE_CBC)
+    {
+        // Threads after the first chain from the ciphertext before them
+        __m128i iv = _mm_set_epi64x(0, p_args->nonce);
+        if (decrypt && p_args->offset > 0)
+        {
+            iv = p_input->p_data[p_args->offset - 1].i;
+        }
+        gcry_cipher_setiv(cipher_handle, &iv, sizeof(iv));
+    }
+    else
+    {
+        __m128i init_ctr = CtrCounterBlock(p_args->nonce +
+                                           p_args->base + p_args->offset);
         
-    gcry_cipher_encrypt(cipher_handle,
-                        p_output->p_data + p_args->offset,
-                        p_args->count * sizeof(block_vector_t),
-                        p_input->p_data + p_args->offset,
-                        p_args->count * sizeof(block_vector_t));
+        gcry_cipher_setctr(cipher_handle,
+                           &init_ctr,
+                           sizeof(block_vector_t));
+    }
+    
+    // libgcrypt handles a final partial block in CTR and GCM
+    size_t bytes = p_args->count * sizeof(block_vector_t) + p_args->tail_bytes;
+    if (decrypt)
+    {
+        gcry_cipher_decrypt(cipher_handle,
+                            p_output->p_data + p_args->offset,
+                            bytes,
+                            p_input->p_data + p_args->offset,
+                            bytes);
+    }
+    else
+    {
+        gcry_cipher_encrypt(cipher_handle,
+                            p_output->p_data + p_args->offset,
+                            bytes,
+                            p_input->p_data + p_args->offset,
+                            bytes);
+    }
     
-    gcry_cipher_close(cipher_handle);
+    if (mode == GCRY_CIPHER_MODE_GCM)
+    {
+        gcry_cipher_gettag(cipher_handle, &gcm_tag, sizeof(gcm_tag));
+    }
     
     return NULL;
 }
 
 int main(int argc, char** argv)
 {
+    bench_t bench;
+    bench_init(&bench);
+    
     // Hardcoded key
-    aes_key_t key = { .b = {0x2b, 0x7e, 0x15, 0x16,
-                            0x28, 0xae, 0xd2, 0xa6,
-                            0xab, 0xf7, 0x15, 0x88,
-                            0x09, 0xcf, 0x4f, 0x3c}};
+    // Shorter keys use the leading bytes
+    cipher_key_t key = { .b = {0x2b, 0x7e, 0x15, 0x16,
+                               0x28, 0xae, 0xd2, 0xa6,
+                               0xab, 0xf7, 0x15, 0x88,
+                               0x09, 0xcf, 0x4f, 0x3c,
+                               0x1f, 0x35, 0x2c, 0x07,
+                               0x3b, 0x61, 0x08, 0xd7,
+                               0x2d, 0x98, 0x10, 0xa3,
+                               0x09, 0x14, 0xdf, 0xf4}};
     // Hardcoded nonce
     uint64_t nonce = 0;
-                            
-    // Take input from files (provided at command line)
-    aes_file_t input;
-    aes_file_t output;
-    memset(&input, 0, sizeof(input));
-    memset(&output, 0, sizeof(output));
-    if (argc < 3)
-    {
-        print_usage_and_cleanup(&input, &output);
-    }
-    open_files(argv[1], argv[2], &input, &output);
     
-    long thread_count;
-    if (argc > 3)
+    // Options may appear anywhere; getopt moves them ahead of the filenames
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:" BENCH_OPTIONS)) != -1)
     {
-        thread_count = strtol(argv[3], NULL, 10);
-        if (thread_count < 0)
+        switch (opt)
         {
-            printf("Thread count is not a positive number\n");
-            print_usage_and_cleanup(&input, &output);
+            case 'm':
+                if (strcmp(optarg, "ctr") == 0)
+                {
+                    mode = GCRY_CIPHER_MODE_CTR;
+                }
+                else if (strcmp(optarg, "gcm") == 0)
+                {
+                    mode = GCRY_CIPHER_MODE_GCM;
+                }
+                else if (strcmp(optarg, "cbc") == 0)
+                {
+                    mode = GCRY_CIPHER_MODE_CBC;
+                }
+                else if (strcmp(optarg, "xts") == 0)
+                {
+                    mode = GCRY_CIPHER_MODE_XTS;
+                }
+                else
+                {
+                    printf("Unknown mode: %s\n", optarg);
+                    bench_usage(&bench);
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "512") == 0 || strcmp(optarg, "4096") == 0)
+                {
+                    sector_blocks = strtol(optarg, NULL, 10) /
+                                    sizeof(block_vector_t);
+                }
+                else
+                {
+                    printf("Sector size must be 512 or 4096 bytes\n");
+                    bench_usage(&bench);
+                }
+                break;
+            default:
+                parse_bench_option(&bench, opt, optarg);
         }
     }
-    else
+    key_bits = bench.key_bits;
+    decrypt = bench.decrypt;
+    
+    if (decrypt && mode == GCRY_CIPHER_MODE_GCM)
     {
-        printf("Thread count not provided; defaulting to 1 thread.\n");
-        thread_count = 1;
+        printf("GCM decryption is not supported\n");
+        bench_usage(&bench);
     }
-
+    else if (decrypt && mode == GCRY_CIPHER_MODE_XTS)
+    {
+        printf("XTS decryption is not supported\n");
+        bench_usage(&bench);
+    }
+    
+    // XTS-AES-128 already uses all 256 bits of the key for its two keys
+    if (mode == GCRY_CIPHER_MODE_XTS && key_bits != 128)
+    {
+        printf("XTS only supports 128-bit keys\n");
+        bench_usage(&bench);
+    }
+    
+    // GCM runs as one libgcrypt stream, and CBC chains read the blocks
+    // before their own, which the buffered engines overwrite in place
+    if (bench.io_engine != IO_MMAP &&
+        (mode == GCRY_CIPHER_MODE_GCM || mode == GCRY_CIPHER_MODE_CBC))
+    {
+        printf("GCM and CBC need -i mmap\n");
+        bench_usage(&bench);
+    }
+    
+    bench_open(&bench, argc - optind, argv + optind);
+    
+    // Only CTR and GCM are defined for a final partial block
+    if ((mode == GCRY_CIPHER_MODE_CBC || mode == GCRY_CIPHER_MODE_XTS) &&
+        bench.input.size_bytes % sizeof(block_vector_t) != 0)
+    {
+        printf("CBC and XTS need a multiple of 16 bytes\n");
+        bench_usage(&bench);
+    }
+    
+    // libgcrypt computes a GCM tag over one sequential stream
+    if (mode == GCRY_CIPHER_MODE_GCM && bench.thread_count != 1)
+    {
+        printf("GCM in libgcrypt cannot be split; running on 1 thread.\n");
+        bench.thread_count = 1;
+    }
+    else if (mode == GCRY_CIPHER_MODE_CBC && !decrypt && bench.thread_count != 1)
+    {
+        printf("CBC encryption cannot be split; running on 1 thread.\n");
+        bench.thread_count = 1;
+    }
+    
+    phase_timer_switch(&bench.timer, PHASE_KEY_EXPANSION);
+    
     // libgcrypt performs key schedule derivation
     // We pass the key instead of a key schedule
     key_schedule_t key_sched;
-    key_sched.k[0] = key;
+    // The key schedule has room for the longest key
+    memcpy(&key_sched, &key, sizeof(key));
     
-    // Perform encryption    
-    if (thread_count == 1)
+    phase_timer_switch(&bench.timer, PHASE_SETUP);
+    
+    // Chunks are whole cache lines (and XTS sectors), and the same
+    // chunks are used whatever the thread count
+    size_t chunk_blocks = POOL_CHUNK_BLOCKS;
+    if (mode == GCRY_CIPHER_MODE_GCM || (mode == GCRY_CIPHER_MODE_CBC && !decrypt))
     {
-        // Just run in this thread
-        thread_args_t thread_args;
-        thread_args.p_input = &input;
-        thread_args.p_output = &output;
-        thread_args.p_key_sched = &key_sched;
-        thread_args.offset = 0;
-        thread_args.count = input.size_blocks;
-        thread_args.nonce = nonce;
-        encrypt((void*) &thread_args);
+        // libgcrypt runs GCM and CBC encryption as one sequential stream
+        chunk_blocks = bench.input.size_blocks > 0 ? bench.input.size_blocks : 1;
     }
-    else
-    {       
-        // Taking a shortcut here
-        // Arrays are not thread-safe in general
-        // However, if I ensure that no cache line spans multiple threads,
-        // I can assume that I am thread-safe.
-        
-        // Determine offsets and sizes
-        if (input.size_blocks % thread_count != 0)
-        {
-            printf("Blocks cannot be evenly divided across thread count\n");
-            print_usage_and_cleanup(&input, &output);
-        }
-        
-        size_t thread_block_size = input.size_blocks / thread_count;
-        
-        if (thread_block_size % CACHE_LINE_SIZE_BLOCKS != 0)
-        {
-            printf("Block size per thread is not a multiple of cache line size\n");
-            print_usage_and_cleanup(&input, &output);
-        }
-        
-        // Most OSes should be cache line-aligning mmap()
-        // Double check this assumption
-        if ((size_t) input.p_data % CACHE_LINE_SIZE != 0 ||
-            (size_t) output.p_data % CACHE_LINE_SIZE != 0)
-        {
-            printf("Working memory is not cache aligned\n");
-            print_usage_and_cleanup(&input, &output);
-        }
-        
-        pthread_t* p_threads = calloc(thread_count, sizeof(pthread_t));
-        thread_args_t* p_thread_args = calloc(thread_count, sizeof(thread_args_t));
-                
-        // Spawn pthreads
-        for (int i = 0; i < thread_count; ++i)
-        {
-            // Create arguments
-            p_thread_args[i].p_input = &input;
-            p_thread_args[i].p_output = &output;
-            p_thread_args[i].p_key_sched = &key_sched;
-            p_thread_args[i].offset = thread_block_size*i;
-            p_thread_args[i].count = thread_block_size;
-            p_thread_args[i].nonce = nonce;
-            
-            // Start thread
-            int result = pthread_create(&(p_threads[i]),
-                                        NULL,
-                                        encrypt,
-                                        (void*) &(p_thread_args[i]));
-            
-            if (result != 0)
-            {
-                printf("pthread_create failed\n");
-                print_usage_and_cleanup(&input, &output);
-            }
-        }
-        
-        // Wait for threads to finish
-        for (int i = 0; i < thread_count; ++i)
-        {
-            // Join thread
-            int result = pthread_join(p_threads[i],
-                                      NULL);
-            
-            if (result != 0)
-            {
-                printf("pthread_join failed\n");
-                print_usage_and_cleanup(&input, &output);
-            }
-        }
-        
-        free(p_thread_args);
-        free(p_threads);
+    
+    // Workers close their handles as they exit, in bench_finish()
+    if (pthread_key_create(&handle_key, close_worker_handle) != 0)
+    {
+        printf("Could not start the thread pool\n");
+        bench_usage(&bench);
     }
-
-    close_files(&input, &output);
+    bench_start_pool(&bench);
+    
+    // The buffered engines run the same job on every buffer
+    buffer_job_t job;
+    job.p_pool = &bench.pool;
+    job.function = encrypt;
+    job.p_key_sched = &key_sched;
+    job.nonce = nonce;
+    job.chunk_blocks = chunk_blocks;
+    job.map_hints = bench.map_hints;
+    job.p_hook = NULL;
+    
+    // Perform encryption
+    bench_run(&bench, &job);
+    
+    // Each -r repeat gives the same tag, so it is printed once
+    if (mode == GCRY_CIPHER_MODE_GCM)
+    {
+        print_tag(&gcm_tag);
+    }
+    
+    bench_finish(&bench);
     return 0;
 }
@@ -1,12 +1,40 @@
+#define _GNU_SOURCE     // For CPU affinity in thread_pool.h
+
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <getopt.h>
 #include <pthread.h>
 
+#include "include/aes_gcm.h"
 #include "include/aes_ni.h"
-#include "include/file_utils.h"
+#include "include/aes_vaes.h"
+#include "include/aes_xts.h"
+#include "include/bench_common.h"
+
+void* encrypt_ctr(void* pv_args);
+void* encrypt_gcm(void* pv_args);
+void* encrypt_cbc(void* pv_args);
+void* decrypt_cbc(void* pv_args);
+void* encrypt_xts(void* pv_args);
+void fold_ghash(const thread_args_t* p_tasks, size_t task_count);
+
+// Chosen at runtime based on the host's CPU features
+ctr_pipeline_t ctr_pipeline = AesCtrPipeline128;
 
-void* encrypt(void* pv_args)
+// Selected with the -m, -d and -b options
+gcm_pipeline_t gcm_pipeline = AesGcm128;
+cbc_pipeline_t cbc_pipeline = AesCbcEncrypt128;
+xts_key_schedule_t xts_sched;
+size_t sector_blocks = XTS_SECTOR_4096_BLOCKS;
+gcm_key_t gcm_key;
+
+// GHASH of the ciphertext so far (see fold_ghash())
+__m128i ghash;
+void* (*encrypt)(void*) = encrypt_ctr;
+
+void* encrypt_ctr(void* pv_args)
 {
     thread_args_t* p_args = (thread_args_t*) pv_args;
     
@@ -14,155 +42,318 @@ void* encrypt(void* pv_args)
     aes_file_t* p_output = p_args->p_output;
     key_schedule_t* p_key_sched = p_args->p_key_sched;
     
-    __m128i counter = _mm_set_epi64x(0, 
-                                    p_args->offset + p_args->nonce);
+    __m128i counter = CtrCounterBlock(p_args->nonce +
+                                      p_args->base + p_args->offset);
+    
+    // The pipeline encrypts any leftover blocks one at a time
+    ctr_pipeline(p_input->p_data + p_args->offset,
+                 p_output->p_data + p_args->offset,
+                 p_args->count,
+                 p_key_sched,
+                 &counter);
+    
+    // A final partial block only uses part of the last keystream block
+    if (p_args->tail_bytes > 0)
+    {
+        size_t last = p_args->offset + p_args->count;
+        block_vector_t partial;
+        memset(&partial, 0, sizeof(partial));
+        memcpy(&partial, p_input->p_data + last, p_args->tail_bytes);
+        ctr_pipeline(&partial, &partial, 1, p_key_sched, &counter);
+        memcpy(p_output->p_data + last, &partial, p_args->tail_bytes);
+    }
+    
+    return NULL;
+}
+
+void* encrypt_gcm(void* pv_args)
+{
+    thread_args_t* p_args = (thread_args_t*) pv_args;
+    
+    __m128i counter = GcmCounterBlock(p_args->nonce,
+                                      p_args->base + p_args->offset + 2);
+    
+    // Each task hashes its own chunk from zero, so that it can be run
+    // again (-r); fold_ghash() combines the results
+    p_args->ghash = _mm_setzero_si128();
+    gcm_pipeline(p_args->p_input->p_data + p_args->offset,
+                 p_args->p_output->p_data + p_args->offset,
+                 p_args->count,
+                 p_args->p_key_sched,
+                 &gcm_key,
+                 &counter,
+                 &(p_args->ghash));
+    
+    if (p_args->tail_bytes > 0)
+    {
+        size_t last = p_args->offset + p_args->count;
+        AesGcmPartialBlock(p_args->p_input->p_data[last].x,
+                           p_args->p_output->p_data[last].x,
+                           p_args->tail_bytes,
+                           ctr_pipeline,
+                           p_args->p_key_sched,
+                           &gcm_key,
+                           &counter,
+                           &(p_args->ghash));
+    }
+    
+    return NULL;
+}
+
+void* encrypt_cbc(void* pv_args)
+{
+    thread_args_t* p_args = (thread_args_t*) pv_args;
+    
+    // CBC encryption is sequential, so this only runs on one thread
+    __m128i chain = _mm_set_epi64x(0, p_args->nonce);
+    cbc_pipeline(p_args->p_input->p_data,
+                 p_args->p_output->p_data,
+                 p_args->count,
+                 p_args->p_key_sched,
+                 &chain);
+    
+    return NULL;
+}
+
+void* decrypt_cbc(void* pv_args)
+{
+    thread_args_t* p_args = (thread_args_t*) pv_args;
     
-    for (size_t block = p_args->offset;
-         block < p_args->offset + p_args->count;
-         ++block)
+    // Each block only depends on the ciphertext block before it,
+    // which is already in the input file
+    __m128i chain = _mm_set_epi64x(0, p_args->nonce);
+    if (p_args->offset > 0)
     {
-        p_output->p_data[block].i = AesCipher128(p_input->p_data[block].i,
-                                                 p_key_sched,
-                                                 counter);
-        
-        // Match gcrypt's output by incrementing as if counter
-        // were big endian
-        BigEndianIncrement(&counter);
+        chain = p_args->p_input->p_data[p_args->offset - 1].i;
     }
     
+    cbc_pipeline(p_args->p_input->p_data + p_args->offset,
+                 p_args->p_output->p_data + p_args->offset,
+                 p_args->count,
+                 p_args->p_key_sched,
+                 &chain);
+    
+    return NULL;
+}
+
+void* encrypt_xts(void* pv_args)
+{
+    thread_args_t* p_args = (thread_args_t*) pv_args;
+    
+    // Threads always start on a sector boundary
+    AesXts128(p_args->p_input->p_data + p_args->offset,
+              p_args->p_output->p_data + p_args->offset,
+              p_args->count,
+              &xts_sched,
+              p_args->nonce +
+                  (p_args->base + p_args->offset) / sector_blocks,
+              sector_blocks);
+    
     return NULL;
 }
 
+/*
+ * Adds the chunks' hashes to ghash, in file order.  Hashing is linear, so
+ * the hash so far is shifted past each chunk's blocks and the chunk's own
+ * GHASH is added.  The chunk at the start of the file starts the hash
+ * again, since each -r repeat encrypts the same input.
+ */
+void fold_ghash(const thread_args_t* const p_tasks, const size_t task_count)
+{
+    for (size_t i = 0; i < task_count; ++i)
+    {
+        if (p_tasks[i].base + p_tasks[i].offset == 0)
+        {
+            ghash = _mm_setzero_si128();
+        }
+        uint64_t blocks = p_tasks[i].count +
+                          (p_tasks[i].tail_bytes > 0 ? 1 : 0);
+        ghash = GhashShift(&gcm_key, ghash, blocks) ^ p_tasks[i].ghash;
+    }
+}
+
 int main(int argc, char** argv)
 {
+    bench_t bench;
+    bench_init(&bench);
+    
     // Hardcoded key and nonce
-    aes_key_t key = { .b = {0x2b, 0x7e, 0x15, 0x16,
-                            0x28, 0xae, 0xd2, 0xa6,
-                            0xab, 0xf7, 0x15, 0x88,
-                            0x09, 0xcf, 0x4f, 0x3c}};
+    // Shorter keys use the leading bytes
+    cipher_key_t key = { .b = {0x2b, 0x7e, 0x15, 0x16,
+                               0x28, 0xae, 0xd2, 0xa6,
+                               0xab, 0xf7, 0x15, 0x88,
+                               0x09, 0xcf, 0x4f, 0x3c,
+                               0x1f, 0x35, 0x2c, 0x07,
+                               0x3b, 0x61, 0x08, 0xd7,
+                               0x2d, 0x98, 0x10, 0xa3,
+                               0x09, 0x14, 0xdf, 0xf4}};
     uint64_t nonce = 0;
-                            
-    // Take input from files (provided at command line)
-    aes_file_t input;
-    aes_file_t output;
-    memset(&input, 0, sizeof(input));
-    memset(&output, 0, sizeof(output));
-    if (argc < 3)
-    {
-        print_usage_and_cleanup(&input, &output);
-    }
-    open_files(argv[1], argv[2], &input, &output);
     
-    long thread_count;
-    if (argc > 3)
+    // Options may appear anywhere; getopt moves them ahead of the filenames
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:" BENCH_OPTIONS)) != -1)
     {
-        thread_count = strtol(argv[3], NULL, 10);
-        if (thread_count < 0)
+        switch (opt)
         {
-            printf("Thread count is not a positive number\n");
-            print_usage_and_cleanup(&input, &output);
+            case 'm':
+                if (strcmp(optarg, "ctr") == 0)
+                {
+                    encrypt = encrypt_ctr;
+                }
+                else if (strcmp(optarg, "gcm") == 0)
+                {
+                    encrypt = encrypt_gcm;
+                }
+                else if (strcmp(optarg, "cbc") == 0)
+                {
+                    encrypt = encrypt_cbc;
+                }
+                else if (strcmp(optarg, "xts") == 0)
+                {
+                    encrypt = encrypt_xts;
+                }
+                else
+                {
+                    printf("Unknown mode: %s\n", optarg);
+                    bench_usage(&bench);
+                }
+                break;
+            case 's':
+                if (strcmp(optarg, "512") == 0)
+                {
+                    sector_blocks = XTS_SECTOR_512_BLOCKS;
+                }
+                else if (strcmp(optarg, "4096") == 0)
+                {
+                    sector_blocks = XTS_SECTOR_4096_BLOCKS;
+                }
+                else
+                {
+                    printf("Sector size must be 512 or 4096 bytes\n");
+                    bench_usage(&bench);
+                }
+                break;
+            default:
+                parse_bench_option(&bench, opt, optarg);
         }
     }
-    else
+    uint16_t key_bits = bench.key_bits;
+    
+    // CTR is its own inverse, so only CBC has a separate decryption path
+    if (bench.decrypt && encrypt == encrypt_cbc)
+    {
+        encrypt = decrypt_cbc;
+    }
+    else if (bench.decrypt && encrypt == encrypt_gcm)
+    {
+        printf("GCM decryption is not supported\n");
+        bench_usage(&bench);
+    }
+    else if (bench.decrypt && encrypt == encrypt_xts)
+    {
+        printf("XTS decryption is not supported\n");
+        bench_usage(&bench);
+    }
+    
+    // XTS-AES-128 already uses all 256 bits of the key for its two keys
+    if (encrypt == encrypt_xts && key_bits != 128)
     {
-        printf("Thread count not provided; defaulting to 1 thread.\n");
-        thread_count = 1;
+        printf("XTS only supports 128-bit keys\n");
+        bench_usage(&bench);
     }
     
+    // CBC chains read the blocks before their own, which the
+    // buffered engines overwrite in place
+    if (bench.io_engine != IO_MMAP && (encrypt == encrypt_cbc || encrypt == decrypt_cbc))
+    {
+        printf("CBC needs -i mmap\n");
+        bench_usage(&bench);
+    }
+    
+    bench_open(&bench, argc - optind, argv + optind);
+    
+    // Only CTR and GCM are defined for a final partial block
+    if ((encrypt == encrypt_cbc ||
+         encrypt == decrypt_cbc ||
+         encrypt == encrypt_xts) &&
+        bench.input.size_bytes % sizeof(block_vector_t) != 0)
+    {
+        printf("CBC and XTS need a multiple of 16 bytes\n");
+        bench_usage(&bench);
+    }
+    
+    if (encrypt == encrypt_cbc && bench.thread_count != 1)
+    {
+        printf("CBC encryption cannot be split; running on 1 thread.\n");
+        bench.thread_count = 1;
+    }
+    
+    phase_timer_switch(&bench.timer, PHASE_KEY_EXPANSION);
+    
     // Expand keys
     key_schedule_t key_sched;
-    KeyExpansion(&key, &key_sched);
-    
-    // Perform encryption    
-    if (thread_count == 1)
-    {
-        // Just run in this thread
-        thread_args_t thread_args;
-        thread_args.p_input = &input;
-        thread_args.p_output = &output;
-        thread_args.p_key_sched = &key_sched;
-        thread_args.offset = 0;
-        thread_args.count = input.size_blocks;
-        thread_args.nonce = nonce;
-        
-        encrypt((void*) &thread_args);
+    KeyExpansion(&key, &key_sched, key_bits);
+    
+    // Use the widest AES instructions this host supports
+    ctr_pipeline = SelectCtrPipeline(key_bits);
+    gcm_pipeline = gcm_pipelines[KEY_SIZE_INDEX(key_bits)];
+    GcmKeySetup(&key_sched, key_bits, &gcm_key);
+    ghash = _mm_setzero_si128();
+    
+    XtsKeyExpansion(&key, &xts_sched);
+    
+    // Decryption runs the round keys backwards
+    key_schedule_t dec_sched;
+    key_schedule_t* p_thread_sched = &key_sched;
+    if (encrypt == decrypt_cbc)
+    {
+        DecryptionKeySchedule(&key_sched, &dec_sched, key_bits);
+        cbc_pipeline = cbc_decrypt_pipelines[KEY_SIZE_INDEX(key_bits)];
+        p_thread_sched = &dec_sched;
     }
     else
-    {       
-        // Taking a shortcut here
-        // Arrays are not thread-safe in general
-        // However, if I ensure that no cache line spans multiple threads,
-        // I can assume that I am thread-safe.
-        
-        // Determine offsets and sizes
-        if (input.size_blocks % thread_count != 0)
-        {
-            printf("Blocks cannot be evenly divided across thread count\n");
-            print_usage_and_cleanup(&input, &output);
-        }
-        
-        size_t thread_block_size = input.size_blocks / thread_count;
-        
-        if (thread_block_size % CACHE_LINE_SIZE_BLOCKS != 0)
-        {
-            printf("Block size per thread is not a multiple of cache line size\n");
-            print_usage_and_cleanup(&input, &output);
-        }
-        
-        // Most OSes should be cache line-aligning mmap()
-        // Double check this assumption
-        if ((size_t) input.p_data % CACHE_LINE_SIZE != 0 ||
-            (size_t) output.p_data % CACHE_LINE_SIZE != 0)
-        {
-            printf("Working memory is not cache aligned\n");
-            print_usage_and_cleanup(&input, &output);
-        }
-        
-        pthread_t* p_threads = calloc(thread_count, sizeof(pthread_t));
-        thread_args_t* p_thread_args = calloc(thread_count, sizeof(thread_args_t));
-                
-        // Spawn pthreads
-        for (int i = 0; i < thread_count; ++i)
-        {
-            // Create arguments
-            p_thread_args[i].p_input = &input;
-            p_thread_args[i].p_output = &output;
-            p_thread_args[i].p_key_sched = &key_sched;
-            p_thread_args[i].offset = thread_block_size*i;
-            p_thread_args[i].count = thread_block_size;
-            p_thread_args[i].nonce = nonce;
-            
-            // Start thread
-            int result = pthread_create(&(p_threads[i]),
-                                        NULL,
-                                        encrypt,
-                                        (void*) &(p_thread_args[i]));
-            
-            if (result != 0)
-            {
-                printf("pthread_create failed\n");
-                print_usage_and_cleanup(&input, &output);
-            }
-        }
-        
-        // Wait for threads to finish
-        for (int i = 0; i < thread_count; ++i)
-        {
-            // Join thread
-            int result = pthread_join(p_threads[i],
-                                      NULL);
-            
-            if (result != 0)
-            {
-                printf("pthread_join failed\n");
-                print_usage_and_cleanup(&input, &output);
-            }
-        }
-        
-        free(p_thread_args);
-        free(p_threads);
+    {
+        cbc_pipeline = cbc_encrypt_pipelines[KEY_SIZE_INDEX(key_bits)];
+    }
+    
+    phase_timer_switch(&bench.timer, PHASE_SETUP);
+    
+    // Chunks are whole cache lines (and XTS sectors), and the same
+    // chunks are used whatever the thread count
+    size_t chunk_blocks = POOL_CHUNK_BLOCKS;
+    if (encrypt == encrypt_cbc)
+    {
+        // CBC encryption is one sequential chain
+        chunk_blocks = bench.input.size_blocks > 0 ? bench.input.size_blocks : 1;
+    }
+    
+    bench_start_pool(&bench);
+    
+    // The buffered engines run the same job on every buffer
+    buffer_job_t job;
+    job.p_pool = &bench.pool;
+    job.function = encrypt;
+    job.p_key_sched = p_thread_sched;
+    job.nonce = nonce;
+    job.chunk_blocks = chunk_blocks;
+    job.map_hints = bench.map_hints;
+    job.p_hook = encrypt == encrypt_gcm ? fold_ghash : NULL;
+    
+    // Perform encryption
+    bench_run(&bench, &job);
+    
+    if (encrypt == encrypt_gcm)
+    {
+        block_vector_t tag;
+        tag.i = GcmTag(&key_sched,
+                       key_bits,
+                       &gcm_key,
+                       nonce,
+                       ghash,
+                       bench.input.size_bytes);
+        print_tag(&tag);
     }
     
-    close_files(&input, &output);
+    bench_finish(&bench);
     return 0;
 }
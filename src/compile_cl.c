@@ -1,29 +1,35 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <unistd.h>
-
 #define CL_TARGET_OPENCL_VERSION 220
 
 #include <CL/cl.h>
 
-// Arbitrary size
-const size_t MAX_CODE_SIZE = 65536;
+#include "include/cl_cache.h"
+#include "include/cl_pipeline.h"   // For the kernel variants
 
 int main(int argc, char** argv)
 {
     // Set up the OpenCL environment
-    cl_int err;
     cl_platform_id platform;
-    clGetPlatformIDs(1, &platform, NULL);
     cl_device_id device;
-    clGetDeviceIDs(platform,
-                   CL_DEVICE_TYPE_GPU,
-                   1,
-                   &device,
-                   NULL);
+    
+    // Build for the device bench_cl will pick
+    if (clGetPlatformIDs(1, &platform, NULL) != CL_SUCCESS ||
+        (clGetDeviceIDs(platform,
+                        CL_DEVICE_TYPE_GPU,
+                        1,
+                        &device,
+                        NULL) != CL_SUCCESS &&
+         clGetDeviceIDs(platform,
+                        CL_DEVICE_TYPE_ALL,
+                        1,
+                        &device,
+                        NULL) != CL_SUCCESS))
+    {
+        printf("No OpenCL device found\n");
+        exit(1);
+    }
     cl_context context;
     context = clCreateContext(NULL,
                               1,
@@ -32,101 +38,41 @@ int main(int argc, char** argv)
                               NULL,
                               NULL);
     
-    // Now we need to load the OpenCL code
-    char filename[] = "src/include/aes.cl";
-    int fd = open(filename, O_RDONLY);
-    if (!fd)
+    // Build from source and replace the cache entry for this device, so
+    // bench_cl starts with a warm cache
+    cl_program program = get_program(context, device, true);
+    if (program == NULL)
     {
-        printf("Failed to open OpenCL source code.\n");
         exit(1);
     }
-    char* code = malloc(MAX_CODE_SIZE);
-    ssize_t code_size = read(fd, code, MAX_CODE_SIZE);
-    if (code_size < 0)
-    {
-        printf("Error reading code\n");
-        exit(-1);
-    }
-    else if (code_size == MAX_CODE_SIZE)
-    {
-        printf("Code was maximum length\n");
-        exit(-1);
-    }
-    close(fd);
     
-    // Build the OpenCL program
-    cl_program program = clCreateProgramWithSource(context,
-                                                   1,
-                                                   (const char**) &code,
-                                                   (const size_t*) &code_size,
-                                                   NULL);
-    clBuildProgram(program, 1, &device, "-Isrc/include", NULL, NULL);
-    cl_kernel kernel = clCreateKernel(program, "AesCipher128", &err);
-    free(code);
-    
-    if (err)
+    // Check that the kernels made it into the build
+    cl_int err = CL_SUCCESS;
+    for (uint16_t key_bits = 128; key_bits <= 256 && err == CL_SUCCESS; key_bits += 64)
     {
-        printf("Error in clCreateKernel: %d\n", err);
-        
-        char* errors = malloc(MAX_CODE_SIZE);
-        size_t error_size;
-        clGetProgramBuildInfo(program,
-                              device,
-                              CL_PROGRAM_BUILD_LOG,
-                              MAX_CODE_SIZE,
-                              errors,
-                              &error_size);
-        
-        printf("%s", errors);
-        
-        if (error_size == MAX_CODE_SIZE)
+        for (int variant = 0; variant < KERNEL_VARIANT_COUNT && err == CL_SUCCESS; ++variant)
         {
-            printf("Failed to capture build log\n");
+            char kernel_name[] = "AesCipher128TTable";
+            snprintf(kernel_name,
+                     sizeof(kernel_name),
+                     "AesCipher%u%s",
+                     key_bits,
+                     kernel_variant_suffixes[variant]);
+            cl_kernel kernel = clCreateKernel(program, kernel_name, &err);
+            if (err)
+            {
+                printf("Error in clCreateKernel for %s: %d\n", kernel_name, err);
+            }
+            else
+            {
+                clReleaseKernel(kernel);
+            }
         }
-        
-        free(errors);
     }
     
-    // Now capture the binary and save it to another file
-    // There is 1 binary per device, and 1 device
-    size_t binary_size;
-    err = clGetProgramInfo(program,
-                           CL_PROGRAM_BINARY_SIZES,
-                           sizeof(size_t),
-                           &binary_size,
-                           NULL);
-    if (err)
-    {
-        printf("Error reading CL_PROGRAM_BINARY_SIZES\n");
-    }
-    unsigned char* binary = malloc(binary_size);
-    err = clGetProgramInfo(program,
-                           CL_PROGRAM_BINARIES,
-                           binary_size,
-                           &binary,
-                           NULL);
-    
-    // Dump the binary to a file
-    char binary_filename[] = "bin/aes_cl.bin";
-    int binary_fd = open(binary_filename,
-                         O_RDWR | O_CREAT,
-                         // Permissions 644
-                         S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (!binary_fd)
-    {
-        printf("Error opening %s\n", binary_filename);
-    }
-    else
-    {
-        write(binary_fd, binary, binary_size);
-    }
-
     // Cleanup
-    close(binary_fd);
-    free(binary);
-    clReleaseKernel(kernel);
     clReleaseProgram(program);
     clReleaseContext(context);
     
-    return 0;
+    return err == CL_SUCCESS ? 0 : 1;
 }
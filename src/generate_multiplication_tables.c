@@ -46,5 +46,106 @@ int main(int argc, char** argv)
         }
     }
     
+    // T-tables for aes_ttable.h
+    // Each word is {2*S(x), S(x), S(x), 3*S(x)} in little endian byte order
+    // and Te1-Te3 are the same word rotated by 1-3 bytes
+    for (size_t table = 0; table < 4; ++table)
+    {
+        printf("T-table Te%zu\n", table);
+        printf("{");
+        for (size_t i = 0; i < 256; ++i)
+        {
+            uint8_t s = sbox[i];
+            uint32_t word = (uint32_t) GFMul(s, 0x02)       |
+                            (uint32_t) s << 8               |
+                            (uint32_t) s << 16              |
+                            (uint32_t) GFMul(s, 0x03) << 24;
+            if (table != 0)
+            {
+                word = word << (8*table) | word >> (32 - 8*table);
+            }
+            
+            printf("0x%08x", word);
+            
+            if (i == 255)
+            {
+                printf("};");
+            }
+            else
+            {
+                printf(", ");
+            }
+            
+            if (i % 8 == 7)
+            {
+                printf("\n");
+            }
+        }
+    }
+    
+    // Inverse S-box and inverse T-tables for decryption in aes_ttable.h
+    uint8_t inv_sbox[256];
+    for (size_t i = 0; i < 256; ++i)
+    {
+        inv_sbox[sbox[i]] = (uint8_t) i;
+    }
+    
+    printf("Inverse S-box\n");
+    printf("{");
+    for (size_t i = 0; i < 256; ++i)
+    {
+        printf("0x%02hhx", inv_sbox[i]);
+        
+        if (i == 255)
+        {
+            printf("};");
+        }
+        else
+        {
+            printf(", ");
+        }
+        
+        if (i % 16 == 15)
+        {
+            printf("\n");
+        }
+    }
+    
+    // Each word is {14*S'(x), 9*S'(x), 13*S'(x), 11*S'(x)} in little endian
+    // byte order, where S' is the inverse S-box
+    for (size_t table = 0; table < 4; ++table)
+    {
+        printf("Inverse T-table Td%zu\n", table);
+        printf("{");
+        for (size_t i = 0; i < 256; ++i)
+        {
+            uint8_t s = inv_sbox[i];
+            uint32_t word = (uint32_t) GFMul(s, 0x0e)       |
+                            (uint32_t) GFMul(s, 0x09) << 8  |
+                            (uint32_t) GFMul(s, 0x0d) << 16 |
+                            (uint32_t) GFMul(s, 0x0b) << 24;
+            if (table != 0)
+            {
+                word = word << (8*table) | word >> (32 - 8*table);
+            }
+            
+            printf("0x%08x", word);
+            
+            if (i == 255)
+            {
+                printf("};");
+            }
+            else
+            {
+                printf(", ");
+            }
+            
+            if (i % 8 == 7)
+            {
+                printf("\n");
+            }
+        }
+    }
+    
     return 0;
 }
@@ -8,6 +8,12 @@ void MixColumns(block_vector_t* const p_state);
 void AddRoundKey(block_vector_t* const p_state,
                  const aes_key_t* const p_key);
 
+/* Extracts row r of a column word */
+#define TTABLE_BYTE(w, r) (((w) >> (8*(r))) & 0xff)
+
+/* Entries in each of the four T-tables */
+#define TTABLE_SIZE 256
+
 __constant uchar16 shift_rows_mask = {0,  5,  10, 15,
                                       4,  9,  14, 3,
                                       8,  13, 2,  7,
@@ -16,13 +22,21 @@ __constant uchar16 shift_rows_mask = {0,  5,  10, 15,
  * Precondition: p_key_sched should be initialized with KeyExpansion
  *               before using the cipher, since the key schedule is
  *               the same for every 128-bit block.
+ * Each kernel passes a constant num_rounds so the loop is fully unrolled.
  */
-__kernel void AesCipher128(__constant block_vector_t* p_inputs, 
-                           __global block_vector_t* p_outputs,
-                           __global const key_schedule_t* p_key_sched,
-                           uint64_t idx_offset)
+inline void AesCipher(__constant block_vector_t* p_inputs,
+                      __global block_vector_t* p_outputs,
+                      __global const key_schedule_t* p_key_sched,
+                      uint64_t idx_offset,
+                      uint64_t block_count,
+                      const uint8_t num_rounds)
 {
+    // The global size is rounded up to a whole number of work-groups
     size_t idx = get_global_id(0);
+    if (idx >= block_count)
+    {
+        return;
+    }
     
     // Treat counter as big endian
     counter_t counter;
@@ -35,68 +49,219 @@ __kernel void AesCipher128(__constant block_vector_t* p_inputs,
     key_schedule_t key_sched = *p_key_sched;
     
     AddRoundKey(&state, &(key_sched.k[0]));
-
-    // Round 1
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(key_sched.k[1]));
     
-    // Round 2
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(key_sched.k[2]));
-    
-    // Round 3
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(key_sched.k[3]));
+    // The last round is a little different, so it is excluded
+    #pragma unroll
+    for (uint8_t round = 1; round < num_rounds; ++round)
+    {
+        SubBytes(&state);
+        ShiftRows(&state);
+        MixColumns(&state);
+        AddRoundKey(&state, &(key_sched.k[round]));
+    }
     
-    // Round 4
+    // Final round excludes MixColumns
     SubBytes(&state);
     ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(key_sched.k[4]));
+    AddRoundKey(&state, &(key_sched.k[num_rounds]));
     
-    // Round 5
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(key_sched.k[5]));
-    
-    // Round 6
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(key_sched.k[6]));
-    
-    // Round 7
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(key_sched.k[7]));
-    
-    // Round 8
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(key_sched.k[8]));
+    // Save output
+    p_outputs[idx] = p_inputs[idx] ^ state;
+}
+
+__kernel void AesCipher128(__constant block_vector_t* p_inputs, 
+                           __global block_vector_t* p_outputs,
+                           __global const key_schedule_t* p_key_sched,
+                           uint64_t idx_offset,
+                           uint64_t block_count)
+{
+    AesCipher(p_inputs, p_outputs, p_key_sched, idx_offset, block_count, NUM_ROUNDS_128);
+}
+
+__kernel void AesCipher192(__constant block_vector_t* p_inputs, 
+                           __global block_vector_t* p_outputs,
+                           __global const key_schedule_t* p_key_sched,
+                           uint64_t idx_offset,
+                           uint64_t block_count)
+{
+    AesCipher(p_inputs, p_outputs, p_key_sched, idx_offset, block_count, NUM_ROUNDS_192);
+}
+
+__kernel void AesCipher256(__constant block_vector_t* p_inputs, 
+                           __global block_vector_t* p_outputs,
+                           __global const key_schedule_t* p_key_sched,
+                           uint64_t idx_offset,
+                           uint64_t block_count)
+{
+    AesCipher(p_inputs, p_outputs, p_key_sched, idx_offset, block_count, NUM_ROUNDS_256);
+}
+
+/*
+ * Scattered lookups into constant memory are served one address at a
+ * time, so the kernels above stall on sbox[] and GFMulBy2/3[].  This
+ * variant has each work-group build the four T-tables (see aes_ttable.h),
+ * the S-box and the key schedule in local memory, where lookups from
+ * different work-items proceed in parallel.  Each work-item then
+ * encrypts blocks_per_item contiguous blocks, which spreads the cost of
+ * building the tables and reads whole blocks as vectors.
+ * Words are little endian, so byte r of a column word is row r.
+ */
+inline void AesCipherTTable(__global const block_vector_t* p_inputs,
+                            __global block_vector_t* p_outputs,
+                            __global const key_schedule_t* p_key_sched,
+                            uint64_t idx_offset,
+                            uint64_t block_count,
+                            uint blocks_per_item,
+                            __local uint* p_te,
+                            __local uint8_t* p_sbox,
+                            __local uint4* p_keys,
+                            const uint8_t num_rounds)
+{
+    // Te0 holds the column {2s, s, s, 3s}; Te1-Te3 are its rotations
+    for (size_t i = get_local_id(0); i < TTABLE_SIZE; i += get_local_size(0))
+    {
+        uint8_t s = sbox[i];
+        uint te0 = (uint) GFMulBy2[s] |
+                   ((uint) s << 8) |
+                   ((uint) s << 16) |
+                   ((uint) GFMulBy3[s] << 24);
+        p_te[i] = te0;
+        p_te[TTABLE_SIZE + i] = rotate(te0, 8u);
+        p_te[2*TTABLE_SIZE + i] = rotate(te0, 16u);
+        p_te[3*TTABLE_SIZE + i] = rotate(te0, 24u);
+        p_sbox[i] = s;
+    }
+    for (size_t i = get_local_id(0); i <= num_rounds; i += get_local_size(0))
+    {
+        p_keys[i] = as_uint4(p_key_sched->k[i]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
     
-    // Round 9
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(key_sched.k[9]));
+    uint64_t first = get_global_id(0)*blocks_per_item;
+    uint64_t last = min(first + blocks_per_item, block_count);
+    for (uint64_t idx = first; idx < last; ++idx)
+    {
+        // Treat counter as big endian
+        counter_t counter;
+        counter.as_scalar[0] = 0;
+        counter.as_scalar[1] = idx + idx_offset;
+        counter.as_vector.s89abcdef = counter.as_vector.sfedcba98;
+        
+        uint4 state = as_uint4(counter.as_vector) ^ p_keys[0];
+        uint4 temp;
+        
+        // ShiftRows is folded into which column each row is read from
+        #pragma unroll
+        for (uint8_t round = 1; round < num_rounds; ++round)
+        {
+            temp.s0 = p_te[TTABLE_BYTE(state.s0, 0)] ^
+                      p_te[TTABLE_SIZE + TTABLE_BYTE(state.s1, 1)] ^
+                      p_te[2*TTABLE_SIZE + TTABLE_BYTE(state.s2, 2)] ^
+                      p_te[3*TTABLE_SIZE + TTABLE_BYTE(state.s3, 3)];
+            temp.s1 = p_te[TTABLE_BYTE(state.s1, 0)] ^
+                      p_te[TTABLE_SIZE + TTABLE_BYTE(state.s2, 1)] ^
+                      p_te[2*TTABLE_SIZE + TTABLE_BYTE(state.s3, 2)] ^
+                      p_te[3*TTABLE_SIZE + TTABLE_BYTE(state.s0, 3)];
+            temp.s2 = p_te[TTABLE_BYTE(state.s2, 0)] ^
+                      p_te[TTABLE_SIZE + TTABLE_BYTE(state.s3, 1)] ^
+                      p_te[2*TTABLE_SIZE + TTABLE_BYTE(state.s0, 2)] ^
+                      p_te[3*TTABLE_SIZE + TTABLE_BYTE(state.s1, 3)];
+            temp.s3 = p_te[TTABLE_BYTE(state.s3, 0)] ^
+                      p_te[TTABLE_SIZE + TTABLE_BYTE(state.s0, 1)] ^
+                      p_te[2*TTABLE_SIZE + TTABLE_BYTE(state.s1, 2)] ^
+                      p_te[3*TTABLE_SIZE + TTABLE_BYTE(state.s2, 3)];
+            state = temp ^ p_keys[round];
+        }
+        
+        // Final round excludes MixColumns, so use the plain S-box
+        temp.s0 = (uint) p_sbox[TTABLE_BYTE(state.s0, 0)] |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s1, 1)] << 8) |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s2, 2)] << 16) |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s3, 3)] << 24);
+        temp.s1 = (uint) p_sbox[TTABLE_BYTE(state.s1, 0)] |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s2, 1)] << 8) |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s3, 2)] << 16) |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s0, 3)] << 24);
+        temp.s2 = (uint) p_sbox[TTABLE_BYTE(state.s2, 0)] |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s3, 1)] << 8) |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s0, 2)] << 16) |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s1, 3)] << 24);
+        temp.s3 = (uint) p_sbox[TTABLE_BYTE(state.s3, 0)] |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s0, 1)] << 8) |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s1, 2)] << 16) |
+                  ((uint) p_sbox[TTABLE_BYTE(state.s2, 3)] << 24);
+        state = temp ^ p_keys[num_rounds];
+        
+        // Save output
+        p_outputs[idx] = p_inputs[idx] ^ as_uchar16(state);
+    }
+}
 
-    // Round 10 (final round excludes MixColumns)
-    SubBytes(&state);
-    ShiftRows(&state);
-    AddRoundKey(&state, &(key_sched.k[10]));
+/* Local memory can only be declared in a kernel, so each one has its own */
+__kernel void AesCipher128TTable(__global const block_vector_t* p_inputs,
+                                 __global block_vector_t* p_outputs,
+                                 __global const key_schedule_t* p_key_sched,
+                                 uint64_t idx_offset,
+                                 uint64_t block_count,
+                                 uint blocks_per_item)
+{
+    __local uint te[4*TTABLE_SIZE];
+    __local uint8_t local_sbox[TTABLE_SIZE];
+    __local uint4 keys[MAX_ROUNDS+1];
+    AesCipherTTable(p_inputs,
+                    p_outputs,
+                    p_key_sched,
+                    idx_offset,
+                    block_count,
+                    blocks_per_item,
+                    te,
+                    local_sbox,
+                    keys,
+                    NUM_ROUNDS_128);
+}
 
-    // Save output
-    p_outputs[idx] = p_inputs[idx] ^ state;
+__kernel void AesCipher192TTable(__global const block_vector_t* p_inputs,
+                                 __global block_vector_t* p_outputs,
+                                 __global const key_schedule_t* p_key_sched,
+                                 uint64_t idx_offset,
+                                 uint64_t block_count,
+                                 uint blocks_per_item)
+{
+    __local uint te[4*TTABLE_SIZE];
+    __local uint8_t local_sbox[TTABLE_SIZE];
+    __local uint4 keys[MAX_ROUNDS+1];
+    AesCipherTTable(p_inputs,
+                    p_outputs,
+                    p_key_sched,
+                    idx_offset,
+                    block_count,
+                    blocks_per_item,
+                    te,
+                    local_sbox,
+                    keys,
+                    NUM_ROUNDS_192);
+}
+
+__kernel void AesCipher256TTable(__global const block_vector_t* p_inputs,
+                                 __global block_vector_t* p_outputs,
+                                 __global const key_schedule_t* p_key_sched,
+                                 uint64_t idx_offset,
+                                 uint64_t block_count,
+                                 uint blocks_per_item)
+{
+    __local uint te[4*TTABLE_SIZE];
+    __local uint8_t local_sbox[TTABLE_SIZE];
+    __local uint4 keys[MAX_ROUNDS+1];
+    AesCipherTTable(p_inputs,
+                    p_outputs,
+                    p_key_sched,
+                    idx_offset,
+                    block_count,
+                    blocks_per_item,
+                    te,
+                    local_sbox,
+                    keys,
+                    NUM_ROUNDS_256);
 }
 
 void SubBytes(block_vector_t* const p_state)
@@ -135,7 +300,7 @@ void MixColumns(block_vector_t* const p_state)
     // This is the matrix-multiply step
     // Note that this is not a simple 8-bit integer multiply
     // The multiplication is done over Galois fields 
-
+    
     // First column
     // Store the previous column states
     uchar4 b;
@@ -149,7 +314,7 @@ void MixColumns(block_vector_t* const p_state)
     p_state->s1 = b.s0           ^ GFMulBy2[b.s1] ^ GFMulBy3[b.s2] ^ b.s3;
     p_state->s2 = b.s0           ^ b.s1           ^ GFMulBy2[b.s2] ^ GFMulBy3[b.s3];
     p_state->s3 = GFMulBy3[b.s0] ^ b.s1           ^ b.s2           ^ GFMulBy2[b.s3];
-                                  
+    
     // Second column
     // Store the previous column states
     b.s0 = p_state->s4;
@@ -162,7 +327,7 @@ void MixColumns(block_vector_t* const p_state)
     p_state->s5 = b.s0           ^ GFMulBy2[b.s1] ^ GFMulBy3[b.s2] ^ b.s3;
     p_state->s6 = b.s0           ^ b.s1           ^ GFMulBy2[b.s2] ^ GFMulBy3[b.s3];
     p_state->s7 = GFMulBy3[b.s0] ^ b.s1           ^ b.s2           ^ GFMulBy2[b.s3];
-                                  
+    
     // Third column
     // Store the previous column states
     b.s0 = p_state->s8;
@@ -175,7 +340,7 @@ void MixColumns(block_vector_t* const p_state)
     p_state->s9 = b.s0           ^ GFMulBy2[b.s1] ^ GFMulBy3[b.s2] ^ b.s3;
     p_state->sa = b.s0           ^ b.s1           ^ GFMulBy2[b.s2] ^ GFMulBy3[b.s3];
     p_state->sb = GFMulBy3[b.s0] ^ b.s1           ^ b.s2           ^ GFMulBy2[b.s3];
-                                  
+    
     // Fourth column
     // Store the previous column states
     b.s0 = p_state->sc;
@@ -18,10 +18,12 @@ typedef ulong uint64_t;
  *   work as expected (i.e. sizeof() returns length*sizeof(element) and
  *   avoid pointer decay when passing to functions).  It's more boilerplate
  *   code than I'd like, but it enforces code correctness.
- * - The current implementation makes a lot of assumptions that break down
- *   with AES-192 and AES-256. This is partly for simplicity and partly for
- *   performance.  The compiler can do a better job of optimizing the program
- *   if the key length and number of rounds are compile-time constants.
+ * - AES-128, AES-192 and AES-256 only differ in key length and number of
+ *   rounds.  The compiler can do a better job of optimizing the program
+ *   if the key length and number of rounds are compile-time constants, so
+ *   each cipher has a generic body that is always inlined into one wrapper
+ *   per key size (e.g. AesCipher128/AesCipher192/AesCipher256).
+ *   key_schedule_t is sized for the largest key.
  * - OpenCL C doesn't support everything in this file, so it's masked out by
  *   the preprocessor.
  */
@@ -34,10 +36,21 @@ typedef ulong uint64_t;
 #define BITS_PER_BYTE 8
 #define BLOCK_SIZE 4                 /* in words */
 #define WORD_SIZE sizeof(uint32_t)   /* in bytes */
-#define KEY_LENGTH 4                 /* in words, AES-128 ONLY */
 
-/* These apply only to AES-128 */
-#define NUM_ROUNDS 10
+/* Key length (in words) and number of rounds for each key size */
+#define KEY_LENGTH_128 4
+#define KEY_LENGTH_192 6
+#define KEY_LENGTH_256 8
+#define NUM_ROUNDS_128 10
+#define NUM_ROUNDS_192 12
+#define NUM_ROUNDS_256 14
+#define MAX_KEY_LENGTH KEY_LENGTH_256
+#define MAX_ROUNDS     NUM_ROUNDS_256
+
+/* Conversions from a key size in bits (128, 192 or 256) */
+#define KEY_LENGTH_FOR(key_bits) ((key_bits)/(BITS_PER_BYTE*WORD_SIZE))
+#define NUM_ROUNDS_FOR(key_bits) (KEY_LENGTH_FOR(key_bits) + 6)
+#define KEY_SIZE_INDEX(key_bits) (((key_bits) - 128)/64)
 
 #ifndef AES_CL
 
@@ -48,13 +61,20 @@ typedef union block_vector_t {
     __m128i  i;
     u8x16    vec;
 } block_vector_t;
+/* A single round key */
 typedef union aes_key_t {
-    uint8_t  b[KEY_LENGTH*WORD_SIZE];
-    uint32_t w[KEY_LENGTH];
+    uint8_t  b[BLOCK_SIZE*WORD_SIZE];
+    uint32_t w[BLOCK_SIZE];
     __m128i  i;
 } aes_key_t;
+/* The cipher key, which is only partly used by AES-128 and AES-192 */
+typedef union cipher_key_t {
+    uint8_t  b[MAX_KEY_LENGTH*WORD_SIZE];
+    uint32_t w[MAX_KEY_LENGTH];
+    __m128i  i[MAX_KEY_LENGTH/BLOCK_SIZE];
+} cipher_key_t;
 typedef struct key_schedule_t {
-    aes_key_t k[NUM_ROUNDS+1];
+    aes_key_t k[MAX_ROUNDS+1];
 } key_schedule_t;
 
 #else
@@ -62,7 +82,7 @@ typedef struct key_schedule_t {
 typedef uchar16 block_vector_t;
 typedef uchar16 aes_key_t;
 typedef struct key_schedule_t {
-    aes_key_t k[NUM_ROUNDS+1];
+    aes_key_t k[MAX_ROUNDS+1];
 } key_schedule_t;
 
 #endif
@@ -110,9 +130,18 @@ const uint32_t Rcon[] = {0x00000000,
                          0x1b000000,
                          0x36000000};
 
+/* Every batched CTR kernel encrypts count blocks starting at *p_counter,
+ * then advances *p_counter past the last block encrypted */
+typedef void (*ctr_pipeline_t)(const block_vector_t* const p_input,
+                               block_vector_t* const p_output,
+                               const size_t count,
+                               const key_schedule_t* const p_key_sched,
+                               __m128i* const p_counter);
+
 typedef struct aes_file_t {
     block_vector_t* p_data;
-    size_t size_blocks;
+    size_t size_blocks;   /* Whole blocks only */
+    size_t size_bytes;    /* Includes a final partial block, if any */
     int fd;
 } aes_file_t;
 
@@ -120,9 +149,12 @@ typedef struct thread_args_t {
     aes_file_t* p_input;
     aes_file_t* p_output;
     key_schedule_t* p_key_sched;
+    size_t base;         /* Block of the file at p_data[0] (see stream_io.h) */
     size_t offset;
     size_t count;
+    size_t tail_bytes;   /* Partial block after the last whole block */
     size_t nonce;
+    __m128i ghash;       /* GHASH of this chunk's ciphertext (GCM only) */
 } thread_args_t;
 
 #endif
@@ -196,6 +228,16 @@ void BigEndianIncrement(__m128i* p_input)
         }
     }
 }
+
+/*
+ * Returns the CTR counter block for the given block of the stream: the
+ * 128-bit big endian block number, as BigEndianIncrement() counts it.
+ * Any chunk seeded with this continues the one stream exactly.
+ */
+__m128i CtrCounterBlock(const uint64_t block)
+{
+    return _mm_set_epi64x((long long) __builtin_bswap64(block), 0);
+}
 #else
 #endif
 
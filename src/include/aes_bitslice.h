@@ -0,0 +1,448 @@
+#ifndef AESBITSLICE_H
+#define AESBITSLICE_H
+
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "aes.h"
+
+/**
+ *  Bitsliced AES-128, AES-192 and AES-256 in CTR mode.
+ *  Several counter blocks are transposed so that each plane holds one bit
+ *  position of every byte of every block.  SubBytes then becomes a Boolean
+ *  circuit evaluated on whole registers, so there are no secret-dependent
+ *  table lookups (unlike sbox[] in aes_cpu.h) and no cache-timing leaks.
+ *
+ *  Plane layout: bit j of byte p of plane b is bit b of state byte p of
+ *  block j.  A plane is 16 bytes (8 blocks) per 128-bit lane, and wider
+ *  registers hold 2 or 4 lanes of 8 blocks side by side.
+ *
+ *  The plane width follows the ISA the file is compiled for (-march).
+ */
+
+#if defined(__AVX512BW__)
+#define BITSLICE_BLOCKS 32
+#elif defined(__AVX2__)
+#define BITSLICE_BLOCKS 16
+#else
+#define BITSLICE_BLOCKS 8
+#endif
+
+/* Each 128-bit lane of a plane holds 8 blocks */
+#define BITSLICE_LANES (BITSLICE_BLOCKS/BITS_PER_BYTE)
+
+typedef uint64_t bs_plane_t __attribute__ ((vector_size (BITSLICE_LANES*16)));
+
+typedef union bs_state_t {
+    bs_plane_t     plane[BITS_PER_BYTE];
+    block_vector_t block[BITS_PER_BYTE][BITSLICE_LANES];
+} bs_state_t;
+
+typedef struct bs_key_schedule_t {
+    bs_plane_t k[MAX_ROUNDS+1][BITS_PER_BYTE];
+} bs_key_schedule_t;
+
+/* Byte shuffles within each 128-bit lane of a plane */
+typedef struct bs_masks_t {
+    bs_plane_t shift_rows;
+    bs_plane_t rotate_1;   /* row r of each column takes row r+1 */
+    bs_plane_t rotate_2;   /* row r of each column takes row r+2 */
+} bs_masks_t;
+
+void BitsliceTranspose(bs_state_t* const p_state);
+void BitsliceSubBytes(bs_state_t* const p_state);
+void BitsliceShiftRows(bs_state_t* const p_state,
+                       const bs_masks_t* const p_masks);
+void BitsliceMixColumns(bs_state_t* const p_state,
+                        const bs_masks_t* const p_masks);
+void BitsliceAddRoundKey(bs_state_t* const p_state,
+                         const bs_plane_t* const p_key);
+
+bs_plane_t BitsliceShuffle(const bs_plane_t in, const bs_plane_t mask)
+{
+#if defined(__AVX512BW__)
+    return (bs_plane_t) _mm512_shuffle_epi8((__m512i) in, (__m512i) mask);
+#elif defined(__AVX2__)
+    return (bs_plane_t) _mm256_shuffle_epi8((__m256i) in, (__m256i) mask);
+#else
+    return (bs_plane_t) _mm_shuffle_epi8((__m128i) in, (__m128i) mask);
+#endif
+}
+
+void BitsliceMasks(bs_masks_t* const p_masks)
+{
+    // Same permutation as shift_rows_mask in aes_cpu.h
+    const uint8_t shift_rows[16] = {0,  5,  10, 15,
+                                    4,  9,  14, 3,
+                                    8,  13, 2,  7,
+                                    12, 1,  6,  11};
+    uint8_t* p_shift_rows = (uint8_t*) &(p_masks->shift_rows);
+    uint8_t* p_rotate_1 = (uint8_t*) &(p_masks->rotate_1);
+    uint8_t* p_rotate_2 = (uint8_t*) &(p_masks->rotate_2);
+    
+    for (uint8_t lane = 0; lane < BITSLICE_LANES; ++lane)
+    {
+        for (uint8_t byte = 0; byte < 16; ++byte)
+        {
+            uint8_t column = byte & ~0x03;
+            uint8_t row = byte & 0x03;
+            p_shift_rows[16*lane + byte] = shift_rows[byte];
+            p_rotate_1[16*lane + byte] = column + ((row + 1) & 0x03);
+            p_rotate_2[16*lane + byte] = column + ((row + 2) & 0x03);
+        }
+    }
+}
+
+/*
+ * Expands every round key into planes.  All blocks share the key, so each
+ * byte of a plane is either all zeros or all ones.
+ */
+void BitsliceKeySchedule(const key_schedule_t* const p_key_sched,
+                         bs_key_schedule_t* const p_bs_key_sched,
+                         const uint8_t num_rounds)
+{
+    for (uint8_t round = 0; round <= num_rounds; ++round)
+    {
+        for (uint8_t bit = 0; bit < BITS_PER_BYTE; ++bit)
+        {
+            uint8_t* p_plane = (uint8_t*) &(p_bs_key_sched->k[round][bit]);
+            for (uint8_t byte = 0; byte < sizeof(bs_plane_t); ++byte)
+            {
+                uint8_t key_byte = p_key_sched->k[round].b[byte % 16];
+                p_plane[byte] = -((key_byte >> bit) & 0x01);
+            }
+        }
+    }
+}
+
+/*
+ * Encrypts count blocks in CTR mode, BITSLICE_BLOCKS at a time.
+ * A final partial batch still encrypts a whole batch, but only the
+ * blocks that exist are written.
+ *
+ * Precondition: p_key_sched should be initialized with KeyExpansion
+ *               from aes_cpu.h.
+ * Postcondition: *p_counter is advanced past the last block encrypted.
+ */
+static inline __attribute__((always_inline))
+void AesCtrBitslice(const block_vector_t* const p_input,
+                    block_vector_t* const p_output,
+                    const size_t count,
+                    const key_schedule_t* const p_key_sched,
+                    __m128i* const p_counter,
+                    const uint8_t num_rounds)
+{
+    // Done once per call, not once per batch
+    bs_key_schedule_t bs_key_sched;
+    BitsliceKeySchedule(p_key_sched, &bs_key_sched, num_rounds);
+    bs_masks_t masks;
+    BitsliceMasks(&masks);
+    
+    for (size_t block = 0; block < count; block += BITSLICE_BLOCKS)
+    {
+        size_t batch_count = count - block < BITSLICE_BLOCKS ?
+                             count - block :
+                             BITSLICE_BLOCKS;
+        
+        // Block 8*lane + j is row j of that lane before transposing
+        // Slots past the end of the data just repeat the next counter
+        bs_state_t state;
+        for (size_t i = 0; i < BITSLICE_BLOCKS; ++i)
+        {
+            state.block[i % 8][i / 8].i = *p_counter;
+            if (i < batch_count)
+            {
+                BigEndianIncrement(p_counter);
+            }
+        }
+        
+        BitsliceTranspose(&state);
+        BitsliceAddRoundKey(&state, bs_key_sched.k[0]);
+        
+        for (uint8_t round = 1; round < num_rounds; ++round)
+        {
+            BitsliceSubBytes(&state);
+            BitsliceShiftRows(&state, &masks);
+            BitsliceMixColumns(&state, &masks);
+            BitsliceAddRoundKey(&state, bs_key_sched.k[round]);
+        }
+        
+        // Last round (no MixColumns)
+        BitsliceSubBytes(&state);
+        BitsliceShiftRows(&state, &masks);
+        BitsliceAddRoundKey(&state, bs_key_sched.k[num_rounds]);
+        
+        // The transpose is its own inverse
+        BitsliceTranspose(&state);
+        
+        // XOR the encrypted counters with the input
+        for (size_t i = 0; i < batch_count; ++i)
+        {
+            p_output[block+i].i = state.block[i % 8][i / 8].i ^
+                                  p_input[block+i].i;
+        }
+    }
+}
+
+void AesCtrBitslice128(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrBitslice(p_input, p_output, count, p_key_sched, p_counter,
+                   NUM_ROUNDS_128);
+}
+
+void AesCtrBitslice192(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrBitslice(p_input, p_output, count, p_key_sched, p_counter,
+                   NUM_ROUNDS_192);
+}
+
+void AesCtrBitslice256(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrBitslice(p_input, p_output, count, p_key_sched, p_counter,
+                   NUM_ROUNDS_256);
+}
+
+/* Indexed by KEY_SIZE_INDEX() */
+const ctr_pipeline_t bitslice_pipelines[] = {AesCtrBitslice128,
+                                             AesCtrBitslice192,
+                                             AesCtrBitslice256};
+
+/* Swaps the bits of b selected by mask with the bits n places up in a */
+#define SWAPMOVE(a, b, n, mask)                       \
+    do {                                              \
+        bs_plane_t t = (((a) >> (n)) ^ (b)) & (mask); \
+        (b) ^= t;                                     \
+        (a) ^= t << (n);                              \
+    } while (0)
+
+void BitsliceTranspose(bs_state_t* const p_state)
+{
+    // An 8x8 bit matrix transpose on every byte position at once
+    // Row j is block j and column b is bit b
+    const bs_plane_t m1 = (bs_plane_t) {0} + 0x5555555555555555;
+    const bs_plane_t m2 = (bs_plane_t) {0} + 0x3333333333333333;
+    const bs_plane_t m4 = (bs_plane_t) {0} + 0x0f0f0f0f0f0f0f0f;
+    bs_plane_t* x = p_state->plane;
+    
+    SWAPMOVE(x[0], x[1], 1, m1);
+    SWAPMOVE(x[2], x[3], 1, m1);
+    SWAPMOVE(x[4], x[5], 1, m1);
+    SWAPMOVE(x[6], x[7], 1, m1);
+    
+    SWAPMOVE(x[0], x[2], 2, m2);
+    SWAPMOVE(x[1], x[3], 2, m2);
+    SWAPMOVE(x[4], x[6], 2, m2);
+    SWAPMOVE(x[5], x[7], 2, m2);
+    
+    SWAPMOVE(x[0], x[4], 4, m4);
+    SWAPMOVE(x[1], x[5], 4, m4);
+    SWAPMOVE(x[2], x[6], 4, m4);
+    SWAPMOVE(x[3], x[7], 4, m4);
+}
+
+void BitsliceSubBytes(bs_state_t* const p_state)
+{
+    // Boyar and Peralta's 113 gate circuit for the AES S-box:
+    // a linear layer, a shared non-linear core for the GF(2^8) inverse,
+    // and a linear layer that also applies the affine transform.
+    // x0 is the most significant bit.
+    bs_plane_t* q = p_state->plane;
+    bs_plane_t x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4];
+    bs_plane_t x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+    
+    // Top linear transformation
+    bs_plane_t y14 = x3 ^ x5;
+    bs_plane_t y13 = x0 ^ x6;
+    bs_plane_t y9  = x0 ^ x3;
+    bs_plane_t y8  = x0 ^ x5;
+    bs_plane_t t0  = x1 ^ x2;
+    bs_plane_t y1  = t0 ^ x7;
+    bs_plane_t y4  = y1 ^ x3;
+    bs_plane_t y12 = y13 ^ y14;
+    bs_plane_t y2  = y1 ^ x0;
+    bs_plane_t y5  = y1 ^ x6;
+    bs_plane_t y3  = y5 ^ y8;
+    bs_plane_t t1  = x4 ^ y12;
+    bs_plane_t y15 = t1 ^ x5;
+    bs_plane_t y20 = t1 ^ x1;
+    bs_plane_t y6  = y15 ^ x7;
+    bs_plane_t y10 = y15 ^ t0;
+    bs_plane_t y11 = y20 ^ y9;
+    bs_plane_t y7  = x7 ^ y11;
+    bs_plane_t y17 = y10 ^ y11;
+    bs_plane_t y19 = y10 ^ y8;
+    bs_plane_t y16 = t0 ^ y11;
+    bs_plane_t y21 = y13 ^ y16;
+    bs_plane_t y18 = x0 ^ y16;
+    
+    // Non-linear section
+    bs_plane_t t2  = y12 & y15;
+    bs_plane_t t3  = y3 & y6;
+    bs_plane_t t4  = t3 ^ t2;
+    bs_plane_t t5  = y4 & x7;
+    bs_plane_t t6  = t5 ^ t2;
+    bs_plane_t t7  = y13 & y16;
+    bs_plane_t t8  = y5 & y1;
+    bs_plane_t t9  = t8 ^ t7;
+    bs_plane_t t10 = y2 & y7;
+    bs_plane_t t11 = t10 ^ t7;
+    bs_plane_t t12 = y9 & y11;
+    bs_plane_t t13 = y14 & y17;
+    bs_plane_t t14 = t13 ^ t12;
+    bs_plane_t t15 = y8 & y10;
+    bs_plane_t t16 = t15 ^ t12;
+    bs_plane_t t17 = t4 ^ t14;
+    bs_plane_t t18 = t6 ^ t16;
+    bs_plane_t t19 = t9 ^ t14;
+    bs_plane_t t20 = t11 ^ t16;
+    bs_plane_t t21 = t17 ^ y20;
+    bs_plane_t t22 = t18 ^ y19;
+    bs_plane_t t23 = t19 ^ y21;
+    bs_plane_t t24 = t20 ^ y18;
+    
+    bs_plane_t t25 = t21 ^ t22;
+    bs_plane_t t26 = t21 & t23;
+    bs_plane_t t27 = t24 ^ t26;
+    bs_plane_t t28 = t25 & t27;
+    bs_plane_t t29 = t28 ^ t22;
+    bs_plane_t t30 = t23 ^ t24;
+    bs_plane_t t31 = t22 ^ t26;
+    bs_plane_t t32 = t31 & t30;
+    bs_plane_t t33 = t32 ^ t24;
+    bs_plane_t t34 = t23 ^ t33;
+    bs_plane_t t35 = t27 ^ t33;
+    bs_plane_t t36 = t24 & t35;
+    bs_plane_t t37 = t36 ^ t34;
+    bs_plane_t t38 = t27 ^ t36;
+    bs_plane_t t39 = t29 & t38;
+    bs_plane_t t40 = t25 ^ t39;
+    
+    bs_plane_t t41 = t40 ^ t37;
+    bs_plane_t t42 = t29 ^ t33;
+    bs_plane_t t43 = t29 ^ t40;
+    bs_plane_t t44 = t33 ^ t37;
+    bs_plane_t t45 = t42 ^ t41;
+    bs_plane_t z0  = t44 & y15;
+    bs_plane_t z1  = t37 & y6;
+    bs_plane_t z2  = t33 & x7;
+    bs_plane_t z3  = t43 & y16;
+    bs_plane_t z4  = t40 & y1;
+    bs_plane_t z5  = t29 & y7;
+    bs_plane_t z6  = t42 & y11;
+    bs_plane_t z7  = t45 & y17;
+    bs_plane_t z8  = t41 & y10;
+    bs_plane_t z9  = t44 & y12;
+    bs_plane_t z10 = t37 & y3;
+    bs_plane_t z11 = t33 & y4;
+    bs_plane_t z12 = t43 & y13;
+    bs_plane_t z13 = t40 & y5;
+    bs_plane_t z14 = t29 & y2;
+    bs_plane_t z15 = t42 & y9;
+    bs_plane_t z16 = t45 & y14;
+    bs_plane_t z17 = t41 & y8;
+    
+    // Bottom linear transformation
+    bs_plane_t t46 = z15 ^ z16;
+    bs_plane_t t47 = z10 ^ z11;
+    bs_plane_t t48 = z5 ^ z13;
+    bs_plane_t t49 = z9 ^ z10;
+    bs_plane_t t50 = z2 ^ z12;
+    bs_plane_t t51 = z2 ^ z5;
+    bs_plane_t t52 = z7 ^ z8;
+    bs_plane_t t53 = z0 ^ z3;
+    bs_plane_t t54 = z6 ^ z7;
+    bs_plane_t t55 = z16 ^ z17;
+    bs_plane_t t56 = z12 ^ t48;
+    bs_plane_t t57 = t50 ^ t53;
+    bs_plane_t t58 = z4 ^ t46;
+    bs_plane_t t59 = z3 ^ t54;
+    bs_plane_t t60 = t46 ^ t57;
+    bs_plane_t t61 = z14 ^ t57;
+    bs_plane_t t62 = t52 ^ t58;
+    bs_plane_t t63 = t49 ^ t58;
+    bs_plane_t t64 = z4 ^ t59;
+    bs_plane_t t65 = t61 ^ t62;
+    bs_plane_t t66 = z1 ^ t63;
+    bs_plane_t s0  = t59 ^ t63;
+    bs_plane_t s6  = t56 ^ ~t62;
+    bs_plane_t s7  = t48 ^ ~t60;
+    bs_plane_t t67 = t64 ^ t65;
+    bs_plane_t s3  = t53 ^ t66;
+    bs_plane_t s4  = t51 ^ t66;
+    bs_plane_t s5  = t47 ^ t65;
+    bs_plane_t s1  = t64 ^ ~s3;
+    bs_plane_t s2  = t55 ^ ~t67;
+    
+    q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+    q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+void BitsliceShiftRows(bs_state_t* const p_state,
+                       const bs_masks_t* const p_masks)
+{
+    // Byte positions move, so every plane gets the same shuffle
+    for (uint8_t bit = 0; bit < BITS_PER_BYTE; ++bit)
+    {
+        p_state->plane[bit] = BitsliceShuffle(p_state->plane[bit],
+                                              p_masks->shift_rows);
+    }
+}
+
+void BitsliceMixColumns(bs_state_t* const p_state,
+                        const bs_masks_t* const p_masks)
+{
+    // For each column, with a_r the byte in row r:
+    //   out_r = 2*a_r ^ 3*a_(r+1) ^ a_(r+2) ^ a_(r+3)
+    //         = 2*(a_r ^ a_(r+1)) ^ a_(r+1) ^ (a_(r+2) ^ a_(r+3))
+    // Rotating the rows turns every term into a shuffle of the planes
+    bs_plane_t* a = p_state->plane;
+    bs_plane_t a1[BITS_PER_BYTE];
+    bs_plane_t t[BITS_PER_BYTE];
+    for (uint8_t bit = 0; bit < BITS_PER_BYTE; ++bit)
+    {
+        a1[bit] = BitsliceShuffle(a[bit], p_masks->rotate_1);
+        t[bit] = a[bit] ^ a1[bit];
+    }
+    
+    // Multiplication by 2 shifts each byte up one bit and reduces by 0x1b,
+    // which on planes is a renaming plus XORs with the top plane
+    bs_plane_t t2[BITS_PER_BYTE];
+    t2[0] = t[7];
+    t2[1] = t[0] ^ t[7];
+    t2[2] = t[1];
+    t2[3] = t[2] ^ t[7];
+    t2[4] = t[3] ^ t[7];
+    t2[5] = t[4];
+    t2[6] = t[5];
+    t2[7] = t[6];
+    
+    for (uint8_t bit = 0; bit < BITS_PER_BYTE; ++bit)
+    {
+        a[bit] = t2[bit] ^ a1[bit] ^
+                 BitsliceShuffle(t[bit], p_masks->rotate_2);
+    }
+}
+
+void BitsliceAddRoundKey(bs_state_t* const p_state,
+                         const bs_plane_t* const p_key)
+{
+    for (uint8_t bit = 0; bit < BITS_PER_BYTE; ++bit)
+    {
+        p_state->plane[bit] ^= p_key[bit];
+    }
+}
+
+#endif
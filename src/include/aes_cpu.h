@@ -10,8 +10,9 @@
 
 uint32_t SubWord(uint32_t in);
 uint32_t RotWord(uint32_t in);
-void KeyExpansion(const aes_key_t* const p_key,
-                  key_schedule_t* const p_key_sched);
+void KeyExpansion(const cipher_key_t* const p_key,
+                  key_schedule_t* const p_key_sched,
+                  const uint16_t key_bits);
 
 uint8_t GFMul(uint8_t a, uint8_t b);
 
@@ -21,6 +22,12 @@ void MixColumns(block_vector_t* const p_state);
 void AddRoundKey(block_vector_t* const p_state,
                  const aes_key_t* const p_key);
 
+/* Every single-block software kernel shares AesCipher128's signature */
+typedef void (*cpu_cipher_t)(const block_vector_t* const p_input,
+                             block_vector_t* const p_output,
+                             const key_schedule_t* const p_key_sched,
+                             const __m128i counter);
+
 const u8x16 shift_rows_mask = {0,  5,  10, 15,
                                4,  9,  14, 3,
                                8,  13, 2,  7,
@@ -30,11 +37,15 @@ const u8x16 shift_rows_mask = {0,  5,  10, 15,
  * Precondition: p_key_sched should be initialized with KeyExpansion
  *               before using the cipher, since the key schedule is
  *               the same for every 128-bit block.
+ * This is only called with a constant num_rounds (see the wrappers below)
+ * so that the round loop is fully unrolled for each key size.
  */
-void AesCipher128(const block_vector_t* const p_input, 
-                  block_vector_t* const p_output,
-                  const key_schedule_t* const p_key_sched,
-                  const __m128i counter)
+static inline __attribute__((always_inline))
+void AesCipher(const block_vector_t* const p_input, 
+               block_vector_t* const p_output,
+               const key_schedule_t* const p_key_sched,
+               const __m128i counter,
+               const uint8_t num_rounds)
 {
     block_vector_t state;
     
@@ -42,73 +53,56 @@ void AesCipher128(const block_vector_t* const p_input,
     state.i = counter;
     
     AddRoundKey(&state, &(p_key_sched->k[0]));
-
-    // Manually unrolled loop
-    // Disassembled output did not suggest unrolling by compiler
-    
-    // Round 1
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(p_key_sched->k[1]));
-    
-    // Round 2
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(p_key_sched->k[2]));
-    
-    // Round 3
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(p_key_sched->k[3]));
-    
-    // Round 4
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(p_key_sched->k[4]));
-    
-    // Round 5
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(p_key_sched->k[5]));
-    
-    // Round 6
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(p_key_sched->k[6]));
-
-    // Round 7
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(p_key_sched->k[7]));
-    
-    // Round 8
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(p_key_sched->k[8]));
     
-    // Round 9
-    SubBytes(&state);
-    ShiftRows(&state);
-    MixColumns(&state);
-    AddRoundKey(&state, &(p_key_sched->k[9]));
+    // Disassembled output did not suggest unrolling by compiler,
+    // so ask for it explicitly
+    #pragma GCC unroll 16
+    for (uint8_t round = 1; round < num_rounds; ++round)
+    {
+        SubBytes(&state);
+        ShiftRows(&state);
+        MixColumns(&state);
+        AddRoundKey(&state, &(p_key_sched->k[round]));
+    }
     
-    // Round 10 (no MixColumns for last round)
+    // Last round (no MixColumns)
     SubBytes(&state);
     ShiftRows(&state);
-    AddRoundKey(&state, &(p_key_sched->k[10]));
+    AddRoundKey(&state, &(p_key_sched->k[num_rounds]));
 
     // XOR the encrypted counter with the input
     p_output->i = state.i ^ p_input->i;
 }
 
+void AesCipher128(const block_vector_t* const p_input, 
+                  block_vector_t* const p_output,
+                  const key_schedule_t* const p_key_sched,
+                  const __m128i counter)
+{
+    AesCipher(p_input, p_output, p_key_sched, counter, NUM_ROUNDS_128);
+}
+
+void AesCipher192(const block_vector_t* const p_input, 
+                  block_vector_t* const p_output,
+                  const key_schedule_t* const p_key_sched,
+                  const __m128i counter)
+{
+    AesCipher(p_input, p_output, p_key_sched, counter, NUM_ROUNDS_192);
+}
+
+void AesCipher256(const block_vector_t* const p_input, 
+                  block_vector_t* const p_output,
+                  const key_schedule_t* const p_key_sched,
+                  const __m128i counter)
+{
+    AesCipher(p_input, p_output, p_key_sched, counter, NUM_ROUNDS_256);
+}
+
+/* Indexed by KEY_SIZE_INDEX() */
+const cpu_cipher_t sbox_ciphers[] = {AesCipher128,
+                                     AesCipher192,
+                                     AesCipher256};
+
 void SubBytes(block_vector_t* const p_state)
 {
     // This is a simple lookup-table substitution
@@ -222,37 +216,45 @@ void AddRoundKey(block_vector_t* const p_state,
     p_state->i ^= p_key->i;
 }
 
-void KeyExpansion(const aes_key_t* const p_key,
-                  key_schedule_t* const p_key_sched)
+void KeyExpansion(const cipher_key_t* const p_key,
+                  key_schedule_t* const p_key_sched,
+                  const uint16_t key_bits)
 {
     // This makes the key unique at each round of encryption
+    const uint8_t key_length = KEY_LENGTH_FOR(key_bits);
+    const uint8_t num_rounds = NUM_ROUNDS_FOR(key_bits);
     
     // Start with the key itself
     // The operations from the spec work in big endian byte order
-    for (uint8_t word = 0; word < KEY_LENGTH; ++word)
+    uint32_t* const p_key_sched_words = (uint32_t* const) p_key_sched;
+    for (uint8_t word = 0; word < key_length; ++word)
     {
-        p_key_sched->k[0].w[word] = htonl(p_key->w[word]);
+        p_key_sched_words[word] = htonl(p_key->w[word]);
     }
     
     // Manipulate the key for future rounds
-    uint32_t* const p_key_sched_words = (uint32_t* const) p_key_sched;
-    for (uint8_t i = KEY_LENGTH; i < (NUM_ROUNDS+1)*BLOCK_SIZE; ++i)
+    for (uint8_t i = key_length; i < (num_rounds+1)*BLOCK_SIZE; ++i)
     {
         // Take previous word
         uint32_t temp = p_key_sched_words[i-1];
         
-        // First word of a new round gets transformed
-        if (i % KEY_LENGTH == 0)
+        // First word of a new key length gets transformed
+        if (i % key_length == 0)
+        {
+            temp = SubWord(RotWord(temp)) ^ Rcon[i/key_length];
+        }
+        // AES-256 also substitutes the word halfway through
+        else if (key_length > KEY_LENGTH_192 && i % key_length == 4)
         {
-            temp = SubWord(RotWord(temp)) ^ Rcon[i/KEY_LENGTH];
+            temp = SubWord(temp);
         }
         
-        // XOR this round's i-th word with previous round's i-th word
-        p_key_sched_words[i] = p_key_sched_words[i-KEY_LENGTH] ^ temp;
+        // XOR with the word one key length earlier
+        p_key_sched_words[i] = p_key_sched_words[i-key_length] ^ temp;
     }
     
     // Convert back to system byte order
-    for (uint8_t i = 0; i < (NUM_ROUNDS+1)*BLOCK_SIZE; ++i)
+    for (uint8_t i = 0; i < (num_rounds+1)*BLOCK_SIZE; ++i)
     {
         p_key_sched_words[i] = ntohl(p_key_sched_words[i]);
     }
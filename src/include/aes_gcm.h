@@ -0,0 +1,399 @@
+#ifndef AESGCM_H
+#define AESGCM_H
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+
+#include "aes.h"
+#include "aes_ni.h"
+
+/**
+ *  Galois/Counter Mode, following Intel's "Carry-Less Multiplication and
+ *  Its Usage for Computing the GCM Mode" whitepaper.  GHASH values are kept
+ *  byte reflected (see GCM_BYTE_REFLECT) so that _mm_clmulepi64_si128 can
+ *  work on them directly.
+ *
+ *  AesGcm encrypts CTR_PIPELINE_BLOCKS blocks per iteration and hashes
+ *  the previous iteration's ciphertext between the AES rounds, so the
+ *  multiplier and the AES unit are busy at the same time.  The blocks in
+ *  an iteration are multiplied by H^8..H^1 and summed before a single
+ *  reduction.
+ *
+ *  GCM counters only increment the low 32 bits, but GCM also limits a
+ *  message to 2^32 - 2 blocks, so the 128-bit increment used by the CTR
+ *  kernels gives the same result for every valid message.
+ */
+
+/* Powers of H kept for the aggregated reduction */
+#define GCM_H_POWERS CTR_PIPELINE_BLOCKS
+
+/* Reverses the bytes of a block to and from GHASH's bit order */
+#define GCM_BYTE_REFLECT _mm_set_epi8(0,  1,  2,  3,  \
+                                      4,  5,  6,  7,  \
+                                      8,  9,  10, 11, \
+                                      12, 13, 14, 15)
+
+/* h[i] holds H^(i+1), byte reflected */
+typedef struct gcm_key_t {
+    __m128i h[GCM_H_POWERS];
+} gcm_key_t;
+
+typedef void (*gcm_pipeline_t)(const block_vector_t* const p_input,
+                               block_vector_t* const p_output,
+                               const size_t count,
+                               const key_schedule_t* const p_key_sched,
+                               const gcm_key_t* const p_gcm_key,
+                               __m128i* const p_counter,
+                               __m128i* const p_ghash);
+
+/*
+ * Adds a*b to the 256-bit product hi:lo without reducing it.
+ * Sums of products only need to be reduced once.
+ */
+static inline __attribute__((always_inline))
+void GhashMultiplyAdd(const __m128i a,
+                      const __m128i b,
+                      __m128i* const p_lo,
+                      __m128i* const p_hi)
+{
+    __m128i mid = _mm_clmulepi64_si128(a, b, 0x10) ^
+                  _mm_clmulepi64_si128(a, b, 0x01);
+    *p_lo ^= _mm_clmulepi64_si128(a, b, 0x00) ^ _mm_slli_si128(mid, 8);
+    *p_hi ^= _mm_clmulepi64_si128(a, b, 0x11) ^ _mm_srli_si128(mid, 8);
+}
+
+/* Reduces hi:lo modulo the GCM polynomial x^128 + x^7 + x^2 + x + 1 */
+static inline __attribute__((always_inline))
+__m128i GhashReduce(__m128i lo, __m128i hi)
+{
+    // Intel provides this reduction
+    // The product of two reflected values is one bit short, so shift
+    // the whole 256-bit value left by 1 first
+    __m128i lo_carry = _mm_srli_epi32(lo, 31);
+    __m128i hi_carry = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    hi |= _mm_srli_si128(lo_carry, 12) |
+          _mm_slli_si128(hi_carry, 4);
+    lo |= _mm_slli_si128(lo_carry, 4);
+    
+    // First phase of the reduction
+    __m128i tmp = _mm_slli_epi32(lo, 31) ^
+                  _mm_slli_epi32(lo, 30) ^
+                  _mm_slli_epi32(lo, 25);
+    __m128i tmp_high = _mm_srli_si128(tmp, 4);
+    lo ^= _mm_slli_si128(tmp, 12);
+    
+    // Second phase of the reduction
+    tmp = _mm_srli_epi32(lo, 1) ^
+          _mm_srli_epi32(lo, 2) ^
+          _mm_srli_epi32(lo, 7) ^
+          tmp_high;
+    
+    return hi ^ lo ^ tmp;
+}
+
+__m128i GhashMultiply(const __m128i a, const __m128i b)
+{
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    GhashMultiplyAdd(a, b, &lo, &hi);
+    return GhashReduce(lo, hi);
+}
+
+/* Returns H^exponent by square-and-multiply */
+__m128i GhashPower(const gcm_key_t* const p_gcm_key, uint64_t exponent)
+{
+    // 1 is the top bit in GHASH's bit order (and so byte 0 when reflected)
+    __m128i result = _mm_set_epi64x(0x8000000000000000, 0);
+    __m128i square = p_gcm_key->h[0];
+    
+    while (exponent > 0)
+    {
+        if (exponent & 1)
+        {
+            result = GhashMultiply(result, square);
+        }
+        square = GhashMultiply(square, square);
+        exponent >>= 1;
+    }
+    
+    return result;
+}
+
+/*
+ * Precondition: p_key_sched should be initialized with KeyExpansion.
+ * The hash key H is the encryption of the all-zero block.
+ */
+void GcmKeySetup(const key_schedule_t* const p_key_sched,
+                 const uint16_t key_bits,
+                 gcm_key_t* const p_gcm_key)
+{
+    const uint8_t num_rounds = NUM_ROUNDS_FOR(key_bits);
+    
+    __m128i h = p_key_sched->k[0].i;
+    for (uint8_t round = 1; round < num_rounds; ++round)
+    {
+        h = _mm_aesenc_si128(h, p_key_sched->k[round].i);
+    }
+    h = _mm_aesenclast_si128(h, p_key_sched->k[num_rounds].i);
+    
+    p_gcm_key->h[0] = _mm_shuffle_epi8(h, GCM_BYTE_REFLECT);
+    for (uint8_t i = 1; i < GCM_H_POWERS; ++i)
+    {
+        p_gcm_key->h[i] = GhashMultiply(p_gcm_key->h[i-1],
+                                        p_gcm_key->h[0]);
+    }
+}
+
+/*
+ * Returns the counter block with the given 32-bit index, for a 96-bit IV
+ * made of 4 zero bytes and the big endian nonce.  Index 1 is J0, which
+ * masks the tag, and message block i is encrypted with index i + 2.
+ */
+__m128i GcmCounterBlock(const uint64_t nonce, const uint64_t index)
+{
+    __m128i counter = _mm_set_epi64x(nonce >> 32,
+                                     (nonce << 32) | (uint32_t) index);
+    return _mm_shuffle_epi8(counter, GCM_BYTE_REFLECT);
+}
+
+/*
+ * Precondition: p_key_sched and p_gcm_key are initialized, and *p_ghash
+ *               holds the (reflected) GHASH of any earlier ciphertext.
+ * Postcondition: *p_counter is advanced past the last block encrypted and
+ *                *p_ghash includes every ciphertext block written.
+ * This is only called with a constant num_rounds (see the wrappers below).
+ */
+static inline __attribute__((always_inline))
+void AesGcm(const block_vector_t* const p_input,
+            block_vector_t* const p_output,
+            const size_t count,
+            const key_schedule_t* const p_key_sched,
+            const gcm_key_t* const p_gcm_key,
+            __m128i* const p_counter,
+            __m128i* const p_ghash,
+            const uint8_t num_rounds)
+{
+    __m128i k[MAX_ROUNDS+1];
+    for (uint8_t round = 0; round <= num_rounds; ++round)
+    {
+        k[round] = p_key_sched->k[round].i;
+    }
+    
+    const __m128i byte_swap = GCM_BYTE_REFLECT;
+    const __m128i carry = _mm_set_epi64x(1, 0);
+    __m128i counter = _mm_shuffle_epi8(*p_counter, byte_swap);
+    __m128i ghash = *p_ghash;
+    
+    // Ciphertext from the previous iteration, waiting to be hashed
+    __m128i pending[CTR_PIPELINE_BLOCKS];
+    bool have_pending = false;
+    
+    size_t block = 0;
+    for (; block + CTR_PIPELINE_BLOCKS <= count; block += CTR_PIPELINE_BLOCKS)
+    {
+        __m128i state[CTR_PIPELINE_BLOCKS];
+        
+        uint64_t low = (uint64_t) _mm_cvtsi128_si64(counter);
+        for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+        {
+            state[i] = _mm_add_epi64(counter, _mm_set_epi64x(0, i));
+            if (low + i < low)
+            {
+                state[i] = _mm_add_epi64(state[i], carry);
+            }
+            state[i] = _mm_shuffle_epi8(state[i], byte_swap) ^ k[0];
+        }
+        counter = _mm_add_epi64(counter,
+                                _mm_set_epi64x(0, CTR_PIPELINE_BLOCKS));
+        if (low + CTR_PIPELINE_BLOCKS < low)
+        {
+            counter = _mm_add_epi64(counter, carry);
+        }
+        
+        // Every AES round also multiplies one pending block by its power
+        // of H.  There are always more rounds than blocks to hash.
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        if (have_pending)
+        {
+            pending[0] ^= ghash;
+        }
+        
+        #pragma GCC unroll 16
+        for (uint8_t round = 1; round < num_rounds; ++round)
+        {
+            for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+            {
+                state[i] = _mm_aesenc_si128(state[i], k[round]);
+            }
+            
+            if (have_pending && round <= CTR_PIPELINE_BLOCKS)
+            {
+                GhashMultiplyAdd(pending[round-1],
+                                 p_gcm_key->h[CTR_PIPELINE_BLOCKS-round],
+                                 &lo,
+                                 &hi);
+            }
+        }
+        
+        if (have_pending)
+        {
+            ghash = GhashReduce(lo, hi);
+        }
+        
+        // Perform the last round and XOR with the input
+        for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+        {
+            state[i] = _mm_aesenclast_si128(state[i], k[num_rounds]);
+            state[i] ^= p_input[block+i].i;
+            p_output[block+i].i = state[i];
+            pending[i] = _mm_shuffle_epi8(state[i], byte_swap);
+        }
+        have_pending = true;
+    }
+    
+    // Hash the last full iteration
+    if (have_pending)
+    {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        pending[0] ^= ghash;
+        for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+        {
+            GhashMultiplyAdd(pending[i],
+                             p_gcm_key->h[CTR_PIPELINE_BLOCKS-1-i],
+                             &lo,
+                             &hi);
+        }
+        ghash = GhashReduce(lo, hi);
+    }
+    
+    *p_counter = _mm_shuffle_epi8(counter, byte_swap);
+    
+    // Any leftover blocks are encrypted and hashed one at a time
+    for (; block < count; ++block)
+    {
+        p_output[block].i = AesCipher(p_input[block].i,
+                                      p_key_sched,
+                                      *p_counter,
+                                      num_rounds);
+        BigEndianIncrement(p_counter);
+        
+        ghash ^= _mm_shuffle_epi8(p_output[block].i, byte_swap);
+        ghash = GhashMultiply(ghash, p_gcm_key->h[0]);
+    }
+    
+    *p_ghash = ghash;
+}
+
+void AesGcm128(const block_vector_t* const p_input,
+               block_vector_t* const p_output,
+               const size_t count,
+               const key_schedule_t* const p_key_sched,
+               const gcm_key_t* const p_gcm_key,
+               __m128i* const p_counter,
+               __m128i* const p_ghash)
+{
+    AesGcm(p_input, p_output, count, p_key_sched, p_gcm_key,
+           p_counter, p_ghash, NUM_ROUNDS_128);
+}
+
+void AesGcm192(const block_vector_t* const p_input,
+               block_vector_t* const p_output,
+               const size_t count,
+               const key_schedule_t* const p_key_sched,
+               const gcm_key_t* const p_gcm_key,
+               __m128i* const p_counter,
+               __m128i* const p_ghash)
+{
+    AesGcm(p_input, p_output, count, p_key_sched, p_gcm_key,
+           p_counter, p_ghash, NUM_ROUNDS_192);
+}
+
+void AesGcm256(const block_vector_t* const p_input,
+               block_vector_t* const p_output,
+               const size_t count,
+               const key_schedule_t* const p_key_sched,
+               const gcm_key_t* const p_gcm_key,
+               __m128i* const p_counter,
+               __m128i* const p_ghash)
+{
+    AesGcm(p_input, p_output, count, p_key_sched, p_gcm_key,
+           p_counter, p_ghash, NUM_ROUNDS_256);
+}
+
+/* Indexed by KEY_SIZE_INDEX() */
+const gcm_pipeline_t gcm_pipelines[] = {AesGcm128,
+                                        AesGcm192,
+                                        AesGcm256};
+
+/*
+ * Encrypts a final partial block of bytes (fewer than a block) with
+ * ctr_pipeline and adds it to *p_ghash.  GCM hashes the partial block
+ * padded with zeros.
+ */
+void AesGcmPartialBlock(const uint8_t* const p_input,
+                        uint8_t* const p_output,
+                        const size_t bytes,
+                        const ctr_pipeline_t ctr_pipeline,
+                        const key_schedule_t* const p_key_sched,
+                        const gcm_key_t* const p_gcm_key,
+                        __m128i* const p_counter,
+                        __m128i* const p_ghash)
+{
+    block_vector_t partial;
+    memset(&partial, 0, sizeof(partial));
+    memcpy(&partial, p_input, bytes);
+    
+    ctr_pipeline(&partial, &partial, 1, p_key_sched, p_counter);
+    memset(partial.x + bytes, 0, sizeof(partial) - bytes);
+    memcpy(p_output, &partial, bytes);
+    
+    *p_ghash ^= _mm_shuffle_epi8(partial.i, GCM_BYTE_REFLECT);
+    *p_ghash = GhashMultiply(*p_ghash, p_gcm_key->h[0]);
+}
+
+/*
+ * Hashing is linear, so a message split into chunks can be hashed in
+ * parallel.  Returns the GHASH of the whole message given the GHASH of
+ * a chunk and the number of blocks that follow it.
+ */
+__m128i GhashShift(const gcm_key_t* const p_gcm_key,
+                   const __m128i chunk_ghash,
+                   const uint64_t blocks_after)
+{
+    return GhashMultiply(chunk_ghash, GhashPower(p_gcm_key, blocks_after));
+}
+
+/*
+ * Returns the authentication tag for a message with no additional data.
+ * ghash is the (reflected) GHASH of all ciphertext blocks.
+ */
+__m128i GcmTag(const key_schedule_t* const p_key_sched,
+               const uint16_t key_bits,
+               const gcm_key_t* const p_gcm_key,
+               const uint64_t nonce,
+               __m128i ghash,
+               const uint64_t length_bytes)
+{
+    // The length block holds the bit lengths of the additional data
+    // and the ciphertext, which is the same when reflected
+    ghash ^= _mm_set_epi64x(0, length_bytes*BITS_PER_BYTE);
+    ghash = GhashMultiply(ghash, p_gcm_key->h[0]);
+    
+    // The tag is masked with the encryption of J0
+    block_vector_t zero;
+    block_vector_t mask;
+    zero.i = _mm_setzero_si128();
+    __m128i j0 = GcmCounterBlock(nonce, 1);
+    ni_pipelines[KEY_SIZE_INDEX(key_bits)](&zero, &mask, 1, p_key_sched, &j0);
+    
+    return _mm_shuffle_epi8(ghash, GCM_BYTE_REFLECT) ^ mask.i;
+}
+
+#endif
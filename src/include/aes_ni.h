@@ -3,6 +3,8 @@
 
 #include <string.h>
 
+#include <tmmintrin.h>
+
 #include "aes.h"
 
 /**
@@ -15,30 +17,345 @@
  * Precondition: p_key_sched should be initialized with KeyExpansion
  *               before using the cipher, since the key schedule is
  *               the same for every 128-bit block.
+ * This is only called with a constant num_rounds (see the wrappers below)
+ * so that the round loop is fully unrolled for each key size.
  */
-__m128i AesCipher128(const __m128i input,
-                     const key_schedule_t* const p_key_sched,
-                     const __m128i counter)
+static inline __attribute__((always_inline))
+__m128i AesCipher(const __m128i input,
+                  const key_schedule_t* const p_key_sched,
+                  const __m128i counter,
+                  const uint8_t num_rounds)
 {
     __m128i state = counter ^ p_key_sched->k[0].i;
     
     // The last round is a little different, so it is excluded
-    state = _mm_aesenc_si128(state, p_key_sched->k[1].i);
-    state = _mm_aesenc_si128(state, p_key_sched->k[2].i);
-    state = _mm_aesenc_si128(state, p_key_sched->k[3].i);
-    state = _mm_aesenc_si128(state, p_key_sched->k[4].i);
-    state = _mm_aesenc_si128(state, p_key_sched->k[5].i);
-    state = _mm_aesenc_si128(state, p_key_sched->k[6].i);
-    state = _mm_aesenc_si128(state, p_key_sched->k[7].i);
-    state = _mm_aesenc_si128(state, p_key_sched->k[8].i);
-    state = _mm_aesenc_si128(state, p_key_sched->k[9].i);
+    #pragma GCC unroll 16
+    for (uint8_t round = 1; round < num_rounds; ++round)
+    {
+        state = _mm_aesenc_si128(state, p_key_sched->k[round].i);
+    }
 
     // Perform the last round
-    state = _mm_aesenclast_si128(state, p_key_sched->k[NUM_ROUNDS].i);
+    state = _mm_aesenclast_si128(state, p_key_sched->k[num_rounds].i);
     
     return state ^ input;
 }
 
+__m128i AesCipher128(const __m128i input,
+                     const key_schedule_t* const p_key_sched,
+                     const __m128i counter)
+{
+    return AesCipher(input, p_key_sched, counter, NUM_ROUNDS_128);
+}
+
+__m128i AesCipher192(const __m128i input,
+                     const key_schedule_t* const p_key_sched,
+                     const __m128i counter)
+{
+    return AesCipher(input, p_key_sched, counter, NUM_ROUNDS_192);
+}
+
+__m128i AesCipher256(const __m128i input,
+                     const key_schedule_t* const p_key_sched,
+                     const __m128i counter)
+{
+    return AesCipher(input, p_key_sched, counter, NUM_ROUNDS_256);
+}
+
+/* Number of independent counter blocks kept in flight by AesCtrPipeline */
+#define CTR_PIPELINE_BLOCKS 8
+
+/*
+ * AES-NI instructions have a latency of several cycles but can be issued
+ * every cycle, so a single dependency chain leaves the AES unit mostly idle.
+ * This encrypts CTR_PIPELINE_BLOCKS counters per iteration so that each
+ * round instruction overlaps with the same round of the other blocks.
+ * Leftover blocks that do not fill an iteration are encrypted one at a time.
+ *
+ * Postcondition: *p_counter is advanced past the last block encrypted,
+ *                matching what BigEndianIncrement would have produced.
+ */
+static inline __attribute__((always_inline))
+void AesCtrPipeline(const block_vector_t* const p_input,
+                    block_vector_t* const p_output,
+                    const size_t count,
+                    const key_schedule_t* const p_key_sched,
+                    __m128i* const p_counter,
+                    const uint8_t num_rounds)
+{
+    // Load the key schedule once so it stays in registers for every block
+    __m128i k[MAX_ROUNDS+1];
+    for (uint8_t round = 0; round <= num_rounds; ++round)
+    {
+        k[round] = p_key_sched->k[round].i;
+    }
+    
+    // The counter is big endian, so byte swap it to use integer adds
+    const __m128i byte_swap = _mm_set_epi8(0,  1,  2,  3,
+                                           4,  5,  6,  7,
+                                           8,  9,  10, 11,
+                                           12, 13, 14, 15);
+    const __m128i carry = _mm_set_epi64x(1, 0);
+    __m128i counter = _mm_shuffle_epi8(*p_counter, byte_swap);
+    
+    size_t block = 0;
+    for (; block + CTR_PIPELINE_BLOCKS <= count; block += CTR_PIPELINE_BLOCKS)
+    {
+        __m128i state[CTR_PIPELINE_BLOCKS];
+        
+        // Only the low 64 bits are added to, so a carry into the upper
+        // 64 bits needs special handling (this is very rare)
+        uint64_t low = (uint64_t) _mm_cvtsi128_si64(counter);
+        for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+        {
+            state[i] = _mm_add_epi64(counter, _mm_set_epi64x(0, i));
+            if (low + i < low)
+            {
+                state[i] = _mm_add_epi64(state[i], carry);
+            }
+            state[i] = _mm_shuffle_epi8(state[i], byte_swap) ^ k[0];
+        }
+        counter = _mm_add_epi64(counter,
+                                _mm_set_epi64x(0, CTR_PIPELINE_BLOCKS));
+        if (low + CTR_PIPELINE_BLOCKS < low)
+        {
+            counter = _mm_add_epi64(counter, carry);
+        }
+        
+        // The last round is a little different, so it is excluded
+        #pragma GCC unroll 16
+        for (uint8_t round = 1; round < num_rounds; ++round)
+        {
+            for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+            {
+                state[i] = _mm_aesenc_si128(state[i], k[round]);
+            }
+        }
+        
+        // Perform the last round and XOR with the input
+        for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+        {
+            state[i] = _mm_aesenclast_si128(state[i], k[num_rounds]);
+            p_output[block+i].i = state[i] ^ p_input[block+i].i;
+        }
+    }
+    
+    *p_counter = _mm_shuffle_epi8(counter, byte_swap);
+    
+    // Any leftover blocks are encrypted one at a time
+    for (; block < count; ++block)
+    {
+        p_output[block].i = AesCipher(p_input[block].i,
+                                      p_key_sched,
+                                      *p_counter,
+                                      num_rounds);
+        BigEndianIncrement(p_counter);
+    }
+}
+
+void AesCtrPipeline128(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrPipeline(p_input, p_output, count, p_key_sched, p_counter,
+                   NUM_ROUNDS_128);
+}
+
+void AesCtrPipeline192(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrPipeline(p_input, p_output, count, p_key_sched, p_counter,
+                   NUM_ROUNDS_192);
+}
+
+void AesCtrPipeline256(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrPipeline(p_input, p_output, count, p_key_sched, p_counter,
+                   NUM_ROUNDS_256);
+}
+
+/* Indexed by KEY_SIZE_INDEX() */
+const ctr_pipeline_t ni_pipelines[] = {AesCtrPipeline128,
+                                       AesCtrPipeline192,
+                                       AesCtrPipeline256};
+
+/*
+ * CBC pipelines take the previous ciphertext block (or the IV) in
+ * *p_chain and leave the last ciphertext block there.
+ */
+typedef void (*cbc_pipeline_t)(const block_vector_t* const p_input,
+                               block_vector_t* const p_output,
+                               const size_t count,
+                               const key_schedule_t* const p_key_sched,
+                               __m128i* const p_chain);
+
+/*
+ * Each block depends on the one before, so CBC encryption cannot be
+ * interleaved and runs one block at a time.
+ */
+static inline __attribute__((always_inline))
+void AesCbcEncrypt(const block_vector_t* const p_input,
+                   block_vector_t* const p_output,
+                   const size_t count,
+                   const key_schedule_t* const p_key_sched,
+                   __m128i* const p_chain,
+                   const uint8_t num_rounds)
+{
+    __m128i chain = *p_chain;
+    for (size_t block = 0; block < count; ++block)
+    {
+        chain = AesCipher(_mm_setzero_si128(),
+                          p_key_sched,
+                          p_input[block].i ^ chain,
+                          num_rounds);
+        p_output[block].i = chain;
+    }
+    *p_chain = chain;
+}
+
+/*
+ * Precondition: p_dec_sched should be initialized with
+ *               DecryptionKeySchedule, not KeyExpansion.
+ * Every plaintext block only needs two ciphertext blocks, so decryption
+ * interleaves CTR_PIPELINE_BLOCKS blocks like AesCtrPipeline.
+ */
+static inline __attribute__((always_inline))
+void AesCbcDecrypt(const block_vector_t* const p_input,
+                   block_vector_t* const p_output,
+                   const size_t count,
+                   const key_schedule_t* const p_dec_sched,
+                   __m128i* const p_chain,
+                   const uint8_t num_rounds)
+{
+    __m128i k[MAX_ROUNDS+1];
+    for (uint8_t round = 0; round <= num_rounds; ++round)
+    {
+        k[round] = p_dec_sched->k[round].i;
+    }
+    
+    __m128i chain = *p_chain;
+    
+    size_t block = 0;
+    for (; block + CTR_PIPELINE_BLOCKS <= count; block += CTR_PIPELINE_BLOCKS)
+    {
+        __m128i state[CTR_PIPELINE_BLOCKS];
+        for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+        {
+            state[i] = p_input[block+i].i ^ k[0];
+        }
+        
+        // The last round is a little different, so it is excluded
+        #pragma GCC unroll 16
+        for (uint8_t round = 1; round < num_rounds; ++round)
+        {
+            for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+            {
+                state[i] = _mm_aesdec_si128(state[i], k[round]);
+            }
+        }
+        
+        // Perform the last round and XOR with the previous ciphertext
+        for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+        {
+            state[i] = _mm_aesdeclast_si128(state[i], k[num_rounds]);
+            p_output[block+i].i = state[i] ^ chain;
+            chain = p_input[block+i].i;
+        }
+    }
+    
+    // Any leftover blocks are decrypted one at a time
+    for (; block < count; ++block)
+    {
+        __m128i state = p_input[block].i ^ k[0];
+        for (uint8_t round = 1; round < num_rounds; ++round)
+        {
+            state = _mm_aesdec_si128(state, k[round]);
+        }
+        state = _mm_aesdeclast_si128(state, k[num_rounds]);
+        p_output[block].i = state ^ chain;
+        chain = p_input[block].i;
+    }
+    
+    *p_chain = chain;
+}
+
+void AesCbcEncrypt128(const block_vector_t* const p_input,
+                      block_vector_t* const p_output,
+                      const size_t count,
+                      const key_schedule_t* const p_key_sched,
+                      __m128i* const p_chain)
+{
+    AesCbcEncrypt(p_input, p_output, count, p_key_sched, p_chain,
+                  NUM_ROUNDS_128);
+}
+
+void AesCbcEncrypt192(const block_vector_t* const p_input,
+                      block_vector_t* const p_output,
+                      const size_t count,
+                      const key_schedule_t* const p_key_sched,
+                      __m128i* const p_chain)
+{
+    AesCbcEncrypt(p_input, p_output, count, p_key_sched, p_chain,
+                  NUM_ROUNDS_192);
+}
+
+void AesCbcEncrypt256(const block_vector_t* const p_input,
+                      block_vector_t* const p_output,
+                      const size_t count,
+                      const key_schedule_t* const p_key_sched,
+                      __m128i* const p_chain)
+{
+    AesCbcEncrypt(p_input, p_output, count, p_key_sched, p_chain,
+                  NUM_ROUNDS_256);
+}
+
+void AesCbcDecrypt128(const block_vector_t* const p_input,
+                      block_vector_t* const p_output,
+                      const size_t count,
+                      const key_schedule_t* const p_key_sched,
+                      __m128i* const p_chain)
+{
+    AesCbcDecrypt(p_input, p_output, count, p_key_sched, p_chain,
+                  NUM_ROUNDS_128);
+}
+
+void AesCbcDecrypt192(const block_vector_t* const p_input,
+                      block_vector_t* const p_output,
+                      const size_t count,
+                      const key_schedule_t* const p_key_sched,
+                      __m128i* const p_chain)
+{
+    AesCbcDecrypt(p_input, p_output, count, p_key_sched, p_chain,
+                  NUM_ROUNDS_192);
+}
+
+void AesCbcDecrypt256(const block_vector_t* const p_input,
+                      block_vector_t* const p_output,
+                      const size_t count,
+                      const key_schedule_t* const p_key_sched,
+                      __m128i* const p_chain)
+{
+    AesCbcDecrypt(p_input, p_output, count, p_key_sched, p_chain,
+                  NUM_ROUNDS_256);
+}
+
+/* Indexed by KEY_SIZE_INDEX() */
+const cbc_pipeline_t cbc_encrypt_pipelines[] = {AesCbcEncrypt128,
+                                                AesCbcEncrypt192,
+                                                AesCbcEncrypt256};
+const cbc_pipeline_t cbc_decrypt_pipelines[] = {AesCbcDecrypt128,
+                                                AesCbcDecrypt192,
+                                                AesCbcDecrypt256};
+
 __m128i KeyExpansionAssist(__m128i tmp1, __m128i tmp2)
 {
     // Intel provides this function
@@ -54,13 +371,13 @@ __m128i KeyExpansionAssist(__m128i tmp1, __m128i tmp2)
     return tmp1;
 }
 
-void KeyExpansion(const aes_key_t* const p_key,
-                  key_schedule_t* const p_key_sched)
+void KeyExpansion128(const cipher_key_t* const p_key,
+                     key_schedule_t* const p_key_sched)
 {
     // Manipulate the key
     __m128i tmp1, tmp2;
     
-    tmp1 = _mm_loadu_si128((__m128i*) &(p_key->i));
+    tmp1 = _mm_loadu_si128((__m128i*) &(p_key->i[0]));
     p_key_sched->k[0].i = tmp1;
     
     tmp2 = _mm_aeskeygenassist_si128(tmp1, 0x01);
@@ -104,4 +421,195 @@ void KeyExpansion(const aes_key_t* const p_key,
     p_key_sched->k[10].i = tmp1;
 }
 
+__m128i KeyExpansionAssist192(__m128i* const p_tmp1,
+                              __m128i tmp2,
+                              __m128i* const p_tmp3)
+{
+    // Intel provides this function
+    // tmp1 holds 4 words of the key and the low half of tmp3 holds 2 more
+    
+    tmp2 = _mm_shuffle_epi32(tmp2, 0x55);
+    __m128i tmp4 = _mm_slli_si128(*p_tmp1, 0x04);
+    *p_tmp1 = _mm_xor_si128(*p_tmp1, tmp4);
+    tmp4 = _mm_slli_si128(tmp4, 0x04);
+    *p_tmp1 = _mm_xor_si128(*p_tmp1, tmp4);
+    tmp4 = _mm_slli_si128(tmp4, 0x04);
+    *p_tmp1 = _mm_xor_si128(*p_tmp1, tmp4);
+    *p_tmp1 = _mm_xor_si128(*p_tmp1, tmp2);
+    tmp2 = _mm_shuffle_epi32(*p_tmp1, 0xff);
+    tmp4 = _mm_slli_si128(*p_tmp3, 0x04);
+    *p_tmp3 = _mm_xor_si128(*p_tmp3, tmp4);
+    *p_tmp3 = _mm_xor_si128(*p_tmp3, tmp2);
+    return *p_tmp1;
+}
+
+/* Joins the low 64 bits of a and the low 64 bits of b */
+__m128i JoinLow(const __m128i a, const __m128i b)
+{
+    return (__m128i) _mm_shuffle_pd((__m128d) a, (__m128d) b, 0);
+}
+
+/* Joins the high 64 bits of a and the low 64 bits of b */
+__m128i JoinHighLow(const __m128i a, const __m128i b)
+{
+    return (__m128i) _mm_shuffle_pd((__m128d) a, (__m128d) b, 1);
+}
+
+void KeyExpansion192(const cipher_key_t* const p_key,
+                     key_schedule_t* const p_key_sched)
+{
+    // Each step makes 6 words, so round keys straddle two steps
+    __m128i tmp1, tmp2, tmp3;
+    
+    tmp1 = _mm_loadu_si128((__m128i*) &(p_key->i[0]));
+    tmp3 = _mm_loadu_si128((__m128i*) &(p_key->i[1]));
+    p_key_sched->k[0].i = tmp1;
+    p_key_sched->k[1].i = tmp3;
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x01);
+    KeyExpansionAssist192(&tmp1, tmp2, &tmp3);
+    p_key_sched->k[1].i = JoinLow(p_key_sched->k[1].i, tmp1);
+    p_key_sched->k[2].i = JoinHighLow(tmp1, tmp3);
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x02);
+    KeyExpansionAssist192(&tmp1, tmp2, &tmp3);
+    p_key_sched->k[3].i = tmp1;
+    p_key_sched->k[4].i = tmp3;
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x04);
+    KeyExpansionAssist192(&tmp1, tmp2, &tmp3);
+    p_key_sched->k[4].i = JoinLow(p_key_sched->k[4].i, tmp1);
+    p_key_sched->k[5].i = JoinHighLow(tmp1, tmp3);
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x08);
+    KeyExpansionAssist192(&tmp1, tmp2, &tmp3);
+    p_key_sched->k[6].i = tmp1;
+    p_key_sched->k[7].i = tmp3;
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x10);
+    KeyExpansionAssist192(&tmp1, tmp2, &tmp3);
+    p_key_sched->k[7].i = JoinLow(p_key_sched->k[7].i, tmp1);
+    p_key_sched->k[8].i = JoinHighLow(tmp1, tmp3);
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x20);
+    KeyExpansionAssist192(&tmp1, tmp2, &tmp3);
+    p_key_sched->k[9].i = tmp1;
+    p_key_sched->k[10].i = tmp3;
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x40);
+    KeyExpansionAssist192(&tmp1, tmp2, &tmp3);
+    p_key_sched->k[10].i = JoinLow(p_key_sched->k[10].i, tmp1);
+    p_key_sched->k[11].i = JoinHighLow(tmp1, tmp3);
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x80);
+    KeyExpansionAssist192(&tmp1, tmp2, &tmp3);
+    p_key_sched->k[12].i = tmp1;
+}
+
+__m128i KeyExpansionAssist256(__m128i tmp1, __m128i tmp3)
+{
+    // Intel provides this function
+    // The second half of each AES-256 step uses SubWord without RotWord
+    
+    __m128i tmp2 = _mm_aeskeygenassist_si128(tmp1, 0x00);
+    tmp2 = _mm_shuffle_epi32(tmp2, 0xaa);
+    __m128i tmp4 = _mm_slli_si128(tmp3, 0x04);
+    tmp3 = _mm_xor_si128(tmp3, tmp4);
+    tmp4 = _mm_slli_si128(tmp4, 0x04);
+    tmp3 = _mm_xor_si128(tmp3, tmp4);
+    tmp4 = _mm_slli_si128(tmp4, 0x04);
+    tmp3 = _mm_xor_si128(tmp3, tmp4);
+    tmp3 = _mm_xor_si128(tmp3, tmp2);
+    return tmp3;
+}
+
+void KeyExpansion256(const cipher_key_t* const p_key,
+                     key_schedule_t* const p_key_sched)
+{
+    // Each step makes two round keys
+    __m128i tmp1, tmp2, tmp3;
+    
+    tmp1 = _mm_loadu_si128((__m128i*) &(p_key->i[0]));
+    tmp3 = _mm_loadu_si128((__m128i*) &(p_key->i[1]));
+    p_key_sched->k[0].i = tmp1;
+    p_key_sched->k[1].i = tmp3;
+    
+    // _mm_aeskeygenassist_si128 needs an immediate, so this is unrolled
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x01);
+    tmp1 = KeyExpansionAssist(tmp1, tmp2);
+    p_key_sched->k[2].i = tmp1;
+    tmp3 = KeyExpansionAssist256(tmp1, tmp3);
+    p_key_sched->k[3].i = tmp3;
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x02);
+    tmp1 = KeyExpansionAssist(tmp1, tmp2);
+    p_key_sched->k[4].i = tmp1;
+    tmp3 = KeyExpansionAssist256(tmp1, tmp3);
+    p_key_sched->k[5].i = tmp3;
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x04);
+    tmp1 = KeyExpansionAssist(tmp1, tmp2);
+    p_key_sched->k[6].i = tmp1;
+    tmp3 = KeyExpansionAssist256(tmp1, tmp3);
+    p_key_sched->k[7].i = tmp3;
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x08);
+    tmp1 = KeyExpansionAssist(tmp1, tmp2);
+    p_key_sched->k[8].i = tmp1;
+    tmp3 = KeyExpansionAssist256(tmp1, tmp3);
+    p_key_sched->k[9].i = tmp3;
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x10);
+    tmp1 = KeyExpansionAssist(tmp1, tmp2);
+    p_key_sched->k[10].i = tmp1;
+    tmp3 = KeyExpansionAssist256(tmp1, tmp3);
+    p_key_sched->k[11].i = tmp3;
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x20);
+    tmp1 = KeyExpansionAssist(tmp1, tmp2);
+    p_key_sched->k[12].i = tmp1;
+    tmp3 = KeyExpansionAssist256(tmp1, tmp3);
+    p_key_sched->k[13].i = tmp3;
+    
+    tmp2 = _mm_aeskeygenassist_si128(tmp3, 0x40);
+    tmp1 = KeyExpansionAssist(tmp1, tmp2);
+    p_key_sched->k[14].i = tmp1;
+}
+
+void KeyExpansion(const cipher_key_t* const p_key,
+                  key_schedule_t* const p_key_sched,
+                  const uint16_t key_bits)
+{
+    switch (key_bits)
+    {
+        case 192:
+            KeyExpansion192(p_key, p_key_sched);
+            break;
+        case 256:
+            KeyExpansion256(p_key, p_key_sched);
+            break;
+        default:
+            KeyExpansion128(p_key, p_key_sched);
+    }
+}
+
+/*
+ * The equivalent inverse cipher uses the round keys in reverse order,
+ * with InvMixColumns (aesimc) applied to every key but the first and last.
+ */
+void DecryptionKeySchedule(const key_schedule_t* const p_key_sched,
+                           key_schedule_t* const p_dec_sched,
+                           const uint16_t key_bits)
+{
+    const uint8_t num_rounds = NUM_ROUNDS_FOR(key_bits);
+    
+    p_dec_sched->k[0] = p_key_sched->k[num_rounds];
+    for (uint8_t round = 1; round < num_rounds; ++round)
+    {
+        p_dec_sched->k[round].i =
+            _mm_aesimc_si128(p_key_sched->k[num_rounds - round].i);
+    }
+    p_dec_sched->k[num_rounds] = p_key_sched->k[0];
+}
+
 #endif
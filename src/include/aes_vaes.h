@@ -0,0 +1,320 @@
+#ifndef AESVAES_H
+#define AESVAES_H
+
+#include <stdbool.h>
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "aes.h"
+#include "aes_ni.h"
+
+/**
+ *  VAES extends the AES-NI instructions to 256-bit and 512-bit registers,
+ *  so a single instruction performs one round on 2 or 4 blocks.
+ *  These kernels are compiled for their target ISA with function
+ *  attributes, so one binary can run on hosts without VAES.  Use
+ *  SelectCtrPipeline() to pick the widest kernel the host supports.
+ *
+ *  All kernels share the AesCtrPipeline calling convention, and each is
+ *  specialized per key size the same way.
+ */
+
+/* Blocks encrypted per loop iteration by each wide kernel */
+#define VAES256_REGISTERS 8
+#define VAES256_BLOCKS    (VAES256_REGISTERS*2)
+#define VAES512_REGISTERS 8
+#define VAES512_BLOCKS    (VAES512_REGISTERS*4)
+
+static inline __attribute__((always_inline, target("avx2,vaes")))
+void AesCtrVaes256(const block_vector_t* const p_input,
+                   block_vector_t* const p_output,
+                   const size_t count,
+                   const key_schedule_t* const p_key_sched,
+                   __m128i* const p_counter,
+                   const uint8_t num_rounds)
+{
+    // Every 128-bit lane uses the same round key
+    __m256i k[MAX_ROUNDS+1];
+    for (uint8_t round = 0; round <= num_rounds; ++round)
+    {
+        k[round] = _mm256_broadcastsi128_si256(p_key_sched->k[round].i);
+    }
+    
+    // The counter is big endian, so byte swap it to use integer adds
+    const __m256i byte_swap = _mm256_set_epi8(0,  1,  2,  3,
+                                              4,  5,  6,  7,
+                                              8,  9,  10, 11,
+                                              12, 13, 14, 15,
+                                              0,  1,  2,  3,
+                                              4,  5,  6,  7,
+                                              8,  9,  10, 11,
+                                              12, 13, 14, 15);
+    const __m256i lane_offsets = _mm256_set_epi64x(0, 1, 0, 0);
+    const __m256i register_step = _mm256_set_epi64x(0, 2, 0, 2);
+    __m128i counter = _mm_shuffle_epi8(*p_counter,
+                                       _mm256_castsi256_si128(byte_swap));
+    
+    size_t block = 0;
+    for (; block + VAES256_BLOCKS <= count; block += VAES256_BLOCKS)
+    {
+        // Vector adds only touch the low 64 bits of the counter, so let
+        // the 128-bit pipeline handle the (very rare) carry into the upper half
+        uint64_t low = (uint64_t) _mm_cvtsi128_si64(counter);
+        if (low + VAES256_BLOCKS < low)
+        {
+            __m128i be_counter = _mm_shuffle_epi8(counter,
+                                    _mm256_castsi256_si128(byte_swap));
+            AesCtrPipeline(p_input + block,
+                           p_output + block,
+                           VAES256_BLOCKS,
+                           p_key_sched,
+                           &be_counter,
+                           num_rounds);
+            counter = _mm_shuffle_epi8(be_counter,
+                                       _mm256_castsi256_si128(byte_swap));
+            continue;
+        }
+    
+        __m256i state[VAES256_REGISTERS];
+        __m256i ctr = _mm256_add_epi64(_mm256_broadcastsi128_si256(counter),
+                                       lane_offsets);
+        for (uint8_t i = 0; i < VAES256_REGISTERS; ++i)
+        {
+            state[i] = _mm256_shuffle_epi8(ctr, byte_swap) ^ k[0];
+            ctr = _mm256_add_epi64(ctr, register_step);
+        }
+        counter = _mm_add_epi64(counter, _mm_set_epi64x(0, VAES256_BLOCKS));
+    
+        // The last round is a little different, so it is excluded
+        #pragma GCC unroll 16
+        for (uint8_t round = 1; round < num_rounds; ++round)
+        {
+            for (uint8_t i = 0; i < VAES256_REGISTERS; ++i)
+            {
+                state[i] = _mm256_aesenc_epi128(state[i], k[round]);
+            }
+        }
+    
+        // Perform the last round and XOR with the input
+        for (uint8_t i = 0; i < VAES256_REGISTERS; ++i)
+        {
+            state[i] = _mm256_aesenclast_epi128(state[i], k[num_rounds]);
+            __m256i input = _mm256_loadu_si256(
+                                (const __m256i*) (p_input + block + 2*i));
+            _mm256_storeu_si256((__m256i*) (p_output + block + 2*i),
+                                state[i] ^ input);
+        }
+    }
+    
+    // Finish whatever does not fill a whole iteration
+    *p_counter = _mm_shuffle_epi8(counter, _mm256_castsi256_si128(byte_swap));
+    AesCtrPipeline(p_input + block,
+                   p_output + block,
+                   count - block,
+                   p_key_sched,
+                   p_counter,
+                   num_rounds);
+}
+
+__attribute__((target("avx2,vaes")))
+void AesCtrVaes256_128(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrVaes256(p_input, p_output, count, p_key_sched, p_counter,
+                  NUM_ROUNDS_128);
+}
+
+__attribute__((target("avx2,vaes")))
+void AesCtrVaes256_192(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrVaes256(p_input, p_output, count, p_key_sched, p_counter,
+                  NUM_ROUNDS_192);
+}
+
+__attribute__((target("avx2,vaes")))
+void AesCtrVaes256_256(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrVaes256(p_input, p_output, count, p_key_sched, p_counter,
+                  NUM_ROUNDS_256);
+}
+
+/* Indexed by KEY_SIZE_INDEX() */
+const ctr_pipeline_t vaes256_pipelines[] = {AesCtrVaes256_128,
+                                          AesCtrVaes256_192,
+                                          AesCtrVaes256_256};
+
+static inline __attribute__((always_inline, target("avx512f,avx512bw,vaes")))
+void AesCtrVaes512(const block_vector_t* const p_input,
+                   block_vector_t* const p_output,
+                   const size_t count,
+                   const key_schedule_t* const p_key_sched,
+                   __m128i* const p_counter,
+                   const uint8_t num_rounds)
+{
+    // Every 128-bit lane uses the same round key
+    __m512i k[MAX_ROUNDS+1];
+    for (uint8_t round = 0; round <= num_rounds; ++round)
+    {
+        k[round] = _mm512_broadcast_i32x4(p_key_sched->k[round].i);
+    }
+    
+    // The counter is big endian, so byte swap it to use integer adds
+    const __m128i byte_swap_128 = _mm_set_epi8(0,  1,  2,  3,
+                                               4,  5,  6,  7,
+                                               8,  9,  10, 11,
+                                               12, 13, 14, 15);
+    const __m512i byte_swap = _mm512_broadcast_i32x4(byte_swap_128);
+    const __m512i lane_offsets = _mm512_set_epi64(0, 3, 0, 2, 0, 1, 0, 0);
+    const __m512i register_step = _mm512_set_epi64(0, 4, 0, 4, 0, 4, 0, 4);
+    __m128i counter = _mm_shuffle_epi8(*p_counter, byte_swap_128);
+    
+    size_t block = 0;
+    for (; block + VAES512_BLOCKS <= count; block += VAES512_BLOCKS)
+    {
+        // Vector adds only touch the low 64 bits of the counter, so let
+        // the 128-bit pipeline handle the (very rare) carry into the upper half
+        uint64_t low = (uint64_t) _mm_cvtsi128_si64(counter);
+        if (low + VAES512_BLOCKS < low)
+        {
+            __m128i be_counter = _mm_shuffle_epi8(counter, byte_swap_128);
+            AesCtrPipeline(p_input + block,
+                           p_output + block,
+                           VAES512_BLOCKS,
+                           p_key_sched,
+                           &be_counter,
+                           num_rounds);
+            counter = _mm_shuffle_epi8(be_counter, byte_swap_128);
+            continue;
+        }
+    
+        __m512i state[VAES512_REGISTERS];
+        __m512i ctr = _mm512_add_epi64(_mm512_broadcast_i32x4(counter),
+                                       lane_offsets);
+        for (uint8_t i = 0; i < VAES512_REGISTERS; ++i)
+        {
+            state[i] = _mm512_shuffle_epi8(ctr, byte_swap) ^ k[0];
+            ctr = _mm512_add_epi64(ctr, register_step);
+        }
+        counter = _mm_add_epi64(counter, _mm_set_epi64x(0, VAES512_BLOCKS));
+    
+        // The last round is a little different, so it is excluded
+        #pragma GCC unroll 16
+        for (uint8_t round = 1; round < num_rounds; ++round)
+        {
+            for (uint8_t i = 0; i < VAES512_REGISTERS; ++i)
+            {
+                state[i] = _mm512_aesenc_epi128(state[i], k[round]);
+            }
+        }
+    
+        // Perform the last round and XOR with the input
+        for (uint8_t i = 0; i < VAES512_REGISTERS; ++i)
+        {
+            state[i] = _mm512_aesenclast_epi128(state[i], k[num_rounds]);
+            __m512i input = _mm512_loadu_si512(p_input + block + 4*i);
+            _mm512_storeu_si512(p_output + block + 4*i, state[i] ^ input);
+        }
+    }
+    
+    // Finish whatever does not fill a whole iteration
+    *p_counter = _mm_shuffle_epi8(counter, byte_swap_128);
+    AesCtrPipeline(p_input + block,
+                   p_output + block,
+                   count - block,
+                   p_key_sched,
+                   p_counter,
+                   num_rounds);
+}
+
+__attribute__((target("avx512f,avx512bw,vaes")))
+void AesCtrVaes512_128(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrVaes512(p_input, p_output, count, p_key_sched, p_counter,
+                  NUM_ROUNDS_128);
+}
+
+__attribute__((target("avx512f,avx512bw,vaes")))
+void AesCtrVaes512_192(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrVaes512(p_input, p_output, count, p_key_sched, p_counter,
+                  NUM_ROUNDS_192);
+}
+
+__attribute__((target("avx512f,avx512bw,vaes")))
+void AesCtrVaes512_256(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const size_t count,
+                       const key_schedule_t* const p_key_sched,
+                       __m128i* const p_counter)
+{
+    AesCtrVaes512(p_input, p_output, count, p_key_sched, p_counter,
+                  NUM_ROUNDS_256);
+}
+
+/* Indexed by KEY_SIZE_INDEX() */
+const ctr_pipeline_t vaes512_pipelines[] = {AesCtrVaes512_128,
+                                          AesCtrVaes512_192,
+                                          AesCtrVaes512_256};
+
+/*
+ * Checks which register widths the CPU and OS support and returns
+ * the widest CTR kernel that can run on this host for the given key size.
+ */
+ctr_pipeline_t SelectCtrPipeline(const uint16_t key_bits)
+{
+    const uint8_t key_index = KEY_SIZE_INDEX(key_bits);
+    unsigned int eax, ebx, ecx, edx;
+    
+    // The OS must save the wider registers on context switches
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+        (ecx & bit_OSXSAVE) == 0)
+    {
+        return ni_pipelines[key_index];
+    }
+    uint32_t xcr0_low, xcr0_high;
+    __asm__ ("xgetbv" : "=a" (xcr0_low), "=d" (xcr0_high) : "c" (0));
+    bool ymm_enabled = (xcr0_low & 0x06) == 0x06;
+    bool zmm_enabled = (xcr0_low & 0xe6) == 0xe6;
+    
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) ||
+        (ecx & bit_VAES) == 0)
+    {
+        return ni_pipelines[key_index];
+    }
+    
+    if (zmm_enabled &&
+        (ebx & bit_AVX512F) != 0 &&
+        (ebx & bit_AVX512BW) != 0)
+    {
+        return vaes512_pipelines[key_index];
+    }
+    
+    if (ymm_enabled && (ebx & bit_AVX2) != 0)
+    {
+        return vaes256_pipelines[key_index];
+    }
+    
+    return ni_pipelines[key_index];
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef AESVPERM_H
+#define AESVPERM_H
+
+#include <tmmintrin.h>
+
+#include "aes.h"
+#include "aes_cpu.h"   // For KeyExpansion and shift_rows_mask
+
+/**
+ *  Vector permute AES, after Mike Hamburg's "Accelerating AES with
+ *  Vector Permute Instructions".  SubBytes is computed on all 16 bytes at
+ *  once with _mm_shuffle_epi8 lookups into 16-entry tables, indexed by
+ *  nibbles.  There are no memory lookups indexed by data, so every step
+ *  runs in constant time.
+ *
+ *  The inverse in GF(2^8) is done in the tower field GF(2^4)[t]/(t^2+t+z),
+ *  where GF(2^4) uses the modulus x^4+x+1 and z = 0x8.  A byte is mapped
+ *  to the pair (i, k) with x = i*t + j*(t+1) and k = i^j, which gives
+ *      iak = 1/i + a/k        jak = 1/j + a/k        (a = 1/z)
+ *      io  = 1/iak + j        jo  = 1/jak + i
+ *  and the inverse of x is a linear function of 1/io plus one of 1/jo.
+ *  Division by zero gives 0x80, which makes the next lookup return 0.
+ *  The output tables also apply the linear part of the AES affine map.
+ */
+
+/* Maps the low and high nibbles of a byte to (i << 4) | k */
+const u8x16 vperm_ipt_lo = {0x00, 0x10, 0x22, 0x32, 0x24, 0x34, 0x06, 0x16,
+                            0x84, 0x94, 0xa6, 0xb6, 0xa0, 0xb0, 0x82, 0x92};
+const u8x16 vperm_ipt_hi = {0x00, 0xf3, 0x8d, 0x7e, 0x73, 0x80, 0xfe, 0x0d,
+                            0xbe, 0x4d, 0x33, 0xc0, 0xcd, 0x3e, 0x40, 0xb3};
+
+/* 1/x and a/x in GF(2^4) */
+const u8x16 vperm_inv  = {0x80, 0x01, 0x09, 0x0e, 0x0d, 0x0b, 0x07, 0x06,
+                          0x0f, 0x02, 0x0c, 0x05, 0x0a, 0x04, 0x03, 0x08};
+const u8x16 vperm_inva = {0x80, 0x0f, 0x0e, 0x05, 0x07, 0x03, 0x0b, 0x04,
+                          0x0a, 0x0d, 0x08, 0x06, 0x0c, 0x09, 0x02, 0x01};
+
+/* Map io and jo back to the AES basis and apply the affine matrix */
+const u8x16 vperm_sbo_io = {0x00, 0x7b, 0xb0, 0x3d, 0x67, 0x91, 0x8d, 0xf6,
+                            0x46, 0x21, 0x1c, 0xac, 0xea, 0xd7, 0x5a, 0xcb};
+const u8x16 vperm_sbo_jo = {0x00, 0x64, 0x99, 0x12, 0xe5, 0x0a, 0x8b, 0xef,
+                            0x76, 0x93, 0x81, 0x18, 0x6e, 0x7c, 0xf7, 0xfd};
+
+/* Row r of each column takes row r+1 or r+2 of the same column */
+const u8x16 vperm_rotate_1 = {1,  2,  3,  0,
+                              5,  6,  7,  4,
+                              9,  10, 11, 8,
+                              13, 14, 15, 12};
+const u8x16 vperm_rotate_2 = {2,  3,  0,  1,
+                              6,  7,  4,  5,
+                              10, 11, 8,  9,
+                              14, 15, 12, 13};
+
+__m128i VpermSubBytes(const __m128i state);
+__m128i VpermMixColumns(const __m128i state);
+__m128i VpermRound(const __m128i state, const aes_key_t* const p_key);
+
+/*
+ * Precondition: p_key_sched should be initialized with KeyExpansion
+ *               before using the cipher, since the key schedule is
+ *               the same for every 128-bit block.
+ */
+static inline __attribute__((always_inline))
+void AesCipherVperm(const block_vector_t* const p_input,
+                    block_vector_t* const p_output,
+                    const key_schedule_t* const p_key_sched,
+                    const __m128i counter,
+                    const uint8_t num_rounds)
+{
+    __m128i state = counter ^ p_key_sched->k[0].i;
+    
+    #pragma GCC unroll 16
+    for (uint8_t round = 1; round < num_rounds; ++round)
+    {
+        state = VpermRound(state, &(p_key_sched->k[round]));
+    }
+    
+    // Last round (no MixColumns)
+    state = VpermSubBytes(state);
+    state = _mm_shuffle_epi8(state, (__m128i) shift_rows_mask);
+    state ^= p_key_sched->k[num_rounds].i;
+    
+    // XOR the encrypted counter with the input
+    p_output->i = state ^ p_input->i;
+}
+
+void AesCipher128Vperm(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const key_schedule_t* const p_key_sched,
+                       const __m128i counter)
+{
+    AesCipherVperm(p_input, p_output, p_key_sched, counter, NUM_ROUNDS_128);
+}
+
+void AesCipher192Vperm(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const key_schedule_t* const p_key_sched,
+                       const __m128i counter)
+{
+    AesCipherVperm(p_input, p_output, p_key_sched, counter, NUM_ROUNDS_192);
+}
+
+void AesCipher256Vperm(const block_vector_t* const p_input,
+                       block_vector_t* const p_output,
+                       const key_schedule_t* const p_key_sched,
+                       const __m128i counter)
+{
+    AesCipherVperm(p_input, p_output, p_key_sched, counter, NUM_ROUNDS_256);
+}
+
+/* Indexed by KEY_SIZE_INDEX() */
+const cpu_cipher_t vperm_ciphers[] = {AesCipher128Vperm,
+                                      AesCipher192Vperm,
+                                      AesCipher256Vperm};
+
+__m128i VpermRound(const __m128i state, const aes_key_t* const p_key)
+{
+    __m128i out = VpermSubBytes(state);
+    out = _mm_shuffle_epi8(out, (__m128i) shift_rows_mask);
+    out = VpermMixColumns(out);
+    return out ^ p_key->i;
+}
+
+__m128i VpermSubBytes(const __m128i state)
+{
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+    
+    // Change to the tower field basis
+    __m128i lo = state & low_nibble;
+    __m128i hi = _mm_srli_epi16(state, 4) & low_nibble;
+    __m128i x = _mm_shuffle_epi8((__m128i) vperm_ipt_lo, lo) ^
+                _mm_shuffle_epi8((__m128i) vperm_ipt_hi, hi);
+    
+    __m128i k = x & low_nibble;
+    __m128i i = _mm_srli_epi16(x, 4) & low_nibble;
+    __m128i j = i ^ k;
+    
+    // Invert using only GF(2^4) reciprocals
+    __m128i ak = _mm_shuffle_epi8((__m128i) vperm_inva, k);
+    __m128i iak = _mm_shuffle_epi8((__m128i) vperm_inv, i) ^ ak;
+    __m128i jak = _mm_shuffle_epi8((__m128i) vperm_inv, j) ^ ak;
+    __m128i io = _mm_shuffle_epi8((__m128i) vperm_inv, iak) ^ j;
+    __m128i jo = _mm_shuffle_epi8((__m128i) vperm_inv, jak) ^ i;
+    
+    // Change back and apply the affine transform
+    return _mm_shuffle_epi8((__m128i) vperm_sbo_io, io) ^
+           _mm_shuffle_epi8((__m128i) vperm_sbo_jo, jo) ^
+           _mm_set1_epi8(0x63);
+}
+
+__m128i VpermMixColumns(const __m128i state)
+{
+    // For each column, with a_r the byte in row r:
+    //   out_r = 2*(a_r ^ a_(r+1)) ^ a_(r+1) ^ (a_(r+2) ^ a_(r+3))
+    __m128i a1 = _mm_shuffle_epi8(state, (__m128i) vperm_rotate_1);
+    __m128i t = state ^ a1;
+    
+    // Multiply every byte by 2, reducing by 0x1b where the top bit was set
+    __m128i overflow = _mm_cmpgt_epi8(_mm_setzero_si128(), t);
+    __m128i t2 = _mm_add_epi8(t, t) ^ (overflow & _mm_set1_epi8(0x1b));
+    
+    return t2 ^ a1 ^ _mm_shuffle_epi8(t, (__m128i) vperm_rotate_2);
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef AESXTS_H
+#define AESXTS_H
+
+#include <tmmintrin.h>
+
+#include "aes.h"
+#include "aes_ni.h"
+
+/**
+ *  XTS mode from IEEE 1619, as used for disk encryption.  The data is
+ *  split into sectors (data units), and each sector's tweak is the
+ *  encryption of its little endian sector number under a second key.
+ *  Block j of a sector is whitened with tweak * alpha^j in GF(2^128),
+ *  where multiplying by alpha is a 128-bit left shift reduced by 0x87.
+ *
+ *  Sectors are independent, so the bench splits a file into whole
+ *  sectors across threads.  Sectors end on a whole block, so ciphertext
+ *  stealing is never needed.
+ */
+
+/* Supported sector sizes, in blocks */
+#define XTS_SECTOR_512_BLOCKS  (512/(BLOCK_SIZE*WORD_SIZE))
+#define XTS_SECTOR_4096_BLOCKS (4096/(BLOCK_SIZE*WORD_SIZE))
+
+typedef struct xts_key_schedule_t {
+    key_schedule_t data;    /* Encrypts the sector contents */
+    key_schedule_t tweak;   /* Encrypts the sector numbers */
+} xts_key_schedule_t;
+
+/*
+ * Multiplies a tweak by alpha.  Each 32-bit lane shifts left by 1 and
+ * takes the top bit of the lane below it; the top bit of the whole
+ * value wraps around to lane 0 as the reduction 0x87.
+ */
+static inline __attribute__((always_inline))
+__m128i XtsDouble(const __m128i tweak)
+{
+    __m128i carry = _mm_shuffle_epi32(_mm_srai_epi32(tweak, 31), 0x93);
+    carry &= _mm_set_epi32(1, 1, 1, 0x87);
+    return _mm_slli_epi32(tweak, 1) ^ carry;
+}
+
+/*
+ * XTS-AES-128 uses two 128-bit keys, taken from the 256 bits of p_key.
+ */
+void XtsKeyExpansion(const cipher_key_t* const p_key,
+                     xts_key_schedule_t* const p_xts_sched)
+{
+    cipher_key_t tweak_key;
+    tweak_key.i[0] = p_key->i[1];
+
+    KeyExpansion(p_key, &(p_xts_sched->data), 128);
+    KeyExpansion(&tweak_key, &(p_xts_sched->tweak), 128);
+}
+
+/*
+ * Encrypts count blocks starting at the beginning of sector first_sector.
+ * CTR_PIPELINE_BLOCKS blocks are in flight at once, and their tweaks are
+ * doubled in registers while the previous blocks go through the rounds.
+ * This is only called with a constant num_rounds (see the wrappers below).
+ */
+static inline __attribute__((always_inline))
+void AesXts(const block_vector_t* const p_input,
+            block_vector_t* const p_output,
+            const size_t count,
+            const xts_key_schedule_t* const p_xts_sched,
+            const uint64_t first_sector,
+            const size_t sector_blocks,
+            const uint8_t num_rounds)
+{
+    __m128i k[MAX_ROUNDS+1];
+    for (uint8_t round = 0; round <= num_rounds; ++round)
+    {
+        k[round] = p_xts_sched->data.k[round].i;
+    }
+
+    uint64_t sector = first_sector;
+    for (size_t sector_start = 0;
+         sector_start < count;
+         sector_start += sector_blocks, ++sector)
+    {
+        // The tweak is the encrypted sector number
+        __m128i tweak = AesCipher128(_mm_setzero_si128(),
+                                     &(p_xts_sched->tweak),
+                                     _mm_set_epi64x(0, sector));
+
+        size_t sector_end = sector_start + sector_blocks < count ?
+                            sector_start + sector_blocks :
+                            count;
+
+        size_t block = sector_start;
+        for (; block + CTR_PIPELINE_BLOCKS <= sector_end;
+             block += CTR_PIPELINE_BLOCKS)
+        {
+            __m128i tweaks[CTR_PIPELINE_BLOCKS];
+            __m128i state[CTR_PIPELINE_BLOCKS];
+            for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+            {
+                tweaks[i] = tweak;
+                state[i] = p_input[block+i].i ^ tweak ^ k[0];
+                tweak = XtsDouble(tweak);
+            }
+
+            // The last round is a little different, so it is excluded
+            #pragma GCC unroll 16
+            for (uint8_t round = 1; round < num_rounds; ++round)
+            {
+                for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+                {
+                    state[i] = _mm_aesenc_si128(state[i], k[round]);
+                }
+            }
+
+            // Perform the last round and whiten with the tweak again
+            for (uint8_t i = 0; i < CTR_PIPELINE_BLOCKS; ++i)
+            {
+                state[i] = _mm_aesenclast_si128(state[i], k[num_rounds]);
+                p_output[block+i].i = state[i] ^ tweaks[i];
+            }
+        }
+
+        // A short last sector may leave blocks that do not fill a batch
+        for (; block < sector_end; ++block)
+        {
+            __m128i state = p_input[block].i ^ tweak ^ k[0];
+            for (uint8_t round = 1; round < num_rounds; ++round)
+            {
+                state = _mm_aesenc_si128(state, k[round]);
+            }
+            state = _mm_aesenclast_si128(state, k[num_rounds]);
+            p_output[block].i = state ^ tweak;
+            tweak = XtsDouble(tweak);
+        }
+    }
+}
+
+void AesXts128(const block_vector_t* const p_input,
+               block_vector_t* const p_output,
+               const size_t count,
+               const xts_key_schedule_t* const p_xts_sched,
+               const uint64_t first_sector,
+               const size_t sector_blocks)
+{
+    AesXts(p_input, p_output, count, p_xts_sched, first_sector,
+           sector_blocks, NUM_ROUNDS_128);
+}
+
+#endif
@@ -0,0 +1,401 @@
+#ifndef BENCHCOMMON_H
+#define BENCHCOMMON_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aes.h"
+#include "file_utils.h"
+#include "page_stats.h"
+#include "perf_counters.h"
+#include "phase_timer.h"
+#include "stream_io.h"
+#include "synthetic.h"
+#include "thread_pool.h"
+#include "uring_io.h"
+
+/**
+ *  The parts of bench_cpu, bench_ni and bench_gcrypt that do not depend
+ *  on the cipher: the shared options, opening the input, and running a
+ *  job over it with the chosen I/O engine.  Each main() goes
+ *      bench_init()
+ *      getopt() with its own options and BENCH_OPTIONS, passing any it
+ *          does not handle itself to parse_bench_option()
+ *      its own checks, then bench_open()
+ *      key expansion, then bench_start_pool()
+ *      bench_run() with its job
+ *      bench_finish()
+ *  Any error prints the usage and exits.
+ */
+
+/* getopt() string of the options parse_bench_option() takes */
+#define BENCH_OPTIONS "b:dei:M:npr:A:N:S:"
+
+typedef struct bench_t {
+    uint16_t key_bits;                  /* -b */
+    bool decrypt;                       /* -d */
+    bool count_events;                  /* -e */
+    io_engine_t io_engine;              /* -i */
+    unsigned map_hints;                 /* -M */
+    bool report_pages;                  /* -M */
+    bool place;                         /* -n */
+    bool pin;                           /* -p, -n */
+    long repeat;                        /* -r */
+    size_t synthetic_bytes;             /* -S, 0 to use files */
+    size_t synthetic_align;             /* -A, 0 for CACHE_LINE_SIZE */
+    int synthetic_node;                 /* -N */
+    long thread_count;
+    
+    phase_timer_t timer;
+    aes_file_t input;
+    aes_file_t output;
+    synthetic_t synthetic;
+    page_stats_t page_stats;
+    thread_pool_t pool;
+    perf_counters_t counters;
+} bench_t;
+
+/* Sets the defaults and starts timing the setup */
+void bench_init(bench_t* const p_bench)
+{
+    memset(p_bench, 0, sizeof(*p_bench));
+    phase_timer_start(&(p_bench->timer), PHASE_SETUP);
+    
+    p_bench->key_bits = 128;
+    p_bench->io_engine = IO_MMAP;
+    p_bench->map_hints = MAP_HINT_NONE;
+    p_bench->repeat = 1;
+    p_bench->synthetic_node = SYNTHETIC_NO_NODE;
+}
+
+void bench_usage(bench_t* const p_bench)
+{
+    print_usage_and_cleanup(&(p_bench->input), &(p_bench->output));
+}
+
+/* Handles one of BENCH_OPTIONS; anything else is a usage error */
+void parse_bench_option(bench_t* const p_bench,
+                        const int opt,
+                        const char* const p_arg)
+{
+    switch (opt)
+    {
+        case 'b':
+            p_bench->key_bits = parse_key_bits(p_arg);
+            if (p_bench->key_bits == 0)
+            {
+                bench_usage(p_bench);
+            }
+            break;
+        case 'd':
+            p_bench->decrypt = true;
+            break;
+        case 'A':
+            p_bench->synthetic_align = parse_size(p_arg);
+            if (p_bench->synthetic_align < CACHE_LINE_SIZE ||
+                (p_bench->synthetic_align & (p_bench->synthetic_align - 1)) != 0)
+            {
+                printf("Alignment must be a power of two of at least %d bytes\n",
+                       CACHE_LINE_SIZE);
+                bench_usage(p_bench);
+            }
+            break;
+        case 'e':
+            p_bench->count_events = true;
+            break;
+        case 'i':
+            if (strcmp(p_arg, "mmap") == 0)
+            {
+                p_bench->io_engine = IO_MMAP;
+            }
+            else if (strcmp(p_arg, "stream") == 0)
+            {
+                p_bench->io_engine = IO_STREAM;
+            }
+            else if (strcmp(p_arg, "uring") == 0)
+            {
+                p_bench->io_engine = IO_URING;
+            }
+            else
+            {
+                printf("Unknown I/O engine: %s\n", p_arg);
+                bench_usage(p_bench);
+            }
+            break;
+        case 'M':
+            p_bench->map_hints = parse_map_hints(p_arg);
+            if (p_bench->map_hints == MAP_HINT_INVALID)
+            {
+                bench_usage(p_bench);
+            }
+            p_bench->report_pages = true;
+            break;
+        case 'N':
+            p_bench->synthetic_node = (int) strtol(p_arg, NULL, 10);
+            if (p_bench->synthetic_node < 0 ||
+                p_bench->synthetic_node >= SYNTHETIC_MAX_NODES)
+            {
+                printf("NUMA node must be from 0 to %d\n", SYNTHETIC_MAX_NODES - 1);
+                bench_usage(p_bench);
+            }
+            break;
+        case 'n':
+            // First touch only puts pages near a worker that stays put
+            p_bench->place = true;
+            p_bench->pin = true;
+            break;
+        case 'p':
+            p_bench->pin = true;
+            break;
+        case 'r':
+            p_bench->repeat = strtol(p_arg, NULL, 10);
+            if (p_bench->repeat < 1)
+            {
+                printf("Repeat count is not a positive number\n");
+                bench_usage(p_bench);
+            }
+            break;
+        case 'S':
+            p_bench->synthetic_bytes = parse_size(p_arg);
+            if (p_bench->synthetic_bytes == 0)
+            {
+                printf("Size must be a positive number of bytes\n");
+                bench_usage(p_bench);
+            }
+            break;
+        default:
+            bench_usage(p_bench);
+    }
+}
+
+/*
+ * Checks the shared options against each other, then opens the input
+ * (files or synthetic buffers) and reads the thread count.  argv holds
+ * the arguments left after the options.
+ */
+void bench_open(bench_t* const p_bench, const int argc, char** const argv)
+{
+    // Buffers are reused, so there is nothing to place
+    if (p_bench->io_engine != IO_MMAP && p_bench->place)
+    {
+        printf("-n needs -i mmap\n");
+        bench_usage(p_bench);
+    }
+    
+    // The buffered engines make one pass over a file
+    if (p_bench->io_engine != IO_MMAP &&
+        (p_bench->synthetic_bytes > 0 || p_bench->repeat > 1))
+    {
+        printf("-S and -r need -i mmap\n");
+        bench_usage(p_bench);
+    }
+    
+    // Synthetic buffers are filled by the main thread, so -N places them
+    if (p_bench->synthetic_bytes == 0 &&
+        (p_bench->synthetic_align != 0 ||
+         p_bench->synthetic_node != SYNTHETIC_NO_NODE))
+    {
+        printf("-A and -N need -S\n");
+        bench_usage(p_bench);
+    }
+    else if (p_bench->synthetic_bytes > 0 && p_bench->place)
+    {
+        printf("-S places memory with -N instead of -n\n");
+        bench_usage(p_bench);
+    }
+    if (p_bench->synthetic_align == 0)
+    {
+        p_bench->synthetic_align = CACHE_LINE_SIZE;
+    }
+    
+    // Synthetic runs take no filenames, only the thread count
+    int file_args = p_bench->synthetic_bytes > 0 ? 0 : 2;
+    if (argc < file_args)
+    {
+        bench_usage(p_bench);
+    }
+    
+    // Started before the files are mapped, to count MAP_POPULATE's faults
+    if (p_bench->report_pages)
+    {
+        page_stats_start(&(p_bench->page_stats));
+    }
+    
+    phase_timer_switch(&(p_bench->timer), PHASE_IO_MAP);
+    if (p_bench->synthetic_bytes > 0)
+    {
+        open_synthetic(p_bench->synthetic_bytes,
+                       p_bench->synthetic_align,
+                       p_bench->synthetic_node,
+                       p_bench->map_hints,
+                       &(p_bench->synthetic),
+                       &(p_bench->input),
+                       &(p_bench->output));
+    }
+    else if (p_bench->io_engine == IO_STREAM)
+    {
+        open_files_streaming(argv[0], argv[1], &(p_bench->input), &(p_bench->output));
+    }
+    else if (p_bench->io_engine == IO_URING)
+    {
+        open_files_uring(argv[0], argv[1], &(p_bench->input), &(p_bench->output));
+    }
+    else
+    {
+        open_files(argv[0],
+                   argv[1],
+                   &(p_bench->input),
+                   &(p_bench->output),
+                   p_bench->map_hints);
+    }
+    
+    phase_timer_switch(&(p_bench->timer), PHASE_SETUP);
+    
+    if (argc > file_args)
+    {
+        p_bench->thread_count = strtol(argv[file_args], NULL, 10);
+        if (p_bench->thread_count < 1)
+        {
+            printf("Thread count is not a positive number\n");
+            bench_usage(p_bench);
+        }
+    }
+    else
+    {
+        printf("Thread count not provided; defaulting to 1 thread.\n");
+        p_bench->thread_count = 1;
+    }
+}
+
+/* Starts thread_count workers, and their counters with -e */
+void bench_start_pool(bench_t* const p_bench)
+{
+    if (!thread_pool_create(&(p_bench->pool), p_bench->thread_count, p_bench->pin))
+    {
+        printf("Could not start the thread pool\n");
+        bench_usage(p_bench);
+    }
+    
+    if (p_bench->count_events &&
+        !perf_counters_open(&(p_bench->counters), &(p_bench->pool)))
+    {
+        printf("Could not allocate counters\n");
+        bench_usage(p_bench);
+    }
+}
+
+/*
+ * Runs p_job over the whole input with the chosen I/O engine, repeat
+ * times with -i mmap.  The hook sees every pass's tasks in file order.
+ * Timing is left in PHASE_ENCRYPT, so a tag can still be counted in it.
+ */
+void bench_run(bench_t* const p_bench, const buffer_job_t* const p_job)
+{
+    phase_timer_switch(&(p_bench->timer), PHASE_ENCRYPT);
+    if (p_bench->count_events)
+    {
+        perf_counters_start(&(p_bench->counters));
+    }
+    
+    if (p_bench->io_engine == IO_STREAM)
+    {
+        if (!stream_files(&(p_bench->input), &(p_bench->output), p_job))
+        {
+            bench_usage(p_bench);
+        }
+        return;
+    }
+    if (p_bench->io_engine == IO_URING)
+    {
+        if (!uring_files(&(p_bench->input), &(p_bench->output), p_job))
+        {
+            bench_usage(p_bench);
+        }
+        return;
+    }
+    
+    // Taking a shortcut here
+    // Arrays are not thread-safe in general
+    // However, if I ensure that no cache line spans multiple tasks,
+    // I can assume that I am thread-safe.
+    
+    // Most OSes should be cache line-aligning mmap()
+    // Double check this assumption
+    if ((size_t) p_bench->input.p_data % CACHE_LINE_SIZE != 0 ||
+        (size_t) p_bench->output.p_data % CACHE_LINE_SIZE != 0)
+    {
+        printf("Working memory is not cache aligned\n");
+        bench_usage(p_bench);
+    }
+    
+    thread_args_t* p_tasks;
+    size_t task_count = split_into_chunks(&(p_bench->input),
+                                          &(p_bench->output),
+                                          p_job->p_key_sched,
+                                          p_job->nonce,
+                                          p_job->chunk_blocks,
+                                          &p_tasks);
+    if (p_tasks == NULL)
+    {
+        printf("Could not allocate tasks\n");
+        bench_usage(p_bench);
+    }
+    
+    // Placing pages is part of mapping the files
+    if (p_bench->place)
+    {
+        phase_timer_switch(&(p_bench->timer), PHASE_IO_MAP);
+        thread_pool_first_touch(&(p_bench->pool), p_tasks, task_count);
+        phase_timer_switch(&(p_bench->timer), PHASE_ENCRYPT);
+    }
+    for (long i = 0; i < p_bench->repeat; ++i)
+    {
+        thread_pool_run(&(p_bench->pool), p_job->function, p_tasks, task_count);
+        if (p_job->p_hook != NULL)
+        {
+            p_job->p_hook(p_tasks, task_count);
+        }
+    }
+    free(p_tasks);
+}
+
+/* Stops timing, prints what was asked for and releases everything */
+void bench_finish(bench_t* const p_bench)
+{
+    if (p_bench->count_events)
+    {
+        perf_counters_stop(&(p_bench->counters));
+    }
+    phase_timer_switch(&(p_bench->timer), PHASE_TEARDOWN);
+    
+    if (p_bench->pin)
+    {
+        print_node_throughput(&(p_bench->pool));
+    }
+    if (p_bench->count_events)
+    {
+        print_perf_counters(&(p_bench->counters));
+        perf_counters_free(&(p_bench->counters));
+    }
+    thread_pool_destroy(&(p_bench->pool));
+    
+    if (p_bench->report_pages)
+    {
+        page_stats_stop(&(p_bench->page_stats));
+        print_page_stats(&(p_bench->page_stats));
+    }
+    
+    if (p_bench->synthetic_bytes > 0)
+    {
+        close_synthetic(&(p_bench->synthetic), &(p_bench->input), &(p_bench->output));
+    }
+    close_files(&(p_bench->input), &(p_bench->output));
+    
+    phase_timer_stop(&(p_bench->timer));
+    print_phase_times(&(p_bench->timer), p_bench->input.size_bytes*p_bench->repeat);
+}
+
+#endif
@@ -0,0 +1,392 @@
+#ifndef CLCACHE_H
+#define CLCACHE_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 220
+#endif
+
+#include <CL/cl.h>
+
+/**
+ *  Caches the built OpenCL program, since building from source takes a
+ *  large part of a short bench_cl run.  Each entry is for one
+ *      platform name, device name, driver version,
+ *      hash of the sources, build options
+ *  and a change to any of them misses the cache, so a stale binary is
+ *  never loaded.  Entries are files in CL_CACHE_DIR named after a hash
+ *  of that key, and start with a header holding the key itself:
+ *      cl_cache_header_t
+ *      the key (key_length bytes)
+ *      the program binary (binary_length bytes)
+ *  An entry is used only if its key matches in full and the runtime
+ *  accepts the binary.  Otherwise the program is built from source and
+ *  the entry is written again.
+ */
+
+#define CL_CACHE_DIR     "bin/cl_cache"
+#define CL_CACHE_MAGIC   "AESCLv1"
+#define CL_BUILD_OPTIONS "-Isrc/include"
+
+/* Longest key, and of each device string in it */
+#define CL_CACHE_KEY_LENGTH  1024
+#define CL_CACHE_INFO_LENGTH 256
+
+/* The kernel source, then every file it includes */
+const char* const cl_source_paths[] = {"src/include/aes.cl",
+                                       "src/include/aes.h"};
+
+typedef struct cl_cache_header_t {
+    char magic[8];
+    uint64_t key_length;
+    uint64_t binary_length;
+} cl_cache_header_t;
+
+/* 64-bit FNV-1a; start with hash = FNV_OFFSET_BASIS */
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME        0x100000001b3ull
+
+uint64_t fnv1a(uint64_t hash, const void* const p_data, const size_t length)
+{
+    const uint8_t* p_bytes = (const uint8_t*) p_data;
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= p_bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Reads a whole file into a new buffer, with a '\0' after it so that
+ * sources can be used as strings.  Returns NULL on failure.
+ */
+char* read_whole_file(const char* const p_path, size_t* const p_length)
+{
+    int fd = open(p_path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    
+    struct stat file_stat;
+    char* p_data = NULL;
+    if (fstat(fd, &file_stat) == 0)
+    {
+        p_data = malloc(file_stat.st_size + 1);
+    }
+    
+    size_t length = 0;
+    while (p_data != NULL && length < (size_t) file_stat.st_size)
+    {
+        ssize_t bytes = read(fd, p_data + length, file_stat.st_size - length);
+        if (bytes <= 0)
+        {
+            free(p_data);
+            p_data = NULL;
+        }
+        else
+        {
+            length += bytes;
+        }
+    }
+    close(fd);
+    
+    if (p_data != NULL)
+    {
+        p_data[length] = '\0';
+        *p_length = length;
+    }
+    return p_data;
+}
+
+/*
+ * Writes the cache key for device and the sources with source_hash:
+ * "<platform>|<device>|<driver>|<source hash>|<build options>"
+ */
+void get_cache_key(const cl_device_id device,
+                   const uint64_t source_hash,
+                   char* const p_key,
+                   const size_t key_length)
+{
+    cl_platform_id platform;
+    char platform_name[CL_CACHE_INFO_LENGTH] = "";
+    char device_name[CL_CACHE_INFO_LENGTH] = "";
+    char driver[CL_CACHE_INFO_LENGTH] = "";
+    clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+    clGetPlatformInfo(platform,
+                      CL_PLATFORM_NAME,
+                      sizeof(platform_name),
+                      platform_name,
+                      NULL);
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+    
+    snprintf(p_key,
+             key_length,
+             "%s|%s|%s|%016llx|%s",
+             platform_name,
+             device_name,
+             driver,
+             (unsigned long long) source_hash,
+             CL_BUILD_OPTIONS);
+}
+
+/* Loads and builds the entry at p_path if it is for p_key, else NULL */
+cl_program load_cached_program(const cl_context context,
+                               const cl_device_id device,
+                               const char* const p_key,
+                               const char* const p_path)
+{
+    size_t length;
+    char* p_entry = read_whole_file(p_path, &length);
+    if (p_entry == NULL)
+    {
+        return NULL;
+    }
+    
+    cl_cache_header_t header;
+    bool valid = length >= sizeof(header);
+    if (valid)
+    {
+        memcpy(&header, p_entry, sizeof(header));
+        valid = memcmp(header.magic, CL_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                header.key_length == strlen(p_key) &&
+                header.binary_length > 0 &&
+                length == sizeof(header) + header.key_length + header.binary_length &&
+                memcmp(p_entry + sizeof(header), p_key, header.key_length) == 0;
+    }
+    
+    // The runtime checks the binary itself when it is built
+    cl_program program = NULL;
+    if (valid)
+    {
+        const unsigned char* p_binary =
+            (const unsigned char*) p_entry + sizeof(header) + header.key_length;
+        size_t binary_length = header.binary_length;
+        cl_int binary_status;
+        cl_int err;
+        program = clCreateProgramWithBinary(context,
+                                            1,
+                                            &device,
+                                            &binary_length,
+                                            &p_binary,
+                                            &binary_status,
+                                            &err);
+        if (err == CL_SUCCESS && binary_status == CL_SUCCESS)
+        {
+            err = clBuildProgram(program, 1, &device, CL_BUILD_OPTIONS, NULL, NULL);
+        }
+        if (program != NULL && (err != CL_SUCCESS || binary_status != CL_SUCCESS))
+        {
+            clReleaseProgram(program);
+            program = NULL;
+        }
+    }
+    free(p_entry);
+    
+    return program;
+}
+
+/* Prints the build log of program, for when the build failed */
+void print_build_log(const cl_program program, const cl_device_id device)
+{
+    size_t log_length = 0;
+    clGetProgramBuildInfo(program,
+                          device,
+                          CL_PROGRAM_BUILD_LOG,
+                          0,
+                          NULL,
+                          &log_length);
+    char* p_log = malloc(log_length + 1);
+    if (p_log == NULL)
+    {
+        return;
+    }
+    
+    p_log[0] = '\0';
+    clGetProgramBuildInfo(program,
+                          device,
+                          CL_PROGRAM_BUILD_LOG,
+                          log_length,
+                          p_log,
+                          NULL);
+    p_log[log_length] = '\0';
+    printf("%s\n", p_log);
+    free(p_log);
+}
+
+/* Builds the program from p_source, printing the build log on failure */
+cl_program build_program_from_source(const cl_context context,
+                                     const cl_device_id device,
+                                     const char* p_source,
+                                     const size_t source_length)
+{
+    cl_int err;
+    cl_program program = clCreateProgramWithSource(context,
+                                                   1,
+                                                   &p_source,
+                                                   &source_length,
+                                                   &err);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error in clCreateProgramWithSource: %d\n", err);
+        return NULL;
+    }
+    
+    err = clBuildProgram(program, 1, &device, CL_BUILD_OPTIONS, NULL, NULL);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error in clBuildProgram: %d\n", err);
+        print_build_log(program, device);
+        clReleaseProgram(program);
+        return NULL;
+    }
+    
+    return program;
+}
+
+/*
+ * Writes the binary of program to p_path as the entry for p_key.  The
+ * entry is written next to it and renamed, so runs in parallel never see
+ * half an entry.
+ */
+bool save_program_binary(const cl_program program,
+                         const char* const p_key,
+                         const char* const p_path)
+{
+    // There is 1 binary per device, and 1 device
+    size_t binary_length = 0;
+    if (clGetProgramInfo(program,
+                         CL_PROGRAM_BINARY_SIZES,
+                         sizeof(binary_length),
+                         &binary_length,
+                         NULL) != CL_SUCCESS ||
+        binary_length == 0)
+    {
+        return false;
+    }
+    unsigned char* p_binary = malloc(binary_length);
+    if (p_binary == NULL ||
+        clGetProgramInfo(program,
+                         CL_PROGRAM_BINARIES,
+                         sizeof(p_binary),
+                         &p_binary,
+                         NULL) != CL_SUCCESS)
+    {
+        free(p_binary);
+        return false;
+    }
+    
+    cl_cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CL_CACHE_MAGIC, sizeof(header.magic));
+    header.key_length = strlen(p_key);
+    header.binary_length = binary_length;
+    
+    // bin/ is made by the build, but the cache directory may not exist yet
+    if (mkdir(CL_CACHE_DIR, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 &&
+        errno != EEXIST)
+    {
+        free(p_binary);
+        return false;
+    }
+    
+    char temp_path[CL_CACHE_KEY_LENGTH];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", p_path, (int) getpid());
+    FILE* p_file = fopen(temp_path, "wb");
+    bool saved = p_file != NULL &&
+                 fwrite(&header, sizeof(header), 1, p_file) == 1 &&
+                 fwrite(p_key, header.key_length, 1, p_file) == 1 &&
+                 fwrite(p_binary, binary_length, 1, p_file) == 1;
+    if (p_file != NULL)
+    {
+        saved = fclose(p_file) == 0 && saved;
+    }
+    saved = saved && rename(temp_path, p_path) == 0;
+    if (!saved)
+    {
+        unlink(temp_path);
+    }
+    free(p_binary);
+    
+    return saved;
+}
+
+/*
+ * Returns the built program for device, from the cache if it has a
+ * valid entry and from source otherwise, or NULL if it cannot be built.
+ * With rebuild, the cache is not read, but its entry is still written.
+ */
+cl_program get_program(const cl_context context,
+                       const cl_device_id device,
+                       const bool rebuild)
+{
+    // Every file that goes into the build is part of the key
+    uint64_t source_hash = FNV_OFFSET_BASIS;
+    char* p_source = NULL;
+    size_t source_length = 0;
+    for (size_t i = 0; i < sizeof(cl_source_paths)/sizeof(cl_source_paths[0]); ++i)
+    {
+        size_t length;
+        char* p_data = read_whole_file(cl_source_paths[i], &length);
+        if (p_data == NULL)
+        {
+            printf("Failed to read %s\n", cl_source_paths[i]);
+            free(p_source);
+            return NULL;
+        }
+        source_hash = fnv1a(source_hash, p_data, length);
+        
+        // Only the first is compiled; it includes the rest
+        if (i == 0)
+        {
+            p_source = p_data;
+            source_length = length;
+        }
+        else
+        {
+            free(p_data);
+        }
+    }
+    
+    char key[CL_CACHE_KEY_LENGTH];
+    get_cache_key(device, source_hash, key, sizeof(key));
+    char path[CL_CACHE_KEY_LENGTH];
+    snprintf(path,
+             sizeof(path),
+             "%s/%016llx.bin",
+             CL_CACHE_DIR,
+             (unsigned long long) fnv1a(FNV_OFFSET_BASIS, key, strlen(key)));
+    
+    cl_program program = rebuild ? NULL :
+                         load_cached_program(context, device, key, path);
+    if (program != NULL)
+    {
+        printf("cl_cache=hit\n");
+        free(p_source);
+        return program;
+    }
+    
+    printf("cl_cache=%s\n", rebuild ? "rebuild" : "miss");
+    program = build_program_from_source(context, device, p_source, source_length);
+    free(p_source);
+    if (program != NULL && !save_program_binary(program, key, path))
+    {
+        printf("Could not write %s\n", path);
+    }
+    
+    return program;
+}
+
+#endif
@@ -0,0 +1,589 @@
+#ifndef CLPIPELINE_H
+#define CLPIPELINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 220
+#endif
+
+#include <CL/cl.h>
+
+#include "aes.h"
+
+/**
+ *  Moves the file through the device in batches, with a set of device
+ *  buffers and an in-order command queue for each batch in flight:
+ *      write batch N into set N % set_count
+ *      run the kernel on it
+ *      read it back into the output
+ *  Nothing in the loop blocks, so with two or three sets the upload of
+ *  batch N+1 and the download of batch N-1 overlap with the kernel of
+ *  batch N.  A set's own queue keeps its batches in order, so a buffer is
+ *  only overwritten after the batch before has been read back.  With one
+ *  set, every step waits for the one before, as a plain loop would.
+ *
+ *  Where host and device share memory, copying into device buffers only
+ *  moves the data from one part of RAM to another.  The zero-copy
+ *  transfers skip that:
+ *      TRANSFER_HOST_PTR wraps each batch of the input and output mappings
+ *          in a CL_MEM_USE_HOST_PTR buffer, and maps the output to make the
+ *          results visible.  The mappings must be page aligned.
+ *      TRANSFER_ALLOC_HOST fills CL_MEM_ALLOC_HOST_PTR buffers through
+ *          clEnqueueMapBuffer(), for mappings that are not.  This costs a
+ *          memcpy() each way, but no transfer to the device.
+ */
+
+#define CL_MAX_BUFFER_SETS 3
+
+/* Default batch when pipelined: small enough for several batches in flight */
+#define CL_PIPELINE_BATCH_BYTES (16*1024*1024)
+
+/* Runtimes only avoid a copy for host pointers aligned to a page */
+#define CL_ZERO_COPY_ALIGN 4096
+
+typedef enum transfer_t {
+    TRANSFER_COPY,          /* Device buffers, written and read each batch */
+    TRANSFER_HOST_PTR,      /* Buffers over the mappings themselves */
+    TRANSFER_ALLOC_HOST,    /* Host buffers, filled and drained through maps */
+} transfer_t;
+
+typedef enum kernel_variant_t {
+    KERNEL_SBOX,            /* One block per work-item, tables in constant memory */
+    KERNEL_TTABLE,          /* Several blocks per work-item, T-tables in local memory */
+    KERNEL_VARIANT_COUNT
+} kernel_variant_t;
+
+/* How the kernel is launched; zeros leave the choice to the runtime */
+typedef struct kernel_config_t {
+    kernel_variant_t variant;
+    size_t local_size;          /* Work-items per work-group */
+    cl_uint blocks_per_item;    /* KERNEL_TTABLE only; 0 means 1 */
+} kernel_config_t;
+
+/* Indexed by kernel_variant_t: -k names and kernel name suffixes */
+const char* kernel_variant_names[] = {"sbox", "ttable"};
+const char* kernel_variant_suffixes[] = {"", "TTable"};
+
+typedef struct cl_buffer_set_t {
+    cl_command_queue queue;
+    cl_mem d_input;
+    cl_mem d_output;
+    void* p_mapped_output;      /* TRANSFER_ALLOC_HOST: batch to drain */
+    block_vector_t* p_destination;
+    size_t mapped_bytes;
+} cl_buffer_set_t;
+
+typedef struct cl_pipeline_t {
+    cl_buffer_set_t sets[CL_MAX_BUFFER_SETS];
+    size_t set_count;
+    size_t batch_blocks;
+    transfer_t transfer;
+    kernel_config_t config;
+    cl_context context;
+    cl_kernel kernel;
+    cl_mem d_key_schedule;
+} cl_pipeline_t;
+
+/* Sets the cipher kernel's arguments; returns the first error */
+cl_int set_cipher_args(const cl_kernel kernel,
+                       const kernel_config_t* const p_config,
+                       const cl_mem d_input,
+                       const cl_mem d_output,
+                       const cl_mem d_key_schedule,
+                       const uint64_t first_block,
+                       const uint64_t block_count)
+{
+    cl_int err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_input);
+    if (err == CL_SUCCESS)
+    {
+        err = clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_output);
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_key_schedule);
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = clSetKernelArg(kernel, 3, sizeof(uint64_t), &first_block);
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = clSetKernelArg(kernel, 4, sizeof(uint64_t), &block_count);
+    }
+    if (err == CL_SUCCESS && p_config->variant == KERNEL_TTABLE)
+    {
+        err = clSetKernelArg(kernel, 5, sizeof(cl_uint), &p_config->blocks_per_item);
+    }
+    
+    return err;
+}
+
+/*
+ * Picks a transfer for p_arg ("auto", "copy" or "zero").  "auto" copies
+ * unless the device reports that it shares memory with the host.  A
+ * zero-copy transfer wraps the files when both start on a page.
+ * Returns -1 if p_arg is not one of these.
+ */
+int parse_transfer(const char* const p_arg,
+                   const cl_device_id device,
+                   const aes_file_t* const p_input,
+                   const aes_file_t* const p_output)
+{
+    bool zero_copy;
+    if (strcmp(p_arg, "auto") == 0)
+    {
+        cl_bool unified = CL_FALSE;
+        clGetDeviceInfo(device,
+                        CL_DEVICE_HOST_UNIFIED_MEMORY,
+                        sizeof(unified),
+                        &unified,
+                        NULL);
+        zero_copy = unified == CL_TRUE;
+    }
+    else if (strcmp(p_arg, "copy") == 0 || strcmp(p_arg, "zero") == 0)
+    {
+        zero_copy = p_arg[0] == 'z';
+    }
+    else
+    {
+        return -1;
+    }
+    
+    if (!zero_copy)
+    {
+        return TRANSFER_COPY;
+    }
+    return (uintptr_t) p_input->p_data % CL_ZERO_COPY_ALIGN == 0 &&
+           (uintptr_t) p_output->p_data % CL_ZERO_COPY_ALIGN == 0 ?
+           TRANSFER_HOST_PTR :
+           TRANSFER_ALLOC_HOST;
+}
+
+const char* transfer_name(const transfer_t transfer)
+{
+    const char* names[] = {"copy", "host_ptr", "alloc_host_ptr"};
+    return names[transfer];
+}
+
+/*
+ * Cuts batches of about batch_bytes, as large as the device allows, for
+ * size_blocks of input.  Batches do not exceed the input, but hold at
+ * least a block, and with TRANSFER_HOST_PTR every batch starts on a page.
+ */
+size_t get_batch_blocks(const size_t batch_bytes,
+                        const cl_ulong max_alloc_bytes,
+                        const transfer_t transfer,
+                        const size_t size_blocks)
+{
+    size_t max_alloc_blocks = max_alloc_bytes / sizeof(block_vector_t);
+    size_t batch_blocks = batch_bytes / sizeof(block_vector_t);
+    batch_blocks = batch_blocks < max_alloc_blocks ? batch_blocks : max_alloc_blocks;
+    
+    size_t page_blocks = CL_ZERO_COPY_ALIGN / sizeof(block_vector_t);
+    if (transfer == TRANSFER_HOST_PTR && batch_blocks > page_blocks)
+    {
+        batch_blocks -= batch_blocks % page_blocks;
+    }
+    
+    batch_blocks = size_blocks < batch_blocks ? size_blocks : batch_blocks;
+    return batch_blocks > 0 ? batch_blocks : 1;
+}
+
+/*
+ * Creates set_count sets of buffers of batch_blocks each, and a queue for
+ * each.  The kernel takes (input, output, key schedule, first block, block
+ * count) and, for KERNEL_TTABLE, blocks per work-item.
+ * TRANSFER_HOST_PTR makes its buffers for each batch instead, so a batch
+ * should be a whole number of pages to keep every batch aligned.
+ * Returns the first OpenCL error, or CL_SUCCESS.
+ */
+cl_int cl_pipeline_create(cl_pipeline_t* const p_pipeline,
+                          const cl_context context,
+                          const cl_device_id device,
+                          const cl_kernel kernel,
+                          const kernel_config_t* const p_config,
+                          const cl_mem d_key_schedule,
+                          const transfer_t transfer,
+                          const size_t set_count,
+                          const size_t batch_blocks)
+{
+    memset(p_pipeline, 0, sizeof(*p_pipeline));
+    p_pipeline->set_count = set_count;
+    p_pipeline->batch_blocks = batch_blocks;
+    p_pipeline->transfer = transfer;
+    p_pipeline->config = *p_config;
+    if (p_pipeline->config.blocks_per_item == 0)
+    {
+        p_pipeline->config.blocks_per_item = 1;
+    }
+    p_pipeline->context = context;
+    p_pipeline->kernel = kernel;
+    p_pipeline->d_key_schedule = d_key_schedule;
+    
+    cl_int err = CL_SUCCESS;
+    for (size_t i = 0; i < set_count && err == CL_SUCCESS; ++i)
+    {
+        cl_buffer_set_t* p_set = &(p_pipeline->sets[i]);
+        p_set->queue = clCreateCommandQueueWithProperties(context,
+                                                          device,
+                                                          NULL,
+                                                          &err);
+        if (transfer == TRANSFER_HOST_PTR)
+        {
+            continue;
+        }
+        
+        cl_mem_flags host_flags = transfer == TRANSFER_ALLOC_HOST ?
+                                  CL_MEM_ALLOC_HOST_PTR :
+                                  0;
+        if (err == CL_SUCCESS)
+        {
+            p_set->d_input = clCreateBuffer(context,
+                                            CL_MEM_READ_ONLY | host_flags,
+                                            batch_blocks*sizeof(block_vector_t),
+                                            NULL,
+                                            &err);
+        }
+        if (err == CL_SUCCESS)
+        {
+            p_set->d_output = clCreateBuffer(context,
+                                             CL_MEM_WRITE_ONLY | host_flags,
+                                             batch_blocks*sizeof(block_vector_t),
+                                             NULL,
+                                             &err);
+        }
+    }
+    
+    return err;
+}
+
+/* Queues one batch on a set, to be flushed by the caller */
+typedef cl_int (*enqueue_batch_t)(cl_pipeline_t* const p_pipeline,
+                                  cl_buffer_set_t* const p_set,
+                                  const block_vector_t* const p_input,
+                                  block_vector_t* const p_output,
+                                  const size_t blocks,
+                                  const uint64_t first_block);
+
+/* Runs the kernel over blocks already in a set's buffers */
+cl_int enqueue_kernel(cl_pipeline_t* const p_pipeline,
+                      cl_buffer_set_t* const p_set,
+                      const cl_mem d_input,
+                      const cl_mem d_output,
+                      const size_t blocks,
+                      const uint64_t first_block)
+{
+    // Arguments are captured when the kernel is enqueued, so one kernel
+    // serves every set
+    const kernel_config_t* p_config = &(p_pipeline->config);
+    cl_int err = set_cipher_args(p_pipeline->kernel,
+                                 p_config,
+                                 d_input,
+                                 d_output,
+                                 p_pipeline->d_key_schedule,
+                                 first_block,
+                                 blocks);
+    
+    // The kernels skip the work-items past the end of the batch, so the
+    // global size can be rounded up to a whole number of work-groups
+    size_t items = p_config->variant == KERNEL_TTABLE ?
+                   (blocks + p_config->blocks_per_item - 1) / p_config->blocks_per_item :
+                   blocks;
+    size_t local_size = p_config->local_size;
+    if (local_size > 0)
+    {
+        items = (items + local_size - 1) / local_size * local_size;
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = clEnqueueNDRangeKernel(p_set->queue,
+                                     p_pipeline->kernel,
+                                     1,
+                                     NULL,
+                                     &items,
+                                     local_size > 0 ? &local_size : NULL,
+                                     0,
+                                     NULL,
+                                     NULL);
+    }
+    
+    return err;
+}
+
+cl_int enqueue_copy_batch(cl_pipeline_t* const p_pipeline,
+                          cl_buffer_set_t* const p_set,
+                          const block_vector_t* const p_input,
+                          block_vector_t* const p_output,
+                          const size_t blocks,
+                          const uint64_t first_block)
+{
+    // The mappings outlive the run, so the copies need not block
+    cl_int err = clEnqueueWriteBuffer(p_set->queue,
+                                      p_set->d_input,
+                                      CL_FALSE,
+                                      0,
+                                      blocks*sizeof(block_vector_t),
+                                      p_input,
+                                      0,
+                                      NULL,
+                                      NULL);
+    if (err == CL_SUCCESS)
+    {
+        err = enqueue_kernel(p_pipeline,
+                             p_set,
+                             p_set->d_input,
+                             p_set->d_output,
+                             blocks,
+                             first_block);
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = clEnqueueReadBuffer(p_set->queue,
+                                  p_set->d_output,
+                                  CL_FALSE,
+                                  0,
+                                  blocks*sizeof(block_vector_t),
+                                  p_output,
+                                  0,
+                                  NULL,
+                                  NULL);
+    }
+    
+    return err;
+}
+
+cl_int enqueue_host_ptr_batch(cl_pipeline_t* const p_pipeline,
+                              cl_buffer_set_t* const p_set,
+                              const block_vector_t* const p_input,
+                              block_vector_t* const p_output,
+                              const size_t blocks,
+                              const uint64_t first_block)
+{
+    size_t bytes = blocks*sizeof(block_vector_t);
+    cl_int err;
+    cl_mem d_input = clCreateBuffer(p_pipeline->context,
+                                    CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+                                    bytes,
+                                    (void*) p_input,
+                                    &err);
+    cl_mem d_output = NULL;
+    if (err == CL_SUCCESS)
+    {
+        d_output = clCreateBuffer(p_pipeline->context,
+                                  CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR,
+                                  bytes,
+                                  p_output,
+                                  &err);
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = enqueue_kernel(p_pipeline,
+                             p_set,
+                             d_input,
+                             d_output,
+                             blocks,
+                             first_block);
+    }
+    
+    // Mapping is what guarantees the results are in p_output; with shared
+    // memory it is a cache flush at most
+    void* p_mapped = NULL;
+    if (err == CL_SUCCESS)
+    {
+        p_mapped = clEnqueueMapBuffer(p_set->queue,
+                                      d_output,
+                                      CL_FALSE,
+                                      CL_MAP_READ,
+                                      0,
+                                      bytes,
+                                      0,
+                                      NULL,
+                                      NULL,
+                                      &err);
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = clEnqueueUnmapMemObject(p_set->queue,
+                                      d_output,
+                                      p_mapped,
+                                      0,
+                                      NULL,
+                                      NULL);
+    }
+    
+    // The buffers are only freed once the queued commands are done
+    if (d_input != NULL)
+    {
+        clReleaseMemObject(d_input);
+    }
+    if (d_output != NULL)
+    {
+        clReleaseMemObject(d_output);
+    }
+    
+    return err;
+}
+
+/* Copies out a set's last TRANSFER_ALLOC_HOST batch, once it is done */
+cl_int drain_set(cl_buffer_set_t* const p_set)
+{
+    if (p_set->p_mapped_output == NULL)
+    {
+        return CL_SUCCESS;
+    }
+    
+    cl_int err = clFinish(p_set->queue);
+    if (err == CL_SUCCESS)
+    {
+        memcpy(p_set->p_destination, p_set->p_mapped_output, p_set->mapped_bytes);
+        err = clEnqueueUnmapMemObject(p_set->queue,
+                                      p_set->d_output,
+                                      p_set->p_mapped_output,
+                                      0,
+                                      NULL,
+                                      NULL);
+    }
+    p_set->p_mapped_output = NULL;
+    
+    return err;
+}
+
+cl_int enqueue_alloc_host_batch(cl_pipeline_t* const p_pipeline,
+                                cl_buffer_set_t* const p_set,
+                                const block_vector_t* const p_input,
+                                block_vector_t* const p_output,
+                                const size_t blocks,
+                                const uint64_t first_block)
+{
+    // The set's last batch has to be out before its buffers are reused
+    size_t bytes = blocks*sizeof(block_vector_t);
+    cl_int err = drain_set(p_set);
+    void* p_mapped = NULL;
+    if (err == CL_SUCCESS)
+    {
+        p_mapped = clEnqueueMapBuffer(p_set->queue,
+                                      p_set->d_input,
+                                      CL_TRUE,
+                                      CL_MAP_WRITE_INVALIDATE_REGION,
+                                      0,
+                                      bytes,
+                                      0,
+                                      NULL,
+                                      NULL,
+                                      &err);
+    }
+    if (err == CL_SUCCESS)
+    {
+        memcpy(p_mapped, p_input, bytes);
+        err = clEnqueueUnmapMemObject(p_set->queue,
+                                      p_set->d_input,
+                                      p_mapped,
+                                      0,
+                                      NULL,
+                                      NULL);
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = enqueue_kernel(p_pipeline,
+                             p_set,
+                             p_set->d_input,
+                             p_set->d_output,
+                             blocks,
+                             first_block);
+    }
+    
+    // Drained when the set comes round again, so the other sets run
+    // meanwhile
+    if (err == CL_SUCCESS)
+    {
+        p_set->p_mapped_output = clEnqueueMapBuffer(p_set->queue,
+                                                    p_set->d_output,
+                                                    CL_FALSE,
+                                                    CL_MAP_READ,
+                                                    0,
+                                                    bytes,
+                                                    0,
+                                                    NULL,
+                                                    NULL,
+                                                    &err);
+        p_set->p_destination = p_output;
+        p_set->mapped_bytes = bytes;
+    }
+    
+    return err;
+}
+
+/* Indexed by transfer_t */
+const enqueue_batch_t enqueue_batch[] = {enqueue_copy_batch,
+                                         enqueue_host_ptr_batch,
+                                         enqueue_alloc_host_batch};
+
+/*
+ * Encrypts the whole blocks of p_input into p_output and waits for the
+ * last batch.  Returns the first OpenCL error, or CL_SUCCESS.
+ */
+cl_int cl_pipeline_run(cl_pipeline_t* const p_pipeline,
+                       const aes_file_t* const p_input,
+                       aes_file_t* const p_output)
+{
+    cl_int err = CL_SUCCESS;
+    size_t batch = 0;
+    for (uint64_t offset = 0;
+         offset < p_input->size_blocks && err == CL_SUCCESS;
+         offset += p_pipeline->batch_blocks, ++batch)
+    {
+        cl_buffer_set_t* p_set = &(p_pipeline->sets[batch % p_pipeline->set_count]);
+        size_t blocks = p_input->size_blocks - offset < p_pipeline->batch_blocks ?
+                        p_input->size_blocks - offset :
+                        p_pipeline->batch_blocks;
+        
+        err = enqueue_batch[p_pipeline->transfer](p_pipeline,
+                                                  p_set,
+                                                  p_input->p_data + offset,
+                                                  p_output->p_data + offset,
+                                                  blocks,
+                                                  offset);
+        
+        // Start this set's work now, rather than when the queue fills
+        if (err == CL_SUCCESS)
+        {
+            err = clFlush(p_set->queue);
+        }
+    }
+    
+    for (size_t i = 0; i < p_pipeline->set_count; ++i)
+    {
+        cl_int finish_err = drain_set(&(p_pipeline->sets[i]));
+        err = err == CL_SUCCESS ? finish_err : err;
+        finish_err = clFinish(p_pipeline->sets[i].queue);
+        err = err == CL_SUCCESS ? finish_err : err;
+    }
+    
+    return err;
+}
+
+void cl_pipeline_destroy(cl_pipeline_t* const p_pipeline)
+{
+    for (size_t i = 0; i < p_pipeline->set_count; ++i)
+    {
+        cl_buffer_set_t* p_set = &(p_pipeline->sets[i]);
+        if (p_set->d_input != NULL)
+        {
+            clReleaseMemObject(p_set->d_input);
+        }
+        if (p_set->d_output != NULL)
+        {
+            clReleaseMemObject(p_set->d_output);
+        }
+        if (p_set->queue != NULL)
+        {
+            clReleaseCommandQueue(p_set->queue);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef CLTUNER_H
+#define CLTUNER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "aes.h"
+#include "cl_pipeline.h"
+#include "phase_timer.h"
+
+/**
+ *  Finds the fastest way to launch the kernels on a device, since the
+ *  best work-group size, blocks per work-item and batch size depend on the
+ *  device and driver, and the runtime's own choices are often poor.
+ *  tune_pipeline() times every combination of
+ *      kernel variant
+ *      work-group size (the runtime's, then powers of two)
+ *      blocks per work-item (KERNEL_TTABLE only)
+ *      batch size, as a fraction of CL_DEVICE_MAX_MEM_ALLOC_SIZE
+ *  on the input, and keeps the fastest.
+ *
+ *  Profiles are kept in one file with a line for each device:
+ *      <device name>|<driver version>|kernel=ttable local_size=64 ...
+ *  A driver update changes the key, so the device is tuned again.
+ */
+
+#define CL_PROFILE_PATH "bin/cl_profiles.txt"
+
+/* Longest line in the profile file, and of each part of its key */
+#define CL_PROFILE_LINE_LENGTH 1024
+#define CL_PROFILE_KEY_LENGTH  256
+
+/* Times each combination is run; the fastest run counts */
+#define CL_TUNE_RUNS 3
+
+typedef struct tuning_profile_t {
+    kernel_config_t config;
+    unsigned batch_divisor;     /* Batches are max_alloc_bytes/batch_divisor */
+} tuning_profile_t;
+
+/* Writes "<device name>|<driver version>|" to p_key */
+void get_profile_key(const cl_device_id device,
+                     char* const p_key,
+                     const size_t key_length)
+{
+    char name[CL_PROFILE_KEY_LENGTH] = "";
+    char driver[CL_PROFILE_KEY_LENGTH] = "";
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+    
+    // The key ends at the last '|', so the parts must not contain one
+    for (char* p_char = name; *p_char != '\0'; ++p_char)
+    {
+        *p_char = *p_char == '|' ? '/' : *p_char;
+    }
+    for (char* p_char = driver; *p_char != '\0'; ++p_char)
+    {
+        *p_char = *p_char == '|' ? '/' : *p_char;
+    }
+    snprintf(p_key, key_length, "%s|%s|", name, driver);
+}
+
+/* Fills p_profile from the line for device in p_path, if there is one */
+bool load_tuning_profile(const char* const p_path,
+                         const cl_device_id device,
+                         tuning_profile_t* const p_profile)
+{
+    FILE* p_file = fopen(p_path, "r");
+    if (p_file == NULL)
+    {
+        return false;
+    }
+    
+    char key[2*CL_PROFILE_KEY_LENGTH + 2];
+    get_profile_key(device, key, sizeof(key));
+    
+    char line[CL_PROFILE_LINE_LENGTH];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), p_file) != NULL)
+    {
+        if (strncmp(line, key, strlen(key)) != 0)
+        {
+            continue;
+        }
+        
+        char variant[16];
+        found = sscanf(line + strlen(key),
+                       "kernel=%15s local_size=%zu blocks_per_item=%u batch_divisor=%u",
+                       variant,
+                       &p_profile->config.local_size,
+                       &p_profile->config.blocks_per_item,
+                       &p_profile->batch_divisor) == 4 &&
+                p_profile->batch_divisor > 0;
+        p_profile->config.variant = strcmp(variant, "ttable") == 0 ?
+                                    KERNEL_TTABLE :
+                                    KERNEL_SBOX;
+    }
+    fclose(p_file);
+    
+    return found;
+}
+
+/* Replaces the line for device in p_path, or adds one */
+bool save_tuning_profile(const char* const p_path,
+                         const cl_device_id device,
+                         const tuning_profile_t* const p_profile)
+{
+    char key[2*CL_PROFILE_KEY_LENGTH + 2];
+    get_profile_key(device, key, sizeof(key));
+    
+    // Write a new file next to the old one, so a failure leaves it intact
+    char temp_path[CL_PROFILE_LINE_LENGTH];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", p_path);
+    FILE* p_temp = fopen(temp_path, "w");
+    if (p_temp == NULL)
+    {
+        return false;
+    }
+    
+    FILE* p_file = fopen(p_path, "r");
+    if (p_file != NULL)
+    {
+        char line[CL_PROFILE_LINE_LENGTH];
+        while (fgets(line, sizeof(line), p_file) != NULL)
+        {
+            if (strncmp(line, key, strlen(key)) != 0)
+            {
+                fputs(line, p_temp);
+            }
+        }
+        fclose(p_file);
+    }
+    
+    fprintf(p_temp,
+            "%skernel=%s local_size=%zu blocks_per_item=%u batch_divisor=%u\n",
+            key,
+            kernel_variant_names[p_profile->config.variant],
+            p_profile->config.local_size,
+            p_profile->config.blocks_per_item,
+            p_profile->batch_divisor);
+    
+    bool saved = fclose(p_temp) == 0;
+    return saved && rename(temp_path, p_path) == 0;
+}
+
+/*
+ * Times one combination over the whole blocks of p_input, and returns the
+ * fastest of CL_TUNE_RUNS runs in ns, or 0 if it cannot run.
+ */
+uint64_t time_tuning_run(const cl_context context,
+                         const cl_device_id device,
+                         const cl_kernel kernel,
+                         const kernel_config_t* const p_config,
+                         const cl_mem d_key_schedule,
+                         const transfer_t transfer,
+                         const size_t set_count,
+                         const size_t batch_blocks,
+                         const aes_file_t* const p_input,
+                         aes_file_t* const p_output)
+{
+    cl_pipeline_t pipeline;
+    cl_int err = cl_pipeline_create(&pipeline,
+                                    context,
+                                    device,
+                                    kernel,
+                                    p_config,
+                                    d_key_schedule,
+                                    transfer,
+                                    set_count,
+                                    batch_blocks);
+    
+    // The first run is not timed, so that buffers are in place
+    if (err == CL_SUCCESS)
+    {
+        err = cl_pipeline_run(&pipeline, p_input, p_output);
+    }
+    
+    uint64_t best_ns = 0;
+    for (int run = 0; run < CL_TUNE_RUNS && err == CL_SUCCESS; ++run)
+    {
+        phase_timer_t timer;
+        phase_timer_start(&timer, PHASE_ENCRYPT);
+        err = cl_pipeline_run(&pipeline, p_input, p_output);
+        phase_timer_switch(&timer, PHASE_TEARDOWN);
+        
+        uint64_t ns = timer.ns[PHASE_ENCRYPT];
+        best_ns = best_ns == 0 || ns < best_ns ? ns : best_ns;
+    }
+    cl_pipeline_destroy(&pipeline);
+    
+    return err == CL_SUCCESS ? best_ns : 0;
+}
+
+/*
+ * Tries every combination on p_input, printing a line for each, and
+ * leaves the fastest in p_best.  kernels holds one kernel for each
+ * kernel_variant_t.  The output is overwritten.
+ * Returns false if nothing ran.
+ */
+bool tune_pipeline(const cl_context context,
+                   const cl_device_id device,
+                   const cl_kernel* const kernels,
+                   const cl_mem d_key_schedule,
+                   const transfer_t transfer,
+                   const size_t set_count,
+                   const cl_ulong max_alloc_bytes,
+                   const aes_file_t* const p_input,
+                   aes_file_t* const p_output,
+                   tuning_profile_t* const p_best)
+{
+    const size_t local_sizes[] = {0, 16, 32, 64, 128, 256, 512, 1024};
+    const cl_uint blocks_per_items[] = {1, 2, 4, 8, 16};
+    const unsigned batch_divisors[] = {1, 4, 16, 64};
+    
+    uint64_t best_ns = 0;
+    for (int variant = 0; variant < KERNEL_VARIANT_COUNT; ++variant)
+    {
+        // Larger work-groups would fail to launch
+        size_t max_local_size = 0;
+        clGetKernelWorkGroupInfo(kernels[variant],
+                                 device,
+                                 CL_KERNEL_WORK_GROUP_SIZE,
+                                 sizeof(max_local_size),
+                                 &max_local_size,
+                                 NULL);
+        
+        size_t last_batch_blocks = 0;
+        for (size_t d = 0; d < sizeof(batch_divisors)/sizeof(batch_divisors[0]); ++d)
+        {
+            // Small inputs cap the batch, so the same batch may come up
+            // again; it is only timed once
+            size_t batch_blocks = get_batch_blocks(max_alloc_bytes / batch_divisors[d],
+                                                   max_alloc_bytes,
+                                                   transfer,
+                                                   p_input->size_blocks);
+            if (batch_blocks == last_batch_blocks)
+            {
+                continue;
+            }
+            last_batch_blocks = batch_blocks;
+            
+            for (size_t l = 0; l < sizeof(local_sizes)/sizeof(local_sizes[0]); ++l)
+            {
+                if (local_sizes[l] > max_local_size)
+                {
+                    break;
+                }
+                
+                // Only the T-table kernel takes more than one block
+                size_t bpi_count = variant == KERNEL_TTABLE ?
+                                   sizeof(blocks_per_items)/sizeof(blocks_per_items[0]) :
+                                   1;
+                for (size_t b = 0; b < bpi_count; ++b)
+                {
+                    kernel_config_t config = {(kernel_variant_t) variant,
+                                              local_sizes[l],
+                                              blocks_per_items[b]};
+                    uint64_t ns = time_tuning_run(context,
+                                                  device,
+                                                  kernels[variant],
+                                                  &config,
+                                                  d_key_schedule,
+                                                  transfer,
+                                                  set_count,
+                                                  batch_blocks,
+                                                  p_input,
+                                                  p_output);
+                    
+                    printf("tune kernel=%s local_size=%zu blocks_per_item=%u batch_bytes=%zu",
+                           kernel_variant_names[variant],
+                           local_sizes[l],
+                           blocks_per_items[b],
+                           batch_blocks*sizeof(block_vector_t));
+                    if (ns == 0)
+                    {
+                        printf(" gb_per_s=n/a\n");
+                        continue;
+                    }
+                    printf(" gb_per_s=%.3f\n",
+                           (double) (p_input->size_blocks*sizeof(block_vector_t)) / ns);
+                    
+                    if (best_ns == 0 || ns < best_ns)
+                    {
+                        best_ns = ns;
+                        p_best->config = config;
+                        p_best->batch_divisor = batch_divisors[d];
+                    }
+                }
+            }
+        }
+    }
+    
+    return best_ns > 0;
+}
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -12,11 +14,28 @@
 
 #include "aes.h"
 
+/* Selected with -i */
+typedef enum io_engine_t {
+    IO_MMAP,        /* Map both files (open_files()) */
+    IO_STREAM,      /* pread()/pwrite() through buffers (stream_io.h) */
+    IO_URING,       /* io_uring with O_DIRECT (uring_io.h) */
+} io_engine_t;
+
+/* Selected with -M, and combined with | */
+#define MAP_HINT_NONE       0
+#define MAP_HINT_POPULATE   (1u << 0)   /* Fault every page in at mmap() */
+#define MAP_HINT_SEQUENTIAL (1u << 1)   /* MADV_SEQUENTIAL: read far ahead */
+#define MAP_HINT_WILLNEED   (1u << 2)   /* MADV_WILLNEED: start reading now */
+#define MAP_HINT_HUGEPAGE   (1u << 3)   /* MADV_HUGEPAGE, huge page buffers */
+#define MAP_HINT_INVALID    (~0u)
+
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
 void close_files(aes_file_t* p_input, aes_file_t* p_output)
 {
     if (p_input->p_data != NULL && p_input->p_data != MAP_FAILED)
     {
-        munmap(p_input->p_data, p_input->size_blocks*BLOCK_SIZE*WORD_SIZE);
+        munmap(p_input->p_data, p_input->size_bytes);
     }
     
     if (p_input->fd > 0)
@@ -26,7 +45,7 @@ void close_files(aes_file_t* p_input, aes_file_t* p_output)
     
     if (p_output->p_data != NULL && p_output->p_data != MAP_FAILED)
     {
-        munmap(p_output->p_data, p_output->size_blocks*BLOCK_SIZE*WORD_SIZE);
+        munmap(p_output->p_data, p_output->size_bytes);
     }
     
     if (p_output->fd > 0)
@@ -38,25 +57,199 @@ void close_files(aes_file_t* p_input, aes_file_t* p_output)
 void print_usage_and_cleanup(aes_file_t* p_input, aes_file_t* p_output)
 {
     printf("Usage:\n");
-    printf("bench_<IMPLEMENTATION> <INPUT_FILENAME> <OUTPUT_FILENAME> [<THREAD_COUNT>]\n");
+    printf("bench_<IMPLEMENTATION> [<OPTIONS>] <INPUT_FILENAME> <OUTPUT_FILENAME> [<THREAD_COUNT>]\n");
+    printf("bench_<IMPLEMENTATION> [<OPTIONS>] -S <SIZE> [<THREAD_COUNT>]\n");
+    printf("Options:\n");
+    printf("-k <sbox|ttable|vperm|bitslice>  (bench_cpu) Software kernel, default sbox\n");
+    printf("-k <sbox|ttable>                 (bench_cl) Kernel, default sbox; ttable keeps\n");
+    printf("                                     T-tables in local memory\n");
+    printf("-L <SIZE>                        (bench_cl) Work-group size, default the runtime's\n");
+    printf("-W <BLOCKS>                      (bench_cl -k ttable) Blocks per work-item, default 1\n");
+    printf("-t                               (bench_cl) Time every kernel, work-group size,\n");
+    printf("                                     -W and batch size, and save the fastest\n");
+    printf("                                     to bin/cl_profiles.txt for later runs\n");
+    printf("-b <128|192|256>                 Key size in bits, default 128\n");
+    printf("-m <ctr|gcm|cbc|xts>             Cipher mode, default ctr (bench_cpu: ctr|cbc)\n");
+    printf("-d                               Decrypt (ctr and cbc; bench_cpu needs -k ttable)\n");
+    printf("-e                               Count cycles, instructions, cache, dTLB and branch\n");
+    printf("                                     misses per worker (bench_cl: the host\n");
+    printf("                                     thread), and memory bandwidth\n");
+    printf("-s <512|4096>                    XTS sector size in bytes, default 4096\n");
+    printf("-i <mmap|stream|uring>           (Not bench_cl) I/O engine, default mmap\n");
+    printf("                                     (stream and uring: ctr, xts; bench_ni\n");
+    printf("                                     also gcm)\n");
+    printf("-M <populate,sequential,willneed,hugepage|none>\n");
+    printf("                                 Mapping and buffer hints; prints page\n");
+    printf("                                     faults and dTLB misses\n");
+    printf("-p                               (Not bench_cl) Pin threads to cores and print\n");
+    printf("                                     per-node GB/s\n");
+    printf("-n                               (Not bench_cl) Like -p, and fault pages in on\n");
+    printf("                                     each thread's node\n");
+    printf("-S <SIZE>                        Encrypt SIZE bytes of generated data in memory\n");
+    printf("                                     instead of a file (K, M and G suffixes)\n");
+    printf("-A <ALIGN>                       (-S) Start the buffers on a multiple of ALIGN\n");
+    printf("                                     bytes but not of 2*ALIGN, default 64\n");
+    printf("-N <NODE>                        (-S) Put the buffers on NUMA node NODE\n");
+    printf("-r <COUNT>                       Encrypt the input COUNT times (-i mmap)\n");
+    printf("-P <1|2|3>                       (bench_cl) Device buffer sets in flight, default 1\n");
+    printf("                                     (2 or 3 overlap copies with the kernel)\n");
+    printf("-B <SIZE>                        (bench_cl) Batch size, default the largest\n");
+    printf("                                     allocation (16M with -P 2 or 3)\n");
+    printf("-T <auto|copy|zero>              (bench_cl) Copy batches to device buffers, or\n");
+    printf("                                     share the files with the device; auto\n");
+    printf("                                     shares them when its memory is unified\n");
     printf("Notes:\n");
     printf("You must have permissions to read <INPUT_FILENAME>\n");
-    printf("<INPUT_FILENAME> must be an integer multiple of 16 bytes\n");
+    printf("<INPUT_FILENAME> must not be empty\n");
     printf("You must have permissions to write <OUTPUT_FILENAME>\n");
     printf("<OUTPUT_FILENAME> will be overwritten\n");
-    printf("Thread count should allow blocks to divide evenly across threads\n");
-    printf("Also, the number of blocks per thread should allow for cache\n");
-    printf("    line alignment.  On x86_64 with DDR3, this means that each\n");
-    printf("    block should have a multiple of 64 bytes\n");
+    printf("GCM mode prints the authentication tag of the whole file\n");
+    printf("CBC encryption always runs on 1 thread; CBC decryption is split\n");
+    printf("XTS uses 128-bit keys; chunks always hold whole sectors\n");
+    printf("CBC and XTS need a multiple of 16 bytes; CTR and GCM take any length\n");
+    printf("The file is cut into 256 KiB chunks that idle threads steal from\n");
+    printf("    busy ones, so the output does not depend on <THREAD_COUNT>\n");
     printf("\n");
-
+    
     close_files(p_input, p_output);
     exit(-1);
 }
 
+/*
+ * Parses a comma separated list of populate, sequential, willneed and
+ * hugepage (or none) into MAP_HINT_* bits.  Returns MAP_HINT_INVALID if
+ * a name is not known.
+ */
+unsigned parse_map_hints(const char* const p_arg)
+{
+    unsigned hints = MAP_HINT_NONE;
+    char list[64];
+    snprintf(list, sizeof(list), "%s", p_arg);
+    
+    for (char* p_name = strtok(list, ","); p_name != NULL;
+         p_name = strtok(NULL, ","))
+    {
+        if (strcmp(p_name, "populate") == 0)
+        {
+            hints |= MAP_HINT_POPULATE;
+        }
+        else if (strcmp(p_name, "sequential") == 0)
+        {
+            hints |= MAP_HINT_SEQUENTIAL;
+        }
+        else if (strcmp(p_name, "willneed") == 0)
+        {
+            hints |= MAP_HINT_WILLNEED;
+        }
+        else if (strcmp(p_name, "hugepage") == 0)
+        {
+            hints |= MAP_HINT_HUGEPAGE;
+        }
+        else if (strcmp(p_name, "none") != 0)
+        {
+            printf("Unknown mapping hint: %s\n", p_name);
+            return MAP_HINT_INVALID;
+        }
+    }
+    
+    return hints;
+}
+
+/*
+ * Passes the madvise() hints on to a mapping.  A refused hint only costs
+ * performance, so it is reported and otherwise ignored.
+ */
+void advise_mapping(void* const p_data, const size_t bytes, const unsigned hints)
+{
+    // Each advice is a separate value, not a flag, so each needs a call
+    const int advice[] = {MADV_SEQUENTIAL, MADV_WILLNEED, MADV_HUGEPAGE};
+    const unsigned hint[] = {MAP_HINT_SEQUENTIAL,
+                             MAP_HINT_WILLNEED,
+                             MAP_HINT_HUGEPAGE};
+    
+    for (size_t i = 0; i < sizeof(advice)/sizeof(advice[0]); ++i)
+    {
+        if ((hints & hint[i]) && madvise(p_data, bytes, advice[i]) != 0)
+        {
+            perror("Error in madvise()");
+        }
+    }
+}
+
+/*
+ * Allocates a page aligned staging buffer for the buffered I/O engines.
+ * With MAP_HINT_HUGEPAGE it comes from the reserved huge pages if there
+ * are any, and is otherwise marked for transparent huge pages.
+ * Returns NULL on failure.  Free it with free_staging_buffer().
+ */
+void* alloc_staging_buffer(const size_t bytes, const unsigned hints)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (hints & MAP_HINT_POPULATE)
+    {
+        flags |= MAP_POPULATE;
+    }
+    
+    void* p_data = MAP_FAILED;
+    if ((hints & MAP_HINT_HUGEPAGE) && bytes % HUGE_PAGE_SIZE == 0)
+    {
+        p_data = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                      flags | MAP_HUGETLB, -1, 0);
+    }
+    if (p_data == MAP_FAILED)
+    {
+        p_data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p_data == MAP_FAILED)
+        {
+            return NULL;
+        }
+        advise_mapping(p_data, bytes, hints & MAP_HINT_HUGEPAGE);
+    }
+    
+    return p_data;
+}
+
+void free_staging_buffer(void* const p_data, const size_t bytes)
+{
+    if (p_data != NULL)
+    {
+        munmap(p_data, bytes);
+    }
+}
+
+/* Prints an authentication tag as hex, in the order the bytes are sent */
+void print_tag(const block_vector_t* const p_tag)
+{
+    printf("Tag: ");
+    for (uint8_t i = 0; i < sizeof(p_tag->x); ++i)
+    {
+        printf("%02x", p_tag->x[i]);
+    }
+    printf("\n");
+}
+
+/* Returns the key size in bits, or 0 if it is not an AES key size */
+uint16_t parse_key_bits(const char* const p_arg)
+{
+    long key_bits = strtol(p_arg, NULL, 10);
+    if (key_bits != 128 && key_bits != 192 && key_bits != 256)
+    {
+        printf("Key size must be 128, 192 or 256 bits\n");
+        return 0;
+    }
+    return (uint16_t) key_bits;
+}
+
+/*
+ * Maps both files.  map_hints (MAP_HINT_*) asks for the pages to be
+ * faulted in up front, read ahead, or backed by huge pages.
+ */
 void open_files(char* in_filename, char* out_filename,
-                aes_file_t* p_infile, aes_file_t* p_outfile)
+                aes_file_t* p_infile, aes_file_t* p_outfile,
+                const unsigned map_hints)
 {
+    int populate = map_hints & MAP_HINT_POPULATE ? MAP_POPULATE : 0;
+    
     // Open the input file and memory map it
     // A lot of checks are made in this process
     int fd = open(in_filename, O_RDONLY);
@@ -74,22 +267,23 @@ void open_files(char* in_filename, char* out_filename,
         perror("Error in stat() on input file");
         print_usage_and_cleanup(p_infile, p_outfile);
     }
-    else if (file_stats.st_size % BLOCK_SIZE*WORD_SIZE != 0 ||
-             file_stats.st_size == 0)
+    else if (file_stats.st_size == 0)
     {
-        printf("Input file size is not a multiple of 16 bytes\n");
+        printf("Input file is empty\n");
         print_usage_and_cleanup(p_infile, p_outfile);
     }
     p_infile->size_blocks = file_stats.st_size / (WORD_SIZE*BLOCK_SIZE);
+    p_infile->size_bytes = file_stats.st_size;
     
     void* p_data = mmap(NULL, file_stats.st_size, PROT_READ,
-                        MAP_PRIVATE, fd, 0);
+                        MAP_PRIVATE | populate, fd, 0);
     if (p_data == NULL || p_data == MAP_FAILED)
     {
         perror("Error in mmap() on input file");
         print_usage_and_cleanup(p_infile, p_outfile);
     }
     p_infile->p_data = (block_vector_t*) p_data;
+    advise_mapping(p_data, file_stats.st_size, map_hints);
     
     // Open and memory map the output file
     fd = open(out_filename, O_CREAT | O_TRUNC | O_RDWR,
@@ -109,9 +303,10 @@ void open_files(char* in_filename, char* out_filename,
         print_usage_and_cleanup(p_infile, p_outfile);
     }
     p_outfile->size_blocks = p_infile->size_blocks;
+    p_outfile->size_bytes = p_infile->size_bytes;
     
     p_data = mmap(NULL, file_stats.st_size, PROT_READ | PROT_WRITE,
-                        MAP_SHARED, fd, 0);
+                        MAP_SHARED | populate, fd, 0);
     if (p_data == NULL || p_data == MAP_FAILED)
     {
         perror("Error in mmap() on output file");
@@ -119,6 +314,7 @@ void open_files(char* in_filename, char* out_filename,
     }
     
     p_outfile->p_data = (block_vector_t*) p_data;
+    advise_mapping(p_data, file_stats.st_size, map_hints);
 }
 
 
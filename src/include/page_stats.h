@@ -0,0 +1,112 @@
+#ifndef PAGESTATS_H
+#define PAGESTATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ *  Page fault and TLB miss counts over part of a run, to compare the
+ *  -M mapping hints.  Faults come from getrusage(), which counts every
+ *  thread of the process.  dTLB misses come from perf_event_open() with
+ *  inherit set, so threads created after page_stats_start() (the pool
+ *  workers) are counted too.  Hosts without a PMU (most VMs) only get the
+ *  fault counts.
+ */
+
+typedef enum tlb_counter_t {
+    TLB_LOAD_MISSES,
+    TLB_STORE_MISSES,
+    TLB_COUNTERS
+} tlb_counter_t;
+
+typedef struct page_stats_t {
+    struct rusage start;
+    long minor_faults;
+    long major_faults;
+    int tlb_fds[TLB_COUNTERS];      /* -1 if the counter is not available */
+    uint64_t tlb_misses[TLB_COUNTERS];
+    bool tlb_available;
+} page_stats_t;
+
+/* Opens a user-space dTLB miss counter for op, or returns -1 */
+int open_tlb_counter(const uint64_t op)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (op << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void page_stats_start(page_stats_t* const p_stats)
+{
+    memset(p_stats, 0, sizeof(*p_stats));
+    p_stats->tlb_fds[TLB_LOAD_MISSES] =
+        open_tlb_counter(PERF_COUNT_HW_CACHE_OP_READ);
+    p_stats->tlb_fds[TLB_STORE_MISSES] =
+        open_tlb_counter(PERF_COUNT_HW_CACHE_OP_WRITE);
+    p_stats->tlb_available = p_stats->tlb_fds[TLB_LOAD_MISSES] >= 0 &&
+                             p_stats->tlb_fds[TLB_STORE_MISSES] >= 0;
+    
+    getrusage(RUSAGE_SELF, &(p_stats->start));
+}
+
+void page_stats_stop(page_stats_t* const p_stats)
+{
+    struct rusage end;
+    getrusage(RUSAGE_SELF, &end);
+    p_stats->minor_faults = end.ru_minflt - p_stats->start.ru_minflt;
+    p_stats->major_faults = end.ru_majflt - p_stats->start.ru_majflt;
+    
+    for (int i = 0; i < TLB_COUNTERS; ++i)
+    {
+        if (p_stats->tlb_fds[i] < 0)
+        {
+            continue;
+        }
+        
+        // The count includes the inherited counters of live threads
+        if (read(p_stats->tlb_fds[i],
+                 &(p_stats->tlb_misses[i]),
+                 sizeof(uint64_t)) != sizeof(uint64_t))
+        {
+            p_stats->tlb_misses[i] = 0;
+        }
+        close(p_stats->tlb_fds[i]);
+        p_stats->tlb_fds[i] = -1;
+    }
+}
+
+void print_page_stats(const page_stats_t* const p_stats)
+{
+    printf("Page faults: %ld minor, %ld major\n",
+           p_stats->minor_faults,
+           p_stats->major_faults);
+    
+    if (p_stats->tlb_available)
+    {
+        printf("dTLB misses: %lu loads, %lu stores\n",
+               p_stats->tlb_misses[TLB_LOAD_MISSES],
+               p_stats->tlb_misses[TLB_STORE_MISSES]);
+    }
+    else
+    {
+        printf("dTLB misses: not available on this host\n");
+    }
+}
+
+#endif
@@ -0,0 +1,545 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+/**
+ *  Hardware event counts for the encryption phase, from perf_event_open().
+ *  Every pool worker gets its own counters, opened on its thread ID, in
+ *  two groups (bench_cl has no pool, so it counts its own thread, which
+ *  drives the device and encrypts the tail):
+ *      core:   cycles, instructions, branch misses
+ *      cache:  L1D read misses, LLC read misses, dTLB read misses
+ *  The members of a group are scheduled on the PMU together, so ratios
+ *  such as IPC within a group are exact.  When there are more events
+ *  than hardware counters, the kernel multiplexes the groups and the
+ *  counts are scaled by enabled/running time.
+ *
+ *  Memory bandwidth comes from the uncore memory controller PMUs
+ *  (uncore_imc*) where the kernel exposes them.  These count for the
+ *  whole socket, not per thread, and need perf_event_paranoid <= 0 or
+ *  CAP_PERFMON.
+ *
+ *  Any event that cannot be opened (no PMU in a VM, an older kernel) is
+ *  reported as n/a, and the benchmark runs as usual.
+ */
+
+#define COUNTER_MAX_UNCORE 64
+#define UNCORE_DEVICES "/sys/bus/event_source/devices"
+
+typedef enum counter_event_t {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTER_LLC_MISSES,
+    COUNTER_DTLB_MISSES,
+    COUNTER_EVENTS
+} counter_event_t;
+
+typedef enum counter_group_t {
+    COUNTER_GROUP_CORE,
+    COUNTER_GROUP_CACHE,
+    COUNTER_GROUPS
+} counter_group_t;
+
+#define HW_CACHE_READ_MISS(cache) ((cache) |                                \
+                                   (PERF_COUNT_HW_CACHE_OP_READ << 8) |     \
+                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+typedef struct counter_spec_t {
+    const char* p_name;
+    uint32_t type;
+    uint64_t config;
+    counter_group_t group;
+} counter_spec_t;
+
+/* In counter_event_t order; each group's events are together */
+const counter_spec_t counter_specs[COUNTER_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, COUNTER_GROUP_CORE},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, COUNTER_GROUP_CORE},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, COUNTER_GROUP_CORE},
+    {"l1d_misses", PERF_TYPE_HW_CACHE,
+     HW_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D), COUNTER_GROUP_CACHE},
+    {"llc_misses", PERF_TYPE_HW_CACHE,
+     HW_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL), COUNTER_GROUP_CACHE},
+    {"dtlb_misses", PERF_TYPE_HW_CACHE,
+     HW_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB), COUNTER_GROUP_CACHE},
+};
+
+typedef struct worker_counters_t {
+    int fds[COUNTER_EVENTS];            /* -1 if the event did not open */
+    int leaders[COUNTER_GROUPS];        /* -1 if no event of the group did */
+    uint64_t values[COUNTER_EVENTS];
+    bool counted[COUNTER_EVENTS];       /* False if never scheduled */
+} worker_counters_t;
+
+typedef struct uncore_counter_t {
+    int fd;
+    double bytes_per_count;
+    bool write;                         /* Else a read counter */
+} uncore_counter_t;
+
+typedef struct perf_counters_t {
+    thread_pool_t* p_pool;              /* NULL when counting this thread */
+    long worker_count;
+    uint64_t bytes;                     /* Set by the caller without a pool */
+    worker_counters_t* p_workers;
+    uncore_counter_t uncore[COUNTER_MAX_UNCORE];
+    size_t uncore_count;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    struct timespec start_time;
+    uint64_t ns;
+} perf_counters_t;
+
+int perf_event_open(struct perf_event_attr* const p_attr,
+                    const pid_t pid,
+                    const int cpu,
+                    const int group_fd)
+{
+    return (int) syscall(__NR_perf_event_open, p_attr, pid, cpu, group_fd, 0);
+}
+
+/* Reads the first line of a sysfs file, without its newline */
+bool read_sysfs_line(const char* const p_path, char* const p_line, const int size)
+{
+    FILE* p_file = fopen(p_path, "r");
+    if (p_file == NULL)
+    {
+        return false;
+    }
+    bool ok = fgets(p_line, size, p_file) != NULL;
+    fclose(p_file);
+    
+    if (ok)
+    {
+        p_line[strcspn(p_line, "\n")] = '\0';
+    }
+    return ok;
+}
+
+/*
+ * Opens one group of events on thread tid.  The first event that opens
+ * leads the group; it starts disabled and the rest follow it.
+ */
+void open_counter_group(worker_counters_t* const p_counters,
+                        const pid_t tid,
+                        const counter_group_t group)
+{
+    p_counters->leaders[group] = -1;
+    for (int i = 0; i < COUNTER_EVENTS; ++i)
+    {
+        if (counter_specs[i].group != group)
+        {
+            continue;
+        }
+        
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_specs[i].type;
+        attr.config = counter_specs[i].config;
+        attr.disabled = p_counters->leaders[group] < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        
+        p_counters->fds[i] = perf_event_open(&attr,
+                                             tid,
+                                             -1,
+                                             p_counters->leaders[group]);
+        if (p_counters->fds[i] >= 0 && p_counters->leaders[group] < 0)
+        {
+            p_counters->leaders[group] = p_counters->fds[i];
+        }
+    }
+}
+
+/*
+ * Turns the event string of an uncore PMU (such as "event=0x04,umask=0x03")
+ * into a config value, using the PMU's format files to place each term.
+ * Returns false if the event does not exist or uses anything but config.
+ */
+bool uncore_event_config(const char* const p_pmu,
+                         const char* const p_event,
+                         uint64_t* const p_config)
+{
+    char path[256];
+    char terms[256];
+    snprintf(path, sizeof(path), UNCORE_DEVICES "/%s/events/%s", p_pmu, p_event);
+    if (!read_sysfs_line(path, terms, sizeof(terms)))
+    {
+        return false;
+    }
+    
+    *p_config = 0;
+    for (char* p_term = strtok(terms, ","); p_term != NULL;
+         p_term = strtok(NULL, ","))
+    {
+        // A term without a value is a flag set to 1
+        uint64_t value = 1;
+        char* p_value = strchr(p_term, '=');
+        if (p_value != NULL)
+        {
+            *p_value = '\0';
+            value = strtoull(p_value + 1, NULL, 0);
+        }
+        
+        // Formats look like "config:0-7" or "config:21"
+        char format[64];
+        snprintf(path, sizeof(path), UNCORE_DEVICES "/%s/format/%s", p_pmu, p_term);
+        int low_bit;
+        if (!read_sysfs_line(path, format, sizeof(format)) ||
+            sscanf(format, "config:%d", &low_bit) != 1)
+        {
+            return false;
+        }
+        *p_config |= value << low_bit;
+    }
+    
+    return true;
+}
+
+/* Opens a socket-wide counter for p_event on every CPU in the PMU's cpumask */
+void open_uncore_counter(perf_counters_t* const p_counters,
+                         const char* const p_pmu,
+                         const char* const p_event,
+                         const bool write)
+{
+    char path[256];
+    char line[256];
+    uint64_t config;
+    snprintf(path, sizeof(path), UNCORE_DEVICES "/%s/type", p_pmu);
+    if (!read_sysfs_line(path, line, sizeof(line)) ||
+        !uncore_event_config(p_pmu, p_event, &config))
+    {
+        return;
+    }
+    uint32_t type = (uint32_t) strtoul(line, NULL, 10);
+    
+    // Counts are scaled to the unit, which is MiB for the Intel IMCs
+    double bytes_per_count = 1.0;
+    snprintf(path, sizeof(path), UNCORE_DEVICES "/%s/events/%s.scale", p_pmu, p_event);
+    if (read_sysfs_line(path, line, sizeof(line)))
+    {
+        bytes_per_count = strtod(line, NULL);
+    }
+    snprintf(path, sizeof(path), UNCORE_DEVICES "/%s/events/%s.unit", p_pmu, p_event);
+    if (read_sysfs_line(path, line, sizeof(line)) && strcmp(line, "MiB") == 0)
+    {
+        bytes_per_count *= 1024*1024;
+    }
+    
+    // One CPU per socket, as a list such as "0,18"
+    snprintf(path, sizeof(path), UNCORE_DEVICES "/%s/cpumask", p_pmu);
+    if (!read_sysfs_line(path, line, sizeof(line)))
+    {
+        return;
+    }
+    for (char* p_cpu = strtok(line, ","); p_cpu != NULL;
+         p_cpu = strtok(NULL, ","))
+    {
+        if (p_counters->uncore_count == COUNTER_MAX_UNCORE)
+        {
+            return;
+        }
+        
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        
+        int fd = perf_event_open(&attr, -1, atoi(p_cpu), -1);
+        if (fd >= 0)
+        {
+            uncore_counter_t* p_uncore =
+                &(p_counters->uncore[p_counters->uncore_count]);
+            p_uncore->fd = fd;
+            p_uncore->bytes_per_count = bytes_per_count;
+            p_uncore->write = write;
+            p_counters->uncore_count += 1;
+        }
+    }
+}
+
+/*
+ * Opens counters for every worker of p_pool, or for the calling thread if
+ * p_pool is NULL, and for the memory controllers.  Returns false only if
+ * memory could not be allocated; events that do not open are left out.
+ */
+bool perf_counters_open(perf_counters_t* const p_counters,
+                        thread_pool_t* const p_pool)
+{
+    memset(p_counters, 0, sizeof(*p_counters));
+    p_counters->p_pool = p_pool;
+    p_counters->worker_count = p_pool != NULL ? p_pool->thread_count : 1;
+    p_counters->p_workers = calloc(p_counters->worker_count,
+                                   sizeof(worker_counters_t));
+    if (p_counters->p_workers == NULL)
+    {
+        return false;
+    }
+    
+    // A tid of 0 is the calling thread
+    for (long i = 0; i < p_counters->worker_count; ++i)
+    {
+        pid_t tid = p_pool != NULL ? p_pool->p_workers[i].tid : 0;
+        for (int group = 0; group < COUNTER_GROUPS; ++group)
+        {
+            open_counter_group(&(p_counters->p_workers[i]), tid, group);
+        }
+    }
+    
+    DIR* p_dir = opendir(UNCORE_DEVICES);
+    if (p_dir != NULL)
+    {
+        struct dirent* p_entry;
+        while ((p_entry = readdir(p_dir)) != NULL)
+        {
+            if (strncmp(p_entry->d_name, "uncore_imc", 10) == 0)
+            {
+                open_uncore_counter(p_counters, p_entry->d_name,
+                                    "cas_count_read", false);
+                open_uncore_counter(p_counters, p_entry->d_name,
+                                    "cas_count_write", true);
+            }
+        }
+        closedir(p_dir);
+    }
+    
+    return true;
+}
+
+/* Zeroes and starts every counter */
+void perf_counters_start(perf_counters_t* const p_counters)
+{
+    for (long i = 0; i < p_counters->worker_count; ++i)
+    {
+        for (int group = 0; group < COUNTER_GROUPS; ++group)
+        {
+            int leader = p_counters->p_workers[i].leaders[group];
+            if (leader >= 0)
+            {
+                ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+                ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            }
+        }
+    }
+    for (size_t i = 0; i < p_counters->uncore_count; ++i)
+    {
+        ioctl(p_counters->uncore[i].fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(p_counters->uncore[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC_RAW, &(p_counters->start_time));
+}
+
+/*
+ * Reads a group into the worker's values.  The kernel returns the
+ * members in the order they joined, which is counter_event_t order.
+ */
+void read_counter_group(worker_counters_t* const p_counters,
+                        const counter_group_t group)
+{
+    // nr, time enabled, time running, then one value per member
+    uint64_t data[3 + COUNTER_EVENTS];
+    int leader = p_counters->leaders[group];
+    if (leader < 0 || read(leader, data, sizeof(data)) < 3*(ssize_t) sizeof(uint64_t))
+    {
+        return;
+    }
+    uint64_t enabled = data[1];
+    uint64_t running = data[2];
+    
+    size_t member = 0;
+    for (int i = 0; i < COUNTER_EVENTS; ++i)
+    {
+        if (counter_specs[i].group != group || p_counters->fds[i] < 0)
+        {
+            continue;
+        }
+        
+        // Scale up for the time the group was multiplexed out
+        uint64_t value = data[3 + member];
+        member += 1;
+        p_counters->counted[i] = running > 0;
+        p_counters->values[i] = running == 0 || running == enabled ?
+                                value :
+                                (uint64_t) ((double) value*enabled/running);
+    }
+}
+
+/* Stops and reads every counter, then closes them */
+void perf_counters_stop(perf_counters_t* const p_counters)
+{
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+    p_counters->ns = (end_time.tv_sec - p_counters->start_time.tv_sec)*1000000000ull +
+                     end_time.tv_nsec - p_counters->start_time.tv_nsec;
+    
+    for (long i = 0; i < p_counters->worker_count; ++i)
+    {
+        worker_counters_t* p_worker = &(p_counters->p_workers[i]);
+        for (int group = 0; group < COUNTER_GROUPS; ++group)
+        {
+            if (p_worker->leaders[group] >= 0)
+            {
+                ioctl(p_worker->leaders[group],
+                      PERF_EVENT_IOC_DISABLE,
+                      PERF_IOC_FLAG_GROUP);
+                read_counter_group(p_worker, group);
+            }
+        }
+        for (int e = 0; e < COUNTER_EVENTS; ++e)
+        {
+            if (p_worker->fds[e] >= 0)
+            {
+                close(p_worker->fds[e]);
+                p_worker->fds[e] = -1;
+            }
+        }
+    }
+    
+    for (size_t i = 0; i < p_counters->uncore_count; ++i)
+    {
+        uncore_counter_t* p_uncore = &(p_counters->uncore[i]);
+        uint64_t count = 0;
+        ioctl(p_uncore->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(p_uncore->fd, &count, sizeof(count)) == sizeof(count))
+        {
+            uint64_t bytes = (uint64_t) (count*p_uncore->bytes_per_count);
+            if (p_uncore->write)
+            {
+                p_counters->write_bytes += bytes;
+            }
+            else
+            {
+                p_counters->read_bytes += bytes;
+            }
+        }
+        close(p_uncore->fd);
+    }
+}
+
+/* Prints a count, or n/a if the event was never counted */
+void print_count(const char* const p_name, const bool counted, const uint64_t value)
+{
+    if (counted)
+    {
+        printf(" %s=%lu", p_name, value);
+    }
+    else
+    {
+        printf(" %s=n/a", p_name);
+    }
+}
+
+/* Prints the counts of one worker, or of all of them if worker is -1 */
+void print_worker_counters(const perf_counters_t* const p_counters, const long worker)
+{
+    long first = worker < 0 ? 0 : worker;
+    long last = worker < 0 ? p_counters->worker_count - 1 : worker;
+    
+    uint64_t values[COUNTER_EVENTS] = {0};
+    bool counted[COUNTER_EVENTS] = {false};
+    uint64_t bytes = 0;
+    for (long i = first; i <= last; ++i)
+    {
+        bytes += p_counters->p_pool != NULL ?
+                 p_counters->p_pool->p_workers[i].bytes :
+                 p_counters->bytes;
+        for (int e = 0; e < COUNTER_EVENTS; ++e)
+        {
+            values[e] += p_counters->p_workers[i].values[e];
+            counted[e] = counted[e] || p_counters->p_workers[i].counted[e];
+        }
+    }
+    
+    if (worker < 0)
+    {
+        printf("counters=all bytes=%lu", bytes);
+    }
+    else
+    {
+        printf("counters=%ld bytes=%lu", worker, bytes);
+    }
+    for (int e = 0; e < COUNTER_EVENTS; ++e)
+    {
+        print_count(counter_specs[e].p_name, counted[e], values[e]);
+    }
+    
+    bool have_ipc = counted[COUNTER_CYCLES] && counted[COUNTER_INSTRUCTIONS] &&
+                    values[COUNTER_CYCLES] > 0;
+    bool have_cpb = counted[COUNTER_CYCLES] && bytes > 0;
+    if (have_ipc)
+    {
+        printf(" ipc=%.3f",
+               (double) values[COUNTER_INSTRUCTIONS]/values[COUNTER_CYCLES]);
+    }
+    else
+    {
+        printf(" ipc=n/a");
+    }
+    if (have_cpb)
+    {
+        printf(" cycles_per_byte=%.3f", (double) values[COUNTER_CYCLES]/bytes);
+    }
+    else
+    {
+        printf(" cycles_per_byte=n/a");
+    }
+    printf("\n");
+}
+
+/*
+ * Prints a key=value line per worker, one for all workers together, and
+ * one for memory bandwidth.  Worker bytes are those of every run so far.
+ */
+void print_perf_counters(const perf_counters_t* const p_counters)
+{
+    for (long i = 0; i < p_counters->worker_count; ++i)
+    {
+        print_worker_counters(p_counters, i);
+    }
+    print_worker_counters(p_counters, -1);
+    
+    if (p_counters->uncore_count > 0 && p_counters->ns > 0)
+    {
+        // Bytes per nanosecond is GB/s
+        printf("counters=memory read_bytes=%lu write_bytes=%lu gb_per_s=%.3f\n",
+               p_counters->read_bytes,
+               p_counters->write_bytes,
+               (double) (p_counters->read_bytes + p_counters->write_bytes)/
+                   p_counters->ns);
+    }
+    else
+    {
+        printf("counters=memory read_bytes=n/a write_bytes=n/a gb_per_s=n/a\n");
+    }
+}
+
+void perf_counters_free(perf_counters_t* const p_counters)
+{
+    free(p_counters->p_workers);
+    p_counters->p_workers = NULL;
+}
+
+#endif
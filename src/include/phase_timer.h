@@ -0,0 +1,123 @@
+#ifndef PHASETIMER_H
+#define PHASETIMER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <x86intrin.h>
+
+/**
+ *  Times the phases of a bench run from inside the process, so that
+ *  process and OpenCL startup no longer hide the encryption time of small
+ *  inputs.  Each phase records nanoseconds from CLOCK_MONOTONIC_RAW, which
+ *  NTP does not slew, and cycles from the time stamp counter.  The TSC
+ *  ticks at a fixed rate, so its cycles are reference cycles, not core
+ *  cycles under turbo.
+ *
+ *  A run moves from phase to phase with phase_timer_switch().  A phase
+ *  can be entered more than once, and its times add up.  With the
+ *  buffered I/O engines, reading and writing overlap with encryption, so
+ *  they are part of PHASE_ENCRYPT.
+ */
+
+typedef enum phase_t {
+    PHASE_SETUP,            /* Options, devices, thread pool */
+    PHASE_KEY_EXPANSION,
+    PHASE_IO_MAP,           /* Opening and mapping the files */
+    PHASE_ENCRYPT,
+    PHASE_TEARDOWN,         /* Stopping threads, unmapping the files */
+    PHASE_COUNT
+} phase_t;
+
+typedef struct phase_timer_t {
+    phase_t current;
+    struct timespec start_time;
+    uint64_t start_cycles;
+    uint64_t ns[PHASE_COUNT];
+    uint64_t cycles[PHASE_COUNT];
+} phase_timer_t;
+
+const char* const phase_names[PHASE_COUNT] = {"setup",
+                                              "key_expansion",
+                                              "io_map",
+                                              "encrypt",
+                                              "teardown"};
+
+/* Reads the TSC once earlier instructions are done */
+uint64_t read_cycles()
+{
+    _mm_lfence();
+    return __rdtsc();
+}
+
+/* Starts timing phase */
+void phase_timer_start(phase_timer_t* const p_timer, const phase_t phase)
+{
+    memset(p_timer, 0, sizeof(*p_timer));
+    p_timer->current = phase;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &(p_timer->start_time));
+    p_timer->start_cycles = read_cycles();
+}
+
+/* Adds the time since the last switch to the current phase, then moves on */
+void phase_timer_switch(phase_timer_t* const p_timer, const phase_t phase)
+{
+    uint64_t cycles = read_cycles();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    
+    p_timer->ns[p_timer->current] +=
+        (now.tv_sec - p_timer->start_time.tv_sec)*1000000000ull +
+        now.tv_nsec - p_timer->start_time.tv_nsec;
+    p_timer->cycles[p_timer->current] += cycles - p_timer->start_cycles;
+    
+    p_timer->current = phase;
+    p_timer->start_time = now;
+    p_timer->start_cycles = cycles;
+}
+
+/* Ends the current phase */
+void phase_timer_stop(phase_timer_t* const p_timer)
+{
+    phase_timer_switch(p_timer, p_timer->current);
+}
+
+/*
+ * Prints one line per phase, and a total, as key=value pairs:
+ *     phase=encrypt ns=... cycles=... bytes=... gb_per_s=... cycles_per_byte=...
+ * Rates are over the bytes of the whole input, so the phases can be
+ * compared with each other.
+ */
+void print_phase_times(const phase_timer_t* const p_timer, const size_t bytes)
+{
+    uint64_t total_ns = 0;
+    uint64_t total_cycles = 0;
+    for (int i = 0; i <= PHASE_COUNT; ++i)
+    {
+        const char* p_name = "total";
+        uint64_t ns = total_ns;
+        uint64_t cycles = total_cycles;
+        if (i < PHASE_COUNT)
+        {
+            p_name = phase_names[i];
+            ns = p_timer->ns[i];
+            cycles = p_timer->cycles[i];
+            total_ns += ns;
+            total_cycles += cycles;
+        }
+        
+        // Bytes per nanosecond is GB/s
+        printf("phase=%s ns=%lu cycles=%lu bytes=%zu "
+               "gb_per_s=%.6f cycles_per_byte=%.6f\n",
+               p_name,
+               ns,
+               cycles,
+               bytes,
+               ns > 0 ? (double) bytes/ns : 0.0,
+               bytes > 0 ? (double) cycles/bytes : 0.0);
+    }
+}
+
+#endif
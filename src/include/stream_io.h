@@ -0,0 +1,362 @@
+#ifndef STREAMIO_H
+#define STREAMIO_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aes.h"
+#include "file_utils.h"
+#include "thread_pool.h"
+
+/**
+ *  Streaming I/O, for files larger than memory.  Instead of mapping the
+ *  whole file, a fixed ring of buffers moves through three stages:
+ *      reader thread:  pread() the next part of the input into a buffer
+ *      thread pool:    encrypt the buffer in place, chunk by chunk
+ *      writer thread:  pwrite() the buffer to the output
+ *  With STREAM_BUFFERS buffers, reading the next buffer and writing the
+ *  previous one overlap with encrypting the current one, and the memory
+ *  used is STREAM_BUFFERS*STREAM_BUFFER_BYTES whatever the file size.
+ *
+ *  Tasks see one buffer as their input and output file, so they carry the
+ *  block number of the buffer's start in thread_args_t.base.  Modes that
+ *  read other blocks than their own (CBC) cannot run in place like this.
+ */
+
+#define STREAM_BUFFERS      3
+#define STREAM_BUFFER_BYTES (64*POOL_CHUNK_BLOCKS*sizeof(block_vector_t))
+
+/* Called with each buffer's tasks, in file order, after they are done */
+typedef void (*buffer_hook_t)(const thread_args_t* p_tasks, size_t task_count);
+
+/* How to encrypt a buffer; the same for every buffered I/O engine */
+typedef struct buffer_job_t {
+    thread_pool_t* p_pool;
+    task_function_t function;
+    key_schedule_t* p_key_sched;
+    uint64_t nonce;
+    size_t chunk_blocks;
+    buffer_hook_t p_hook;       /* May be NULL */
+    unsigned map_hints;         /* MAP_HINT_* for the staging buffers */
+} buffer_job_t;
+
+typedef enum buffer_state_t {
+    BUFFER_FREE,        /* Waiting for the reader */
+    BUFFER_READ,        /* Waiting to be encrypted */
+    BUFFER_ENCRYPTED,   /* Waiting for the writer */
+} buffer_state_t;
+
+typedef struct stream_buffer_t {
+    block_vector_t* p_data;
+    uint64_t file_offset;   /* In bytes */
+    size_t bytes;           /* 0 marks the end of the file */
+    buffer_state_t state;
+} stream_buffer_t;
+
+typedef struct stream_t {
+    aes_file_t* p_input;
+    aes_file_t* p_output;
+    stream_buffer_t buffers[STREAM_BUFFERS];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     /* Broadcast whenever a buffer changes state */
+    bool failed;
+} stream_t;
+
+/*
+ * Like open_files(), but only opens the files and records the input size.
+ * Nothing is mapped, so p_data stays NULL.
+ */
+void open_files_streaming(char* in_filename, char* out_filename,
+                          aes_file_t* p_infile, aes_file_t* p_outfile)
+{
+    int fd = open(in_filename, O_RDONLY);
+    if (fd <= 0)
+    {
+        perror("Error in open() on input file");
+        print_usage_and_cleanup(p_infile, p_outfile);
+    }
+    p_infile->fd = fd;
+    
+    struct stat file_stats;
+    int success = fstat(fd, &file_stats);
+    if (success != 0)
+    {
+        perror("Error in stat() on input file");
+        print_usage_and_cleanup(p_infile, p_outfile);
+    }
+    else if (file_stats.st_size == 0)
+    {
+        printf("Input file is empty\n");
+        print_usage_and_cleanup(p_infile, p_outfile);
+    }
+    p_infile->size_blocks = file_stats.st_size / (WORD_SIZE*BLOCK_SIZE);
+    p_infile->size_bytes = file_stats.st_size;
+    
+    fd = open(out_filename, O_CREAT | O_TRUNC | O_WRONLY,
+              S_IRUSR | S_IWUSR);
+    if (fd <= 0)
+    {
+        perror("Error in open() on output file");
+        print_usage_and_cleanup(p_infile, p_outfile);
+    }
+    p_outfile->fd = fd;
+    p_outfile->size_blocks = p_infile->size_blocks;
+    p_outfile->size_bytes = p_infile->size_bytes;
+}
+
+/*
+ * Encrypts bytes of the file, starting at byte file_offset, which have
+ * been read into p_data.  The buffer stands in for both files.  Only the
+ * last buffer of a file can end in a partial block.  Returns false if the
+ * tasks could not be allocated.
+ */
+bool encrypt_buffer(const buffer_job_t* const p_job,
+                    block_vector_t* const p_data,
+                    const uint64_t file_offset,
+                    const size_t bytes)
+{
+    aes_file_t window;
+    window.p_data = p_data;
+    window.size_blocks = bytes / sizeof(block_vector_t);
+    window.size_bytes = bytes;
+    window.fd = -1;
+    
+    thread_args_t* p_tasks;
+    size_t task_count = split_into_chunks(&window,
+                                          &window,
+                                          p_job->p_key_sched,
+                                          p_job->nonce,
+                                          p_job->chunk_blocks,
+                                          &p_tasks);
+    if (p_tasks == NULL)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < task_count; ++i)
+    {
+        p_tasks[i].base = file_offset / sizeof(block_vector_t);
+    }
+    
+    thread_pool_run(p_job->p_pool, p_job->function, p_tasks, task_count);
+    if (p_job->p_hook != NULL)
+    {
+        p_job->p_hook(p_tasks, task_count);
+    }
+    free(p_tasks);
+    
+    return true;
+}
+
+/* Waits until buffer index is in the given state; false if a stage failed */
+bool wait_for_buffer(stream_t* const p_stream,
+                     const size_t index,
+                     const buffer_state_t state)
+{
+    pthread_mutex_lock(&(p_stream->lock));
+    while (p_stream->buffers[index].state != state && !p_stream->failed)
+    {
+        pthread_cond_wait(&(p_stream->changed), &(p_stream->lock));
+    }
+    bool ok = !p_stream->failed;
+    pthread_mutex_unlock(&(p_stream->lock));
+    
+    return ok;
+}
+
+void set_buffer_state(stream_t* const p_stream,
+                      const size_t index,
+                      const buffer_state_t state)
+{
+    pthread_mutex_lock(&(p_stream->lock));
+    p_stream->buffers[index].state = state;
+    pthread_cond_broadcast(&(p_stream->changed));
+    pthread_mutex_unlock(&(p_stream->lock));
+}
+
+/* Stops every stage, so that none of them waits forever */
+void fail_stream(stream_t* const p_stream, const char* const p_message)
+{
+    perror(p_message);
+    
+    pthread_mutex_lock(&(p_stream->lock));
+    p_stream->failed = true;
+    pthread_cond_broadcast(&(p_stream->changed));
+    pthread_mutex_unlock(&(p_stream->lock));
+}
+
+void* stream_reader(void* pv_stream)
+{
+    stream_t* p_stream = (stream_t*) pv_stream;
+    uint64_t file_offset = 0;
+    
+    // One extra pass hands the encryption stage an empty buffer at the end
+    for (size_t i = 0; ; i = (i + 1) % STREAM_BUFFERS)
+    {
+        if (!wait_for_buffer(p_stream, i, BUFFER_FREE))
+        {
+            return NULL;
+        }
+        
+        stream_buffer_t* p_buffer = &(p_stream->buffers[i]);
+        size_t remaining = p_stream->p_input->size_bytes - file_offset;
+        p_buffer->file_offset = file_offset;
+        p_buffer->bytes = remaining < STREAM_BUFFER_BYTES ?
+                          remaining :
+                          STREAM_BUFFER_BYTES;
+        
+        // pread() may return less than asked for, so keep going
+        size_t done = 0;
+        while (done < p_buffer->bytes)
+        {
+            ssize_t result = pread(p_stream->p_input->fd,
+                                   (uint8_t*) p_buffer->p_data + done,
+                                   p_buffer->bytes - done,
+                                   file_offset + done);
+            if (result <= 0)
+            {
+                fail_stream(p_stream, "Error in pread() on input file");
+                return NULL;
+            }
+            done += result;
+        }
+        
+        file_offset += p_buffer->bytes;
+        set_buffer_state(p_stream, i, BUFFER_READ);
+        
+        if (p_buffer->bytes == 0)
+        {
+            return NULL;
+        }
+    }
+}
+
+void* stream_writer(void* pv_stream)
+{
+    stream_t* p_stream = (stream_t*) pv_stream;
+    
+    for (size_t i = 0; ; i = (i + 1) % STREAM_BUFFERS)
+    {
+        if (!wait_for_buffer(p_stream, i, BUFFER_ENCRYPTED))
+        {
+            return NULL;
+        }
+        
+        stream_buffer_t* p_buffer = &(p_stream->buffers[i]);
+        if (p_buffer->bytes == 0)
+        {
+            return NULL;
+        }
+        
+        size_t done = 0;
+        while (done < p_buffer->bytes)
+        {
+            ssize_t result = pwrite(p_stream->p_output->fd,
+                                    (uint8_t*) p_buffer->p_data + done,
+                                    p_buffer->bytes - done,
+                                    p_buffer->file_offset + done);
+            if (result <= 0)
+            {
+                fail_stream(p_stream, "Error in pwrite() on output file");
+                return NULL;
+            }
+            done += result;
+        }
+        
+        set_buffer_state(p_stream, i, BUFFER_FREE);
+    }
+}
+
+/*
+ * Encrypts p_input into p_output (opened with open_files_streaming())
+ * through the ring of buffers, running p_job on each buffer.  Returns
+ * false if reading or writing failed.
+ */
+bool stream_files(aes_file_t* const p_input,
+                  aes_file_t* const p_output,
+                  const buffer_job_t* const p_job)
+{
+    stream_t stream;
+    stream.p_input = p_input;
+    stream.p_output = p_output;
+    stream.failed = false;
+    pthread_mutex_init(&(stream.lock), NULL);
+    pthread_cond_init(&(stream.changed), NULL);
+    
+    bool ok = true;
+    for (size_t i = 0; i < STREAM_BUFFERS; ++i)
+    {
+        // Page aligned, so that the same buffers would suit O_DIRECT
+        stream.buffers[i].p_data = alloc_staging_buffer(STREAM_BUFFER_BYTES,
+                                                        p_job->map_hints);
+        stream.buffers[i].state = BUFFER_FREE;
+        ok = ok && stream.buffers[i].p_data != NULL;
+    }
+    
+    pthread_t reader;
+    pthread_t writer;
+    if (!ok)
+    {
+        fail_stream(&stream, "Error in mmap()");
+    }
+    else if (pthread_create(&reader, NULL, stream_reader, &stream) != 0)
+    {
+        fail_stream(&stream, "Error in pthread_create()");
+        ok = false;
+    }
+    else if (pthread_create(&writer, NULL, stream_writer, &stream) != 0)
+    {
+        fail_stream(&stream, "Error in pthread_create()");
+        pthread_join(reader, NULL);
+        ok = false;
+    }
+    
+    for (size_t i = 0; ok; i = (i + 1) % STREAM_BUFFERS)
+    {
+        if (!wait_for_buffer(&stream, i, BUFFER_READ))
+        {
+            break;
+        }
+        
+        // An empty buffer passes on to the writer to tell it to stop
+        stream_buffer_t* p_buffer = &(stream.buffers[i]);
+        if (p_buffer->bytes == 0)
+        {
+            set_buffer_state(&stream, i, BUFFER_ENCRYPTED);
+            break;
+        }
+        
+        if (!encrypt_buffer(p_job,
+                            p_buffer->p_data,
+                            p_buffer->file_offset,
+                            p_buffer->bytes))
+        {
+            fail_stream(&stream, "Error in calloc()");
+            break;
+        }
+        
+        set_buffer_state(&stream, i, BUFFER_ENCRYPTED);
+    }
+    
+    if (ok)
+    {
+        pthread_join(reader, NULL);
+        pthread_join(writer, NULL);
+    }
+    
+    for (size_t i = 0; i < STREAM_BUFFERS; ++i)
+    {
+        free_staging_buffer(stream.buffers[i].p_data, STREAM_BUFFER_BYTES);
+    }
+    pthread_cond_destroy(&(stream.changed));
+    pthread_mutex_destroy(&(stream.lock));
+    
+    return ok && !stream.failed;
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "aes.h"
+#include "file_utils.h"
+
+/**
+ *  In-memory input for -S, so that kernel throughput can be measured
+ *  without files or storage.  The input is filled with pseudorandom data
+ *  and both buffers are faulted in before the run, so encryption only
+ *  sees memory that is already mapped.
+ *
+ *  With an alignment, each buffer starts on a multiple of it but not of
+ *  twice it, so -A 64 gives cache line aligned buffers that are not page
+ *  aligned.  With a node, the pages are bound to that NUMA node.
+ */
+
+#define SYNTHETIC_NO_NODE (-1)
+
+/* Nodes that bind_to_node() can name: the bits of its unsigned long mask */
+#define SYNTHETIC_MAX_NODES 64
+
+typedef struct synthetic_t {
+    void* p_mappings[2];    /* Input, output */
+    size_t mapping_bytes;
+} synthetic_t;
+
+/*
+ * Parses a byte count with an optional K, M or G suffix (powers of 1024).
+ * Returns 0 if it is not one.
+ */
+size_t parse_size(const char* const p_arg)
+{
+    char* p_end;
+    unsigned long long size = strtoull(p_arg, &p_end, 10);
+    if (p_end == p_arg)
+    {
+        return 0;
+    }
+    
+    switch (*p_end)
+    {
+        case 'G':
+            size *= 1024;
+            // Fall through
+        case 'M':
+            size *= 1024;
+            // Fall through
+        case 'K':
+            size *= 1024;
+            p_end += 1;
+            break;
+    }
+    
+    return *p_end == '\0' ? (size_t) size : 0;
+}
+
+/* Fills bytes with a xorshift64 stream, so that the input is not all zero */
+void fill_pseudorandom(uint8_t* const p_data, const size_t bytes)
+{
+    uint64_t state = 0x2b7e151628aed2a6ull;
+    for (size_t i = 0; i < bytes; i += sizeof(state))
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        
+        size_t length = bytes - i < sizeof(state) ? bytes - i : sizeof(state);
+        memcpy(p_data + i, &state, length);
+    }
+}
+
+/* Binds a mapping to node; pages that are already there are moved */
+bool bind_to_node(void* const p_data, const size_t bytes, const int node)
+{
+    unsigned long node_mask = 1ul << node;
+    return syscall(SYS_mbind,
+                   p_data,
+                   bytes,
+                   MPOL_BIND,
+                   &node_mask,
+                   sizeof(node_mask)*8,
+                   MPOL_MF_MOVE) == 0;
+}
+
+/*
+ * Allocates input and output buffers of bytes each and fills the input.
+ * align is a power of two of at least CACHE_LINE_SIZE, node a NUMA node
+ * or SYNTHETIC_NO_NODE, and map_hints as for open_files().
+ * Exits through print_usage_and_cleanup() on failure.
+ */
+void open_synthetic(const size_t bytes,
+                    const size_t align,
+                    const int node,
+                    const unsigned map_hints,
+                    synthetic_t* const p_synthetic,
+                    aes_file_t* p_infile,
+                    aes_file_t* p_outfile)
+{
+    // Room to move the start up to a multiple of 2*align, then on by align
+    p_synthetic->mapping_bytes = bytes + 3*align;
+    
+    aes_file_t* files[2] = {p_infile, p_outfile};
+    for (int i = 0; i < 2; ++i)
+    {
+        uint8_t* p_mapping = alloc_staging_buffer(p_synthetic->mapping_bytes,
+                                                  map_hints);
+        p_synthetic->p_mappings[i] = p_mapping;
+        if (p_mapping == NULL)
+        {
+            perror("Error in mmap()");
+            print_usage_and_cleanup(p_infile, p_outfile);
+        }
+        
+        if (node != SYNTHETIC_NO_NODE &&
+            !bind_to_node(p_mapping, p_synthetic->mapping_bytes, node))
+        {
+            perror("Error in mbind()");
+            print_usage_and_cleanup(p_infile, p_outfile);
+        }
+        
+        uintptr_t start = ((uintptr_t) p_mapping + 2*align - 1) & ~(2*align - 1);
+        files[i]->p_data = (block_vector_t*) (start + align);
+        files[i]->size_blocks = bytes / sizeof(block_vector_t);
+        files[i]->size_bytes = bytes;
+        files[i]->fd = -1;
+    }
+    
+    fill_pseudorandom((uint8_t*) p_infile->p_data, bytes);
+    memset(p_outfile->p_data, 0, bytes);
+}
+
+/* Frees what open_synthetic() allocated; close_files() must not be used */
+void close_synthetic(synthetic_t* const p_synthetic,
+                     aes_file_t* p_infile,
+                     aes_file_t* p_outfile)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        free_staging_buffer(p_synthetic->p_mappings[i],
+                            p_synthetic->mapping_bytes);
+        p_synthetic->p_mappings[i] = NULL;
+    }
+    p_infile->p_data = NULL;
+    p_outfile->p_data = NULL;
+}
+
+#endif
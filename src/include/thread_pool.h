@@ -0,0 +1,544 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sched.h>      // CPU affinity needs _GNU_SOURCE
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "aes.h"
+
+/**
+ *  A pool of worker threads that stay alive between runs.  A run is a list
+ *  of tasks (one thread_args_t per chunk of the file) and a function to
+ *  apply to each of them.  The tasks are dealt out in contiguous ranges,
+ *  one range per worker.  A worker takes tasks from the front of its own
+ *  range, and once that is empty it steals from the back of the others,
+ *  so a slow core only holds up the chunk it is working on.
+ *
+ *  Each range is a single 64-bit word (next task, end) updated with
+ *  compare-and-swap, so the owner and thieves never need a lock.
+ *
+ *  Workers can be pinned to cores, dealt round robin across NUMA nodes.
+ *  A pinned worker steals from workers on its own node first.  Placement
+ *  of the mappings is by first touch: the kernel puts a page on the node
+ *  of the thread that faults it in, so thread_pool_first_touch() has each
+ *  worker fault in the pages of the chunks it was dealt.
+ */
+
+/* 256 KiB; a whole number of cache lines and of either XTS sector size */
+#define POOL_CHUNK_BLOCKS 16384
+
+/* Marks a range with no tasks left */
+#define POOL_NO_TASK SIZE_MAX
+
+/* Highest NUMA node number that is looked for */
+#define POOL_MAX_NODES 64
+
+#define PAGE_SIZE_BYTES 4096
+
+typedef void* (*task_function_t)(void*);
+
+/* Padded so that workers never share a cache line */
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) task_range_t {
+    _Atomic uint64_t range; /* Next task in the low 32 bits, end in the high */
+} task_range_t;
+
+typedef struct thread_pool_t thread_pool_t;
+
+typedef struct worker_t {
+    thread_pool_t* p_pool;
+    long index;
+    int cpu;            /* -1 if not pinned */
+    int node;           /* NUMA node of cpu, 0 if not pinned */
+    pid_t tid;          /* Kernel thread ID, for per-thread counters */
+    uint64_t bytes;     /* Encrypted in every run so far */
+} worker_t;
+
+struct thread_pool_t {
+    long thread_count;
+    pthread_t* p_threads;
+    worker_t* p_workers;
+    task_range_t* p_ranges;
+    
+    // Protects everything below
+    pthread_mutex_t lock;
+    pthread_cond_t start;           /* Signalled when a run begins */
+    pthread_cond_t done;            /* Signalled when the last worker ends */
+    uint64_t generation;            /* Counts runs, so workers see new ones */
+    long busy_count;                /* Workers still in the current run */
+    bool shutdown;
+    
+    // The current run
+    task_function_t function;
+    thread_args_t* p_tasks;
+    uint64_t run_ns;                /* Wall time of every run so far */
+};
+
+static inline uint64_t pack_range(const uint64_t next, const uint64_t end)
+{
+    return next | (end << 32);
+}
+
+/*
+ * The owner takes the task at the front of its range, so that it walks
+ * through memory in order.
+ */
+size_t take_own_task(task_range_t* const p_range)
+{
+    uint64_t range = atomic_load(&(p_range->range));
+    for (;;)
+    {
+        uint64_t next = range & UINT32_MAX;
+        uint64_t end = range >> 32;
+        if (next >= end)
+        {
+            return POOL_NO_TASK;
+        }
+        
+        // On failure, range is reloaded and the loop tries again
+        if (atomic_compare_exchange_weak(&(p_range->range),
+                                         &range,
+                                         pack_range(next + 1, end)))
+        {
+            return next;
+        }
+    }
+}
+
+/*
+ * A thief takes the task at the back of the range, the one the owner
+ * would otherwise reach last.
+ */
+size_t steal_task(task_range_t* const p_range)
+{
+    uint64_t range = atomic_load(&(p_range->range));
+    for (;;)
+    {
+        uint64_t next = range & UINT32_MAX;
+        uint64_t end = range >> 32;
+        if (next >= end)
+        {
+            return POOL_NO_TASK;
+        }
+        
+        if (atomic_compare_exchange_weak(&(p_range->range),
+                                         &range,
+                                         pack_range(next, end - 1)))
+        {
+            return end - 1;
+        }
+    }
+}
+
+size_t next_task(thread_pool_t* const p_pool, const long index)
+{
+    size_t task = take_own_task(&(p_pool->p_ranges[index]));
+    int node = p_pool->p_workers[index].node;
+    
+    // Try the other workers, starting with the next one along.  The first
+    // pass only visits workers on this node, to keep memory traffic local.
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (long i = 1; task == POOL_NO_TASK && i < p_pool->thread_count; ++i)
+        {
+            long victim = (index + i) % p_pool->thread_count;
+            bool local = p_pool->p_workers[victim].node == node;
+            if (local == (pass == 0))
+            {
+                task = steal_task(&(p_pool->p_ranges[victim]));
+            }
+        }
+    }
+    
+    return task;
+}
+
+void* pool_worker(void* pv_worker)
+{
+    worker_t* p_worker = (worker_t*) pv_worker;
+    thread_pool_t* p_pool = p_worker->p_pool;
+    uint64_t seen_generation = 0;
+    p_worker->tid = (pid_t) syscall(SYS_gettid);
+    
+    for (;;)
+    {
+        pthread_mutex_lock(&(p_pool->lock));
+        while (p_pool->generation == seen_generation && !p_pool->shutdown)
+        {
+            pthread_cond_wait(&(p_pool->start), &(p_pool->lock));
+        }
+        if (p_pool->shutdown)
+        {
+            pthread_mutex_unlock(&(p_pool->lock));
+            return NULL;
+        }
+        seen_generation = p_pool->generation;
+        task_function_t function = p_pool->function;
+        thread_args_t* p_tasks = p_pool->p_tasks;
+        pthread_mutex_unlock(&(p_pool->lock));
+        
+        // Tasks are never added during a run, so once every range is
+        // empty this worker is finished
+        size_t task;
+        while ((task = next_task(p_pool, p_worker->index)) != POOL_NO_TASK)
+        {
+            function((void*) &(p_tasks[task]));
+            p_worker->bytes += p_tasks[task].count*sizeof(block_vector_t) +
+                               p_tasks[task].tail_bytes;
+        }
+        
+        pthread_mutex_lock(&(p_pool->lock));
+        p_pool->busy_count -= 1;
+        if (p_pool->busy_count == 0)
+        {
+            pthread_cond_signal(&(p_pool->done));
+        }
+        pthread_mutex_unlock(&(p_pool->lock));
+    }
+}
+
+/* Returns the NUMA node of cpu, or 0 if the kernel does not say */
+int cpu_node(const int cpu)
+{
+    char path[64];
+    for (int node = 0; node < POOL_MAX_NODES; ++node)
+    {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpu%d", node, cpu);
+        if (access(path, F_OK) == 0)
+        {
+            return node;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Chooses a CPU for each worker from the ones this process may run on.
+ * Nodes take turns, so that a few workers are spread over every socket
+ * instead of filling the first one.
+ */
+void choose_cpus(worker_t* const p_workers, const long thread_count)
+{
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    
+    int cpus[CPU_SETSIZE];
+    int nodes[CPU_SETSIZE];
+    bool taken[CPU_SETSIZE];
+    int cpu_count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            cpus[cpu_count] = cpu;
+            nodes[cpu_count] = cpu_node(cpu);
+            taken[cpu_count] = false;
+            cpu_count += 1;
+        }
+    }
+    
+    // Each turn gives every node its lowest free CPU; after every CPU is
+    // taken, start again and put several workers on each
+    int node = 0;
+    int free_count = cpu_count;
+    for (long i = 0; i < thread_count; ++i)
+    {
+        if (free_count == 0)
+        {
+            for (int c = 0; c < cpu_count; ++c)
+            {
+                taken[c] = false;
+            }
+            free_count = cpu_count;
+        }
+        
+        // Find the next node (in number order) that still has a free CPU
+        int chosen = -1;
+        for (int step = 0; chosen < 0 && step < POOL_MAX_NODES; ++step)
+        {
+            int want = (node + step) % POOL_MAX_NODES;
+            for (int c = 0; c < cpu_count; ++c)
+            {
+                if (!taken[c] && nodes[c] == want)
+                {
+                    chosen = c;
+                    node = want + 1;
+                    break;
+                }
+            }
+        }
+        
+        taken[chosen] = true;
+        free_count -= 1;
+        p_workers[i].cpu = cpus[chosen];
+        p_workers[i].node = nodes[chosen];
+    }
+}
+
+/*
+ * Applies function to every task and returns when all of them are done.
+ * Tasks must not share a cache line of output.
+ */
+void thread_pool_run(thread_pool_t* const p_pool,
+                     const task_function_t function,
+                     thread_args_t* const p_tasks,
+                     const size_t task_count)
+{
+    // Deal the tasks out in contiguous ranges, one per worker
+    uint64_t thread_count = (uint64_t) p_pool->thread_count;
+    for (uint64_t i = 0; i < thread_count; ++i)
+    {
+        atomic_store(&(p_pool->p_ranges[i].range),
+                     pack_range(i*task_count/thread_count,
+                                (i + 1)*task_count/thread_count));
+    }
+    
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    
+    pthread_mutex_lock(&(p_pool->lock));
+    p_pool->function = function;
+    p_pool->p_tasks = p_tasks;
+    p_pool->busy_count = p_pool->thread_count;
+    p_pool->generation += 1;
+    pthread_cond_broadcast(&(p_pool->start));
+    
+    while (p_pool->busy_count > 0)
+    {
+        pthread_cond_wait(&(p_pool->done), &(p_pool->lock));
+    }
+    pthread_mutex_unlock(&(p_pool->lock));
+    
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    p_pool->run_ns += (end_time.tv_sec - start_time.tv_sec)*1000000000ull +
+                      end_time.tv_nsec - start_time.tv_nsec;
+}
+
+/*
+ * Returns false if the workers could not be started.  With pin set, each
+ * worker is started on its own core (see choose_cpus()).
+ */
+bool thread_pool_create(thread_pool_t* const p_pool,
+                        const long thread_count,
+                        const bool pin)
+{
+    p_pool->thread_count = thread_count;
+    p_pool->p_threads = calloc(thread_count, sizeof(pthread_t));
+    p_pool->p_workers = calloc(thread_count, sizeof(worker_t));
+    p_pool->p_ranges = aligned_alloc(CACHE_LINE_SIZE,
+                                     thread_count*sizeof(task_range_t));
+    p_pool->generation = 0;
+    p_pool->busy_count = 0;
+    p_pool->shutdown = false;
+    p_pool->function = NULL;
+    p_pool->p_tasks = NULL;
+    p_pool->run_ns = 0;
+    pthread_mutex_init(&(p_pool->lock), NULL);
+    pthread_cond_init(&(p_pool->start), NULL);
+    pthread_cond_init(&(p_pool->done), NULL);
+    
+    if (p_pool->p_threads == NULL ||
+        p_pool->p_workers == NULL ||
+        p_pool->p_ranges == NULL)
+    {
+        p_pool->thread_count = 0;
+        return false;
+    }
+    
+    for (long i = 0; i < thread_count; ++i)
+    {
+        p_pool->p_workers[i].cpu = -1;
+        p_pool->p_workers[i].node = 0;
+    }
+    if (pin)
+    {
+        choose_cpus(p_pool->p_workers, thread_count);
+    }
+    
+    for (long i = 0; i < thread_count; ++i)
+    {
+        atomic_init(&(p_pool->p_ranges[i].range), 0);
+        p_pool->p_workers[i].p_pool = p_pool;
+        p_pool->p_workers[i].index = i;
+        p_pool->p_workers[i].bytes = 0;
+        
+        // A pinned worker starts on its core, so it never runs elsewhere
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (p_pool->p_workers[i].cpu >= 0)
+        {
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            CPU_SET(p_pool->p_workers[i].cpu, &cpu_set);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set), &cpu_set);
+        }
+        
+        int result = pthread_create(&(p_pool->p_threads[i]),
+                                    &attr,
+                                    pool_worker,
+                                    (void*) &(p_pool->p_workers[i]));
+        pthread_attr_destroy(&attr);
+        if (result != 0)
+        {
+            // Only wait for the workers that did start
+            p_pool->thread_count = i;
+            return false;
+        }
+    }
+    
+    // An empty run returns once every worker is waiting for work, and so
+    // has set its tid
+    thread_pool_run(p_pool, NULL, NULL, 0);
+    p_pool->run_ns = 0;
+    
+    return true;
+}
+
+/*
+ * Reads the input and writes the output once per page, so that the pages
+ * are faulted in by the worker the chunk is dealt to.  The encryption
+ * overwrites the output afterwards.
+ */
+void* first_touch_chunk(void* pv_args)
+{
+    thread_args_t* p_args = (thread_args_t*) pv_args;
+    
+    volatile uint8_t* p_in = (volatile uint8_t*) (p_args->p_input->p_data +
+                                                  p_args->offset);
+    uint8_t* p_out = (uint8_t*) (p_args->p_output->p_data + p_args->offset);
+    size_t bytes = p_args->count*sizeof(block_vector_t) + p_args->tail_bytes;
+    
+    for (size_t i = 0; i < bytes; i += PAGE_SIZE_BYTES)
+    {
+        p_out[i] = p_in[i];
+    }
+    
+    return NULL;
+}
+
+/*
+ * Places each worker's share of the mappings on its NUMA node.  Run this
+ * with the same tasks as the encryption, so that the workers are dealt
+ * the same chunks.  Stolen chunks end up on the thief's node.
+ */
+void thread_pool_first_touch(thread_pool_t* const p_pool,
+                             thread_args_t* const p_tasks,
+                             const size_t task_count)
+{
+    thread_pool_run(p_pool, first_touch_chunk, p_tasks, task_count);
+    
+    // Only count the encryption in the throughput
+    p_pool->run_ns = 0;
+    for (long i = 0; i < p_pool->thread_count; ++i)
+    {
+        p_pool->p_workers[i].bytes = 0;
+    }
+}
+
+/* Prints how much of the runs so far each NUMA node did, and how fast */
+void print_node_throughput(const thread_pool_t* const p_pool)
+{
+    for (int node = 0; node < POOL_MAX_NODES; ++node)
+    {
+        long threads = 0;
+        uint64_t bytes = 0;
+        for (long i = 0; i < p_pool->thread_count; ++i)
+        {
+            if (p_pool->p_workers[i].node == node)
+            {
+                threads += 1;
+                bytes += p_pool->p_workers[i].bytes;
+            }
+        }
+        
+        if (threads > 0)
+        {
+            // Bytes per nanosecond is GB/s
+            printf("Node %d: %ld threads, %lu bytes, %.3f GB/s\n",
+                   node,
+                   threads,
+                   bytes,
+                   p_pool->run_ns > 0 ? (double) bytes / p_pool->run_ns : 0.0);
+        }
+    }
+}
+
+void thread_pool_destroy(thread_pool_t* const p_pool)
+{
+    pthread_mutex_lock(&(p_pool->lock));
+    p_pool->shutdown = true;
+    pthread_cond_broadcast(&(p_pool->start));
+    pthread_mutex_unlock(&(p_pool->lock));
+    
+    for (long i = 0; i < p_pool->thread_count; ++i)
+    {
+        pthread_join(p_pool->p_threads[i], NULL);
+    }
+    
+    pthread_cond_destroy(&(p_pool->done));
+    pthread_cond_destroy(&(p_pool->start));
+    pthread_mutex_destroy(&(p_pool->lock));
+    free(p_pool->p_ranges);
+    free(p_pool->p_workers);
+    free(p_pool->p_threads);
+}
+
+/*
+ * Cuts the input into tasks of chunk_blocks blocks each, in file order.
+ * The last task takes whatever is left, including a final partial block.
+ * Returns the number of tasks, and the array in *pp_tasks (free it after).
+ */
+size_t split_into_chunks(aes_file_t* const p_input,
+                         aes_file_t* const p_output,
+                         key_schedule_t* const p_key_sched,
+                         const uint64_t nonce,
+                         const size_t chunk_blocks,
+                         thread_args_t** const pp_tasks)
+{
+    size_t total_blocks = p_input->size_blocks;
+    size_t task_count = (total_blocks + chunk_blocks - 1) / chunk_blocks;
+    if (task_count == 0)
+    {
+        // Input shorter than a block still needs a task for the tail
+        task_count = 1;
+    }
+    
+    thread_args_t* p_tasks = calloc(task_count, sizeof(thread_args_t));
+    for (size_t i = 0; i < task_count && p_tasks != NULL; ++i)
+    {
+        p_tasks[i].p_input = p_input;
+        p_tasks[i].p_output = p_output;
+        p_tasks[i].p_key_sched = p_key_sched;
+        p_tasks[i].base = 0;
+        p_tasks[i].offset = i*chunk_blocks;
+        p_tasks[i].count = total_blocks - p_tasks[i].offset < chunk_blocks ?
+                           total_blocks - p_tasks[i].offset :
+                           chunk_blocks;
+        p_tasks[i].tail_bytes = 0;
+        p_tasks[i].nonce = nonce;
+        p_tasks[i].ghash = _mm_setzero_si128();
+    }
+    
+    if (p_tasks != NULL)
+    {
+        p_tasks[task_count-1].tail_bytes = p_input->size_bytes %
+                                           sizeof(block_vector_t);
+    }
+    
+    *pp_tasks = p_tasks;
+    return task_count;
+}
+
+#endif
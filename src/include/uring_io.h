@@ -0,0 +1,494 @@
+#ifndef URINGIO_H
+#define URINGIO_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "aes.h"
+#include "file_utils.h"
+#include "stream_io.h"
+
+// linux/fs.h, which this pulls in, has its own BLOCK_SIZE (1 KiB).  Keep
+// the one from aes.h, or every size derived from it silently changes.
+#pragma push_macro("BLOCK_SIZE")
+#include <linux/io_uring.h>
+#pragma pop_macro("BLOCK_SIZE")
+
+/**
+ *  io_uring I/O with O_DIRECT, so that reads and writes skip the page
+ *  cache and go straight between the device and the buffers.  The ring is
+ *  set up with the raw system calls, so there is no liburing dependency.
+ *
+ *  URING_BUFFERS buffers are registered with the kernel once (fixed
+ *  buffers, so pages are not pinned again on every request).  Reads are
+ *  queued on every free buffer, so several are in flight while the pool
+ *  encrypts.  Buffers are encrypted in file order, since GCM folds its
+ *  hash in order, and then written back from the same buffer.
+ *
+ *  O_DIRECT needs offsets and lengths aligned to the device block size.
+ *  Buffers are a multiple of URING_ALIGN, the last read and write are
+ *  rounded up, and the output is truncated to the input size at the end.
+ *  If the file system refuses O_DIRECT, the files are opened without it.
+ */
+
+#define URING_BUFFERS      8
+#define URING_BUFFER_BYTES (16*POOL_CHUNK_BLOCKS*sizeof(block_vector_t))
+#define URING_ALIGN        4096
+
+typedef enum uring_state_t {
+    URING_FREE,
+    URING_READING,
+    URING_READ,         /* Waiting to be encrypted */
+    URING_WRITING,
+} uring_state_t;
+
+typedef struct uring_buffer_t {
+    block_vector_t* p_data;
+    uint64_t file_offset;   /* In bytes */
+    size_t bytes;           /* File bytes held, without the rounding */
+    size_t io_bytes;        /* Rounded up to URING_ALIGN */
+    size_t done;            /* Bytes of the current request completed */
+    uring_state_t state;
+} uring_buffer_t;
+
+/* The shared rings, as mapped from the kernel */
+typedef struct uring_t {
+    int fd;
+    bool fixed;             /* Buffers are registered */
+    unsigned submit_count;  /* Queued but not yet passed to the kernel */
+    
+    _Atomic unsigned* p_sq_head;
+    _Atomic unsigned* p_sq_tail;
+    unsigned sq_mask;
+    unsigned* p_sq_array;
+    struct io_uring_sqe* p_sqes;
+    
+    _Atomic unsigned* p_cq_head;
+    _Atomic unsigned* p_cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* p_cqes;
+    
+    void* p_sq_ring;
+    size_t sq_ring_bytes;
+    void* p_cq_ring;
+    size_t cq_ring_bytes;
+    size_t sqes_bytes;
+} uring_t;
+
+/* Opens fd with O_DIRECT if the file system allows it */
+int open_direct(const char* const p_filename, const int flags)
+{
+    int fd = open(p_filename, flags | O_DIRECT, S_IRUSR | S_IWUSR);
+    if (fd < 0 && errno == EINVAL)
+    {
+        printf("O_DIRECT is not supported for %s; using the page cache\n",
+               p_filename);
+        fd = open(p_filename, flags, S_IRUSR | S_IWUSR);
+    }
+    
+    return fd;
+}
+
+/*
+ * Like open_files(), but opens the files for O_DIRECT and does not map
+ * them, so p_data stays NULL.
+ */
+void open_files_uring(char* in_filename, char* out_filename,
+                      aes_file_t* p_infile, aes_file_t* p_outfile)
+{
+    int fd = open_direct(in_filename, O_RDONLY);
+    if (fd <= 0)
+    {
+        perror("Error in open() on input file");
+        print_usage_and_cleanup(p_infile, p_outfile);
+    }
+    p_infile->fd = fd;
+    
+    struct stat file_stats;
+    int success = fstat(fd, &file_stats);
+    if (success != 0)
+    {
+        perror("Error in stat() on input file");
+        print_usage_and_cleanup(p_infile, p_outfile);
+    }
+    else if (file_stats.st_size == 0)
+    {
+        printf("Input file is empty\n");
+        print_usage_and_cleanup(p_infile, p_outfile);
+    }
+    p_infile->size_blocks = file_stats.st_size / (WORD_SIZE*BLOCK_SIZE);
+    p_infile->size_bytes = file_stats.st_size;
+    
+    fd = open_direct(out_filename, O_CREAT | O_TRUNC | O_WRONLY);
+    if (fd <= 0)
+    {
+        perror("Error in open() on output file");
+        print_usage_and_cleanup(p_infile, p_outfile);
+    }
+    p_outfile->fd = fd;
+    p_outfile->size_blocks = p_infile->size_blocks;
+    p_outfile->size_bytes = p_infile->size_bytes;
+}
+
+void uring_destroy(uring_t* const p_ring)
+{
+    if (p_ring->p_sqes != NULL && p_ring->p_sqes != MAP_FAILED)
+    {
+        munmap(p_ring->p_sqes, p_ring->sqes_bytes);
+    }
+    if (p_ring->p_cq_ring != NULL && p_ring->p_cq_ring != MAP_FAILED &&
+        p_ring->p_cq_ring != p_ring->p_sq_ring)
+    {
+        munmap(p_ring->p_cq_ring, p_ring->cq_ring_bytes);
+    }
+    if (p_ring->p_sq_ring != NULL && p_ring->p_sq_ring != MAP_FAILED)
+    {
+        munmap(p_ring->p_sq_ring, p_ring->sq_ring_bytes);
+    }
+    if (p_ring->fd >= 0)
+    {
+        close(p_ring->fd);
+    }
+    
+    memset(p_ring, 0, sizeof(*p_ring));
+    p_ring->fd = -1;
+}
+
+/* Returns false, with errno set, if the ring could not be set up */
+bool uring_create(uring_t* const p_ring, const unsigned entries)
+{
+    memset(p_ring, 0, sizeof(*p_ring));
+    
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    p_ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (p_ring->fd < 0)
+    {
+        return false;
+    }
+    
+    p_ring->sq_ring_bytes = params.sq_off.array +
+                            params.sq_entries*sizeof(unsigned);
+    p_ring->cq_ring_bytes = params.cq_off.cqes +
+                            params.cq_entries*sizeof(struct io_uring_cqe);
+    p_ring->sqes_bytes = params.sq_entries*sizeof(struct io_uring_sqe);
+    
+    // Newer kernels share one mapping between the two rings
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && p_ring->cq_ring_bytes > p_ring->sq_ring_bytes)
+    {
+        p_ring->sq_ring_bytes = p_ring->cq_ring_bytes;
+    }
+    
+    p_ring->p_sq_ring = mmap(NULL, p_ring->sq_ring_bytes,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE,
+                             p_ring->fd, IORING_OFF_SQ_RING);
+    if (p_ring->p_sq_ring == MAP_FAILED)
+    {
+        int error = errno;
+        uring_destroy(p_ring);
+        errno = error;
+        return false;
+    }
+    
+    p_ring->p_cq_ring = p_ring->p_sq_ring;
+    if (!single_mmap)
+    {
+        p_ring->p_cq_ring = mmap(NULL, p_ring->cq_ring_bytes,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE,
+                                 p_ring->fd, IORING_OFF_CQ_RING);
+    }
+    p_ring->p_sqes = mmap(NULL, p_ring->sqes_bytes,
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE,
+                          p_ring->fd, IORING_OFF_SQES);
+    if (p_ring->p_cq_ring == MAP_FAILED || p_ring->p_sqes == MAP_FAILED)
+    {
+        int error = errno;
+        uring_destroy(p_ring);
+        errno = error;
+        return false;
+    }
+    
+    uint8_t* p_sq = (uint8_t*) p_ring->p_sq_ring;
+    p_ring->p_sq_head = (_Atomic unsigned*) (p_sq + params.sq_off.head);
+    p_ring->p_sq_tail = (_Atomic unsigned*) (p_sq + params.sq_off.tail);
+    p_ring->sq_mask = *(unsigned*) (p_sq + params.sq_off.ring_mask);
+    p_ring->p_sq_array = (unsigned*) (p_sq + params.sq_off.array);
+    
+    uint8_t* p_cq = (uint8_t*) p_ring->p_cq_ring;
+    p_ring->p_cq_head = (_Atomic unsigned*) (p_cq + params.cq_off.head);
+    p_ring->p_cq_tail = (_Atomic unsigned*) (p_cq + params.cq_off.tail);
+    p_ring->cq_mask = *(unsigned*) (p_cq + params.cq_off.ring_mask);
+    p_ring->p_cqes = (struct io_uring_cqe*) (p_cq + params.cq_off.cqes);
+    
+    return true;
+}
+
+/*
+ * Registers the buffers, so that requests can use them as fixed buffers.
+ * This counts against RLIMIT_MEMLOCK, so it is allowed to fail.
+ */
+bool uring_register_buffers(uring_t* const p_ring,
+                            const uring_buffer_t* const p_buffers,
+                            const size_t count)
+{
+    struct iovec iovecs[URING_BUFFERS];
+    for (size_t i = 0; i < count; ++i)
+    {
+        iovecs[i].iov_base = p_buffers[i].p_data;
+        iovecs[i].iov_len = URING_BUFFER_BYTES;
+    }
+    
+    p_ring->fixed = syscall(__NR_io_uring_register,
+                            p_ring->fd,
+                            IORING_REGISTER_BUFFERS,
+                            iovecs,
+                            (unsigned) count) == 0;
+    return p_ring->fixed;
+}
+
+/*
+ * Queues a read or write of the rest of buffer index.  The submission ring
+ * has a slot for every buffer, so it never fills up.
+ */
+void uring_queue(uring_t* const p_ring,
+                 const uring_buffer_t* const p_buffers,
+                 const size_t index,
+                 const int fd,
+                 const bool write)
+{
+    const uring_buffer_t* p_buffer = &(p_buffers[index]);
+    
+    unsigned tail = atomic_load_explicit(p_ring->p_sq_tail,
+                                         memory_order_relaxed);
+    unsigned slot = tail & p_ring->sq_mask;
+    struct io_uring_sqe* p_sqe = &(p_ring->p_sqes[slot]);
+    memset(p_sqe, 0, sizeof(*p_sqe));
+    
+    if (p_ring->fixed)
+    {
+        p_sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        p_sqe->buf_index = (uint16_t) index;
+    }
+    else
+    {
+        p_sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    p_sqe->fd = fd;
+    p_sqe->addr = (uint64_t) ((uint8_t*) p_buffer->p_data + p_buffer->done);
+    p_sqe->len = (uint32_t) (p_buffer->io_bytes - p_buffer->done);
+    p_sqe->off = p_buffer->file_offset + p_buffer->done;
+    p_sqe->user_data = index;
+    
+    p_ring->p_sq_array[slot] = slot;
+    atomic_store_explicit(p_ring->p_sq_tail, tail + 1, memory_order_release);
+    p_ring->submit_count += 1;
+}
+
+/*
+ * Passes queued requests to the kernel and, if wait is set, blocks until
+ * at least one has completed.  Returns false on an error.
+ */
+bool uring_submit(uring_t* const p_ring, const bool wait)
+{
+    for (;;)
+    {
+        int result = (int) syscall(__NR_io_uring_enter,
+                                   p_ring->fd,
+                                   p_ring->submit_count,
+                                   wait ? 1 : 0,
+                                   wait ? IORING_ENTER_GETEVENTS : 0,
+                                   NULL,
+                                   0);
+        if (result >= 0)
+        {
+            p_ring->submit_count -= (unsigned) result;
+            return true;
+        }
+        if (errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
+/*
+ * Encrypts p_input into p_output (opened with open_files_uring()) through
+ * io_uring, running p_job on each buffer.  Returns false if any I/O
+ * failed.
+ */
+bool uring_files(aes_file_t* const p_input,
+                 aes_file_t* const p_output,
+                 const buffer_job_t* const p_job)
+{
+    uring_buffer_t buffers[URING_BUFFERS];
+    bool ok = true;
+    for (size_t i = 0; i < URING_BUFFERS; ++i)
+    {
+        // mmap() memory is page aligned, which covers URING_ALIGN
+        buffers[i].p_data = alloc_staging_buffer(URING_BUFFER_BYTES,
+                                                 p_job->map_hints);
+        buffers[i].state = URING_FREE;
+        ok = ok && buffers[i].p_data != NULL;
+    }
+    
+    uring_t ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+    if (!ok)
+    {
+        perror("Error in mmap()");
+    }
+    else if (!uring_create(&ring, URING_BUFFERS))
+    {
+        perror("Error in io_uring_setup()");
+        ok = false;
+    }
+    else if (!uring_register_buffers(&ring, buffers, URING_BUFFERS))
+    {
+        perror("Buffers not registered with io_uring; using plain reads");
+    }
+    
+    uint64_t size_bytes = p_input->size_bytes;
+    uint64_t read_offset = 0;
+    uint64_t encrypt_offset = 0;
+    size_t writes_pending = 0;
+    
+    while (ok && (encrypt_offset < size_bytes || writes_pending > 0))
+    {
+        // Keep every free buffer busy reading ahead
+        for (size_t i = 0; i < URING_BUFFERS && read_offset < size_bytes; ++i)
+        {
+            if (buffers[i].state == URING_FREE)
+            {
+                size_t remaining = size_bytes - read_offset;
+                buffers[i].file_offset = read_offset;
+                buffers[i].bytes = remaining < URING_BUFFER_BYTES ?
+                                   remaining :
+                                   URING_BUFFER_BYTES;
+                buffers[i].io_bytes = (buffers[i].bytes + URING_ALIGN - 1) /
+                                      URING_ALIGN * URING_ALIGN;
+                buffers[i].done = 0;
+                buffers[i].state = URING_READING;
+                uring_queue(&ring, buffers, i, p_input->fd, false);
+                read_offset += buffers[i].bytes;
+            }
+        }
+        
+        // The buffer that comes next in the file may already be read
+        size_t next = URING_BUFFERS;
+        for (size_t i = 0; i < URING_BUFFERS; ++i)
+        {
+            if (buffers[i].state == URING_READ &&
+                buffers[i].file_offset == encrypt_offset)
+            {
+                next = i;
+            }
+        }
+        
+        // Hand the kernel the queued requests before encrypting, so the
+        // I/O runs alongside.  Only block if there is nothing to encrypt.
+        if (!uring_submit(&ring, next == URING_BUFFERS))
+        {
+            perror("Error in io_uring_enter()");
+            ok = false;
+            break;
+        }
+        
+        if (next < URING_BUFFERS)
+        {
+            if (!encrypt_buffer(p_job,
+                                buffers[next].p_data,
+                                buffers[next].file_offset,
+                                buffers[next].bytes))
+            {
+                perror("Error in calloc()");
+                ok = false;
+                break;
+            }
+            encrypt_offset += buffers[next].bytes;
+            
+            buffers[next].done = 0;
+            buffers[next].state = URING_WRITING;
+            uring_queue(&ring, buffers, next, p_output->fd, true);
+            writes_pending += 1;
+        }
+        
+        // Collect whatever has completed
+        unsigned head = atomic_load_explicit(ring.p_cq_head,
+                                             memory_order_relaxed);
+        while (head != atomic_load_explicit(ring.p_cq_tail,
+                                            memory_order_acquire))
+        {
+            struct io_uring_cqe* p_cqe = &(ring.p_cqes[head & ring.cq_mask]);
+            uring_buffer_t* p_buffer = &(buffers[p_cqe->user_data]);
+            int result = p_cqe->res;
+            head += 1;
+            
+            if (result <= 0)
+            {
+                // A read can only end early at the end of the file
+                errno = result < 0 ? -result : EIO;
+                perror(p_buffer->state == URING_READING ?
+                       "Error in io_uring read on input file" :
+                       "Error in io_uring write on output file");
+                ok = false;
+                break;
+            }
+            
+            // A short transfer continues where it stopped
+            p_buffer->done += (size_t) result;
+            bool reading = p_buffer->state == URING_READING;
+            size_t needed = reading ? p_buffer->bytes : p_buffer->io_bytes;
+            if (p_buffer->done < needed)
+            {
+                uring_queue(&ring,
+                            buffers,
+                            p_cqe->user_data,
+                            reading ? p_input->fd : p_output->fd,
+                            !reading);
+            }
+            else if (reading)
+            {
+                p_buffer->state = URING_READ;
+            }
+            else
+            {
+                p_buffer->state = URING_FREE;
+                writes_pending -= 1;
+            }
+        }
+        atomic_store_explicit(ring.p_cq_head, head, memory_order_release);
+    }
+    
+    // The last write was rounded up to a whole URING_ALIGN
+    if (ok && ftruncate(p_output->fd, (off_t) size_bytes) != 0)
+    {
+        perror("Error in ftruncate() on output file");
+        ok = false;
+    }
+    
+    uring_destroy(&ring);
+    for (size_t i = 0; i < URING_BUFFERS; ++i)
+    {
+        free_staging_buffer(buffers[i].p_data, URING_BUFFER_BYTES);
+    }
+    
+    return ok;
+}
+
+#endif